@@ -0,0 +1,295 @@
+#ifndef ARKIN_PACK_H
+#define ARKIN_PACK_H
+
+// Loader for shader packs written with 'arkin_shader --pack'. A pack is
+// meant to be mapped as is: every table is an array of fixed size records
+// and every SPIR-V payload is aligned, so the pointers returned here can be
+// handed straight to vkCreateShaderModule.
+//
+// Layout, all integers little endian and all offsets from the file start:
+// ArkinPackHeader
+// ArkinPackEntry[entry_count], sorted by name, then stage
+// ArkinPackResource[resource_count]
+// ArkinPackType[type_count], the members of a type are contiguous
+// uint32_t[dimension_count], array dimension lengths
+// Strings, each null terminated
+// SPIR-V payloads, each aligned to ARKIN_PACK_SPV_ALIGN
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ARKIN_PACK_MAGIC 0x4b505341 // 'ASPK'
+#define ARKIN_PACK_VERSION 1
+#define ARKIN_PACK_SPV_ALIGN 16
+#define ARKIN_PACK_NONE 0xffffffff
+
+typedef enum {
+    ARKIN_PACK_STAGE_VERTEX,
+    ARKIN_PACK_STAGE_FRAGMENT,
+    ARKIN_PACK_STAGE_COMPUTE,
+} ArkinPackStage;
+
+typedef enum {
+    ARKIN_PACK_RESOURCE_UNIFORM_BUFFER,
+    ARKIN_PACK_RESOURCE_PUSH_CONSTANT,
+    ARKIN_PACK_RESOURCE_INPUT,
+    ARKIN_PACK_RESOURCE_OUTPUT,
+    ARKIN_PACK_RESOURCE_STORAGE_BUFFER,
+} ArkinPackResourceKind;
+
+// Same order as the types in the generated headers.
+typedef enum {
+    ARKIN_PACK_DATA_TYPE_UNKNOWN,
+
+    ARKIN_PACK_DATA_TYPE_VOID,
+    ARKIN_PACK_DATA_TYPE_STRUCT,
+    ARKIN_PACK_DATA_TYPE_SAMPLER,
+
+    ARKIN_PACK_DATA_TYPE_INT,
+    ARKIN_PACK_DATA_TYPE_UINT,
+    ARKIN_PACK_DATA_TYPE_FLOAT,
+    ARKIN_PACK_DATA_TYPE_DOUBLE,
+
+    ARKIN_PACK_DATA_TYPE_IVEC2,
+    ARKIN_PACK_DATA_TYPE_UVEC2,
+    ARKIN_PACK_DATA_TYPE_VEC2,
+    ARKIN_PACK_DATA_TYPE_DVEC2,
+
+    ARKIN_PACK_DATA_TYPE_IVEC3,
+    ARKIN_PACK_DATA_TYPE_UVEC3,
+    ARKIN_PACK_DATA_TYPE_VEC3,
+    ARKIN_PACK_DATA_TYPE_DVEC3,
+
+    ARKIN_PACK_DATA_TYPE_IVEC4,
+    ARKIN_PACK_DATA_TYPE_UVEC4,
+    ARKIN_PACK_DATA_TYPE_VEC4,
+    ARKIN_PACK_DATA_TYPE_DVEC4,
+
+    ARKIN_PACK_DATA_TYPE_MAT2,
+    ARKIN_PACK_DATA_TYPE_DMAT2,
+
+    ARKIN_PACK_DATA_TYPE_MAT3,
+    ARKIN_PACK_DATA_TYPE_DMAT3,
+
+    ARKIN_PACK_DATA_TYPE_MAT4,
+    ARKIN_PACK_DATA_TYPE_DMAT4,
+} ArkinPackDataType;
+
+typedef struct ArkinPackString {
+    uint32_t offset;
+    // Not counting the terminator.
+    uint32_t len;
+} ArkinPackString;
+
+typedef struct ArkinPackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t file_size;
+
+    uint32_t entry_count;
+    uint32_t entries_offset;
+    uint32_t resource_count;
+    uint32_t resources_offset;
+    uint32_t type_count;
+    uint32_t types_offset;
+    uint32_t dimension_count;
+    uint32_t dimensions_offset;
+    uint32_t strings_size;
+    uint32_t strings_offset;
+} ArkinPackHeader;
+
+// One stage of a program.
+typedef struct ArkinPackEntry {
+    // Program name.
+    ArkinPackString name;
+    // ArkinPackStage.
+    uint32_t stage;
+    uint32_t spv_offset;
+    // In bytes.
+    uint32_t spv_size;
+    uint32_t first_resource;
+    uint32_t resource_count;
+    uint32_t reserved;
+} ArkinPackEntry;
+
+typedef struct ArkinPackResource {
+    // ArkinPackResourceKind.
+    uint32_t kind;
+    // Stage inputs and outputs only, ARKIN_PACK_NONE otherwise.
+    uint32_t location;
+    uint32_t type;
+} ArkinPackResource;
+
+typedef struct ArkinPackType {
+    ArkinPackString name;
+    // ArkinPackDataType.
+    uint32_t data_type;
+    uint32_t vec_size;
+    uint32_t cols;
+    // Index into the array dimension lengths, 0 count if not an array.
+    uint32_t first_dimension;
+    uint32_t dimension_count;
+    // Index of the first member type.
+    uint32_t first_member;
+    uint32_t member_count;
+} ArkinPackType;
+
+typedef struct ArkinPack {
+    const uint8_t *data;
+    size_t size;
+    const ArkinPackHeader *header;
+    const ArkinPackEntry *entries;
+    const ArkinPackResource *resources;
+    const ArkinPackType *types;
+    const uint32_t *dimensions;
+    const char *strings;
+    // Set by arkin_pack_open.
+    void *mapping;
+} ArkinPack;
+
+static inline int arkin_pack_range_ok(size_t size, uint32_t offset, uint64_t count, uint64_t stride, uint32_t align) {
+    return offset % align == 0 && offset <= size && count * stride <= size - offset;
+}
+
+static inline int arkin_pack_string_ok(const ArkinPack *pack, ArkinPackString str) {
+    return (uint64_t) str.offset + str.len < pack->header->strings_size &&
+        pack->strings[str.offset + str.len] == '\0';
+}
+
+// Points 'pack' into 'data', which has to stay alive and be at least 4 byte
+// aligned. Every index and offset is checked here so that lookups don't have
+// to. Returns 0 if the data isn't a valid pack.
+static inline int arkin_pack_load(ArkinPack *pack, const void *data, size_t size) {
+    memset(pack, 0, sizeof(*pack));
+    if (size < sizeof(ArkinPackHeader) || (uintptr_t) data % 4 != 0) {
+        return 0;
+    }
+
+    const ArkinPackHeader *header = (const ArkinPackHeader *) data;
+    if (header->magic != ARKIN_PACK_MAGIC || header->version != ARKIN_PACK_VERSION || header->file_size != size) {
+        return 0;
+    }
+    if (!arkin_pack_range_ok(size, header->entries_offset, header->entry_count, sizeof(ArkinPackEntry), 4) ||
+            !arkin_pack_range_ok(size, header->resources_offset, header->resource_count, sizeof(ArkinPackResource), 4) ||
+            !arkin_pack_range_ok(size, header->types_offset, header->type_count, sizeof(ArkinPackType), 4) ||
+            !arkin_pack_range_ok(size, header->dimensions_offset, header->dimension_count, sizeof(uint32_t), 4) ||
+            !arkin_pack_range_ok(size, header->strings_offset, header->strings_size, 1, 1)) {
+        return 0;
+    }
+
+    const uint8_t *bytes = (const uint8_t *) data;
+    pack->data = bytes;
+    pack->size = size;
+    pack->header = header;
+    pack->entries = (const ArkinPackEntry *) (bytes + header->entries_offset);
+    pack->resources = (const ArkinPackResource *) (bytes + header->resources_offset);
+    pack->types = (const ArkinPackType *) (bytes + header->types_offset);
+    pack->dimensions = (const uint32_t *) (bytes + header->dimensions_offset);
+    pack->strings = (const char *) (bytes + header->strings_offset);
+
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        const ArkinPackEntry *entry = &pack->entries[i];
+        if (!arkin_pack_string_ok(pack, entry->name) ||
+                !arkin_pack_range_ok(size, entry->spv_offset, entry->spv_size, 1, ARKIN_PACK_SPV_ALIGN) ||
+                (uint64_t) entry->first_resource + entry->resource_count > header->resource_count) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->resource_count; i++) {
+        if (pack->resources[i].type >= header->type_count) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->type_count; i++) {
+        const ArkinPackType *type = &pack->types[i];
+        if (!arkin_pack_string_ok(pack, type->name) ||
+                (uint64_t) type->first_dimension + type->dimension_count > header->dimension_count ||
+                (uint64_t) type->first_member + type->member_count > header->type_count) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static inline const char *arkin_pack_string(const ArkinPack *pack, ArkinPackString str) {
+    return pack->strings + str.offset;
+}
+
+// Binary search over the sorted entries. Returns NULL if the program has no
+// such stage.
+static inline const ArkinPackEntry *arkin_pack_find(const ArkinPack *pack, const char *name, ArkinPackStage stage) {
+    size_t name_len = strlen(name);
+    uint32_t low = 0;
+    uint32_t high = pack->header->entry_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const ArkinPackEntry *entry = &pack->entries[mid];
+
+        size_t len = entry->name.len < name_len ? entry->name.len : name_len;
+        int cmp = memcmp(arkin_pack_string(pack, entry->name), name, len);
+        if (cmp == 0) {
+            cmp = (entry->name.len > name_len) - (entry->name.len < name_len);
+        }
+        if (cmp == 0) {
+            cmp = (entry->stage > (uint32_t) stage) - (entry->stage < (uint32_t) stage);
+        }
+
+        if (cmp == 0) {
+            return entry;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+static inline const uint32_t *arkin_pack_spv(const ArkinPack *pack, const ArkinPackEntry *entry) {
+    return (const uint32_t *) (pack->data + entry->spv_offset);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Maps the file read only. Returns 0 if it can't be opened or isn't a valid
+// pack.
+static inline int arkin_pack_open(ArkinPack *pack, const char *path) {
+    memset(pack, 0, sizeof(*pack));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+    if (!arkin_pack_load(pack, mapping, st.st_size)) {
+        munmap(mapping, st.st_size);
+        return 0;
+    }
+    pack->mapping = mapping;
+    return 1;
+}
+
+static inline void arkin_pack_close(ArkinPack *pack) {
+    if (pack->mapping != NULL) {
+        munmap(pack->mapping, pack->size);
+    }
+    memset(pack, 0, sizeof(*pack));
+}
+#endif
+
+#endif
@@ -3,4 +3,298 @@
 
 #include "arkin_core.h"
 
+// In-process compilation of arkin shader files, built as the 'arkin_shader_lib'
+// static library. Every function is thread safe and reentrant. Results and
+// errors are allocated on the arena passed in, nothing is logged.
+
+// NOTE: Booleans reflect into unsigned integers.
+// bool -> uint
+// bvec2 -> uvec2
+// bvec3 -> uvec3
+// bvec4 -> uvec4
+typedef enum {
+    REFLECTED_DATA_TYPE_UNKNOWN,
+
+    REFLECTED_DATA_TYPE_VOID,
+    REFLECTED_DATA_TYPE_STRUCT,
+    REFLECTED_DATA_TYPE_SAMPLER,
+
+    // Scalers
+    REFLECTED_DATA_TYPE_I32,
+    REFLECTED_DATA_TYPE_U32,
+    REFLECTED_DATA_TYPE_F32,
+    REFLECTED_DATA_TYPE_F64,
+
+    // Vectors
+    REFLECTED_DATA_TYPE_IVEC2,
+    REFLECTED_DATA_TYPE_UVEC2,
+    REFLECTED_DATA_TYPE_VEC2,
+    REFLECTED_DATA_TYPE_DVEC2,
+
+    REFLECTED_DATA_TYPE_IVEC3,
+    REFLECTED_DATA_TYPE_UVEC3,
+    REFLECTED_DATA_TYPE_VEC3,
+    REFLECTED_DATA_TYPE_DVEC3,
+
+    REFLECTED_DATA_TYPE_IVEC4,
+    REFLECTED_DATA_TYPE_UVEC4,
+    REFLECTED_DATA_TYPE_VEC4,
+    REFLECTED_DATA_TYPE_DVEC4,
+
+    // Matrices
+    REFLECTED_DATA_TYPE_MAT2,
+    REFLECTED_DATA_TYPE_DMAT2,
+
+    REFLECTED_DATA_TYPE_MAT3,
+    REFLECTED_DATA_TYPE_DMAT3,
+
+    REFLECTED_DATA_TYPE_MAT4,
+    REFLECTED_DATA_TYPE_DMAT4,
+
+    REFLECTED_DATA_TYPE_COUNT,
+} ReflectedDataType;
+
+typedef struct ReflectedType ReflectedType;
+struct ReflectedType {
+    ReflectedDataType data_type;
+    ArStr name;
+
+    // 0 if not an array.
+    U32 array_dimensions;
+    // Array of length 'array_dimensions'.
+    U32 *array_dimension_lengths;
+    // Array of length 'array_dimensions'. Lengths set by a specialization
+    // constant hold its default and have its ID here, the others have
+    // REFLECTED_NO_SPEC_ID.
+    U32 *array_dimension_spec_ids;
+
+    U32 vec_size;
+    U32 cols;
+
+    // Layout of buffer block members, all 0 for stage inputs and outputs.
+    // Byte offset within the parent struct.
+    U32 offset;
+    // Declared size in bytes, of the whole array for arrays and without the
+    // runtime array for blocks ending in one.
+    U32 size;
+    // Of the outermost array dimension, 0 if not an array.
+    U32 array_stride;
+    // Between columns, 0 if not a matrix.
+    U32 matrix_stride;
+
+    U32 member_count;
+    ReflectedType *members;
+};
+
+typedef enum {
+    REFLECTION_INDEX_UNIFORM_BUFFER,
+    REFLECTION_INDEX_PUSH_CONSTANT,
+    REFLECTION_INDEX_STORAGE_BUFFER,
+
+    REFLECTION_INDEX_COUNT,
+} ReflectionIndex;
+
+typedef struct ReflectedVariable ReflectedVariable;
+struct ReflectedVariable {
+    U32 location;
+    ReflectedType type;
+};
+
+// Same order as VkDescriptorType, without the dynamic buffers.
+typedef enum {
+    REFLECTED_DESCRIPTOR_TYPE_SAMPLER,
+    REFLECTED_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    REFLECTED_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+    REFLECTED_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+    REFLECTED_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER,
+    REFLECTED_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    REFLECTED_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+    REFLECTED_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    REFLECTED_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+
+    REFLECTED_DESCRIPTOR_TYPE_COUNT,
+} ReflectedDescriptorType;
+
+typedef struct ReflectedBinding ReflectedBinding;
+struct ReflectedBinding {
+    ArStr name;
+    U32 set;
+    U32 binding;
+    ReflectedDescriptorType descriptor_type;
+    // Descriptors in the binding, 0 for runtime sized arrays.
+    U32 count;
+};
+
+// Declared with 'layout(constant_id = N) const'.
+typedef struct ReflectedSpecConstant ReflectedSpecConstant;
+struct ReflectedSpecConstant {
+    ArStr name;
+    U32 id;
+    // REFLECTED_DATA_TYPE_I32, _U32, _F32 or _F64. Booleans are U32, like
+    // VkBool32.
+    ReflectedDataType data_type;
+    B8 boolean;
+    // Bits of the default value.
+    U64 default_value;
+};
+
+typedef struct ReflectedStage ReflectedStage;
+struct ReflectedStage {
+    ReflectedType *types[REFLECTION_INDEX_COUNT];
+    Usize count[REFLECTION_INDEX_COUNT];
+
+    // User defined stage inputs and outputs sorted by location. Built-ins
+    // aren't included.
+    ReflectedVariable *inputs;
+    Usize input_count;
+    ReflectedVariable *outputs;
+    Usize output_count;
+
+    // Every descriptor the stage declares, sorted by set and binding.
+    ReflectedBinding *bindings;
+    Usize binding_count;
+
+    // 'local_size_x/y/z' of compute stages, 0 for other stages. A dimension
+    // set with 'local_size_*_id' holds the specialization constant's default
+    // and its ID is in 'workgroup_size_spec_ids'.
+    U32 workgroup_size[3];
+    U32 workgroup_size_spec_ids[3];
+
+    // Sorted by ID.
+    ReflectedSpecConstant *spec_constants;
+    Usize spec_constant_count;
+};
+
+// Entry of workgroup_size_spec_ids or array_dimension_spec_ids for a workgroup
+// or array dimension that isn't sized by a specialization constant.
+#define REFLECTED_NO_SPEC_ID 0xffffffff
+
+typedef struct CompiledStage CompiledStage;
+struct CompiledStage {
+    ArStr spv;
+    // Size of the SPIR-V glslang generated, before optimization.
+    U64 unoptimized_size;
+    ReflectedStage reflection;
+};
+
+// Declared with '#variant PROGRAM NAME [VALUE,...]'. Every stage of the
+// program sees 'NAME' defined to the index of the variant's value, and
+// 'NAME_VALUE' to the index of each value.
+typedef struct VariantAxis VariantAxis;
+struct VariantAxis {
+    ArStr name;
+    // Empty for a boolean axis, where 'NAME' is 0 or 1.
+    ArStr *values;
+    U32 value_count;
+};
+
+typedef enum {
+    // '#program NAME VERT FRAG'.
+    PROGRAM_TYPE_GRAPHICS,
+    // '#compute NAME COMP', a single stage without a link partner.
+    PROGRAM_TYPE_COMPUTE,
+} ProgramType;
+
+typedef struct CompiledShader CompiledShader;
+struct CompiledShader {
+    ArStr name;
+    ProgramType type;
+    // Variant 0, every axis at its first value. Compute programs only have
+    // 'compute', others only 'vertex' and 'fragment'.
+    CompiledStage vertex;
+    CompiledStage fragment;
+    CompiledStage compute;
+
+    // A variant key is the sum of each axis' value index times the product
+    // of the value counts of the axes before it.
+    VariantAxis *axes;
+    U32 axis_count;
+    // Indexed by variant key. Variants with byte-identical SPIR-V share the
+    // same 'spv' data.
+    CompiledStage *vertex_variants;
+    CompiledStage *fragment_variants;
+    CompiledStage *compute_variants;
+    U32 variant_count;
+};
+
+typedef enum {
+    SHADER_TYPE_VERTEX,
+    SHADER_TYPE_FRAGMENT,
+    SHADER_TYPE_COMPUTE,
+
+    SHADER_TYPE_COUNT,
+} ShaderType;
+
+typedef struct ParsedStage ParsedStage;
+struct ParsedStage {
+    ShaderType type;
+    // Followed by a null terminator not counted in 'len'.
+    ArStr source;
+};
+
+typedef struct ParsedProgram ParsedProgram;
+struct ParsedProgram {
+    ArStr name;
+    ProgramType type;
+    // Indices into 'ParsedShader.stages', set like the CompiledShader stages.
+    U32 vertex;
+    U32 fragment;
+    U32 compute;
+    VariantAxis *axes;
+    U32 axis_count;
+};
+
+typedef struct ParsedShader ParsedShader;
+struct ParsedShader {
+    // In definition order, empty if the file doesn't define any.
+    ParsedProgram *programs;
+    U64 program_count;
+    // One per module used by a program. Programs using the same module share
+    // its stage, so it's only compiled once.
+    ParsedStage *stages;
+    U64 stage_count;
+    ArHashMap *ctypes;
+    // Every file included while parsing, directly or transitively. Doesn't
+    // contain the parsed file itself.
+    ArStrList dependencies;
+};
+
+typedef enum {
+    OPTIMIZE_NONE,
+    // SPIRV-Tools performance passes ('-O').
+    OPTIMIZE_PERFORMANCE,
+    // SPIRV-Tools size passes, also strips debug info ('-Os').
+    OPTIMIZE_SIZE,
+} OptimizeLevel;
+
+// Resolves '#include "path"'. 'includer' is the name of the including source.
+// On success 'name' identifies the included file, it's passed as the
+// includer to the file's own includes and listed in the dependencies. Both
+// 'name' and 'content' go on 'arena'. Return false if it doesn't exist.
+typedef B8 ShaderIncludeFunc(void *userdata, ArArena *arena, ArStr path, ArStr includer, ArStr *name, ArStr *content);
+
+typedef struct ShaderSource ShaderSource;
+struct ShaderSource {
+    ArStr name;
+    ArStr code;
+    // Optional, '#include' fails without it.
+    ShaderIncludeFunc *include;
+    void *include_userdata;
+};
+
+// Reference counted, every shader_library_init needs a matching
+// shader_library_terminate. Call before compiling on any thread.
+extern void shader_library_init(void);
+extern void shader_library_terminate(void);
+
+// The functions below return false on failure and set 'errors', if given, to
+// the error messages.
+extern B8 shader_parse(ArArena *arena, ShaderSource source, ParsedShader *parsed, ArStrList *errors);
+// Compiles and reflects every program of a parsed file. '*programs' gets one
+// CompiledShader per parsed program, in the same order. Programs sharing a
+// module share its CompiledStage. Runs on the calling thread only, compile
+// several files from several threads to use more cores.
+extern B8 shader_compile(ArArena *arena, ParsedShader parsed, OptimizeLevel optimize, CompiledShader **programs, ArStrList *errors);
+extern B8 shader_reflect(ArArena *arena, ArStr spv, ReflectedStage *reflection, ArStrList *errors);
+
 #endif
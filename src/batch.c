@@ -0,0 +1,586 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <stdlib.h>
+
+static void record_dependencies(BatchJob *job, ArStrList dependencies) {
+    if (job->dependency_arena == NULL) {
+        return;
+    }
+    ar_arena_destroy(&job->dependency_arena);
+    job->dependency_arena = ar_arena_create_default();
+    job->dependencies = (ArStrList) {0};
+    for (ArStrListNode *curr = dependencies.first; curr != NULL; curr = curr->next) {
+        ar_str_list_push(job->dependency_arena, &job->dependencies, ar_str_push_copy(job->dependency_arena, curr->str));
+    }
+}
+
+static CompiledStage copy_stage(ArArena *arena, CompiledStage stage) {
+    return (CompiledStage) {
+        .spv = ar_str_push_copy(arena, stage.spv),
+        .unoptimized_size = stage.unoptimized_size,
+        .reflection = reflected_stage_copy(arena, stage.reflection),
+    };
+}
+
+typedef struct KeptStage KeptStage;
+struct KeptStage {
+    const U8 *spv;
+    CompiledStage stage;
+};
+
+// Copies 'stage' once, stages sharing its SPIR-V share the copy. 'kept' holds
+// KeptStage.
+static CompiledStage keep_stage(ArArena *arena, Buffer *kept, CompiledStage stage) {
+    const KeptStage *stages = (const KeptStage *) kept->data;
+    for (U64 i = 0; i < kept->len / sizeof(KeptStage); i++) {
+        if (stages[i].spv == stage.spv.data) {
+            return stages[i].stage;
+        }
+    }
+    KeptStage entry = {
+        .spv = stage.spv.data,
+        .stage = copy_stage(arena, stage),
+    };
+    buffer_push(kept, &entry, sizeof(entry));
+    return entry.stage;
+}
+
+static VariantAxis *copy_axes(ArArena *arena, const VariantAxis *axes, U32 axis_count) {
+    VariantAxis *copy = ar_arena_push_arr(arena, VariantAxis, axis_count);
+    for (U32 i = 0; i < axis_count; i++) {
+        copy[i].name = ar_str_push_copy(arena, axes[i].name);
+        copy[i].value_count = axes[i].value_count;
+        copy[i].values = ar_arena_push_arr(arena, ArStr, axes[i].value_count);
+        for (U32 j = 0; j < axes[i].value_count; j++) {
+            copy[i].values[j] = ar_str_push_copy(arena, axes[i].values[j]);
+        }
+    }
+    return copy;
+}
+
+// Copies 'programs' into the job's result arena so they outlive the run.
+static void keep_results(BatchJob *job, const CompiledShader *programs, U64 program_count) {
+    ArArena *arena = job->result_arena;
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    Buffer kept = { .arena = scratch.arena };
+
+    job->results = ar_arena_push_arr(arena, CompiledShader, program_count);
+    job->result_count = program_count;
+    for (U64 i = 0; i < program_count; i++) {
+        CompiledShader program = programs[i];
+        CompiledShader *result = &job->results[i];
+        *result = (CompiledShader) {
+            .name = ar_str_push_copy(arena, program.name),
+            .type = program.type,
+            .axes = copy_axes(arena, program.axes, program.axis_count),
+            .axis_count = program.axis_count,
+            .variant_count = program.variant_count,
+        };
+        if (program.type == PROGRAM_TYPE_COMPUTE) {
+            result->compute = keep_stage(arena, &kept, program.compute);
+            result->compute_variants = ar_arena_push_arr(arena, CompiledStage, program.variant_count);
+            for (U32 key = 0; key < program.variant_count; key++) {
+                result->compute_variants[key] = keep_stage(arena, &kept, program.compute_variants[key]);
+            }
+            continue;
+        }
+        result->vertex = keep_stage(arena, &kept, program.vertex);
+        result->fragment = keep_stage(arena, &kept, program.fragment);
+        result->vertex_variants = ar_arena_push_arr(arena, CompiledStage, program.variant_count);
+        result->fragment_variants = ar_arena_push_arr(arena, CompiledStage, program.variant_count);
+        for (U32 key = 0; key < program.variant_count; key++) {
+            result->vertex_variants[key] = keep_stage(arena, &kept, program.vertex_variants[key]);
+            result->fragment_variants[key] = keep_stage(arena, &kept, program.fragment_variants[key]);
+        }
+    }
+
+    ar_scratch_release(&scratch);
+}
+
+// Compiles on the server, then writes the header and depfile locally.
+static void remote_job_run(ArArena *arena, BatchJob *job) {
+    ArTemp temp = ar_temp_begin(arena);
+
+    RemoteResult result;
+    if (!compile_remote(temp.arena, job->server, job->input, job->paths, job->compile_options.optimize, job->output_options, &result)) {
+        job->status = BATCH_STATUS_FAILED;
+        ar_temp_end(&temp);
+        return;
+    }
+    record_dependencies(job, result.dependencies);
+    for (ArStrListNode *curr = result.errors.first; curr != NULL; curr = curr->next) {
+        ar_error("%.*s", (I32) curr->str.len, curr->str.data);
+    }
+
+    switch (result.status) {
+        case REMOTE_STATUS_DONE:
+            break;
+        case REMOTE_STATUS_NO_PROGRAM:
+            if (job->discovered) {
+                job->status = BATCH_STATUS_SKIPPED;
+            } else {
+                ar_error("%.*s: No program defined.", (I32) job->input.len, job->input.data);
+                job->status = BATCH_STATUS_FAILED;
+            }
+            ar_temp_end(&temp);
+            return;
+        case REMOTE_STATUS_FAILED:
+        case REMOTE_STATUS_COUNT:
+            job->status = BATCH_STATUS_FAILED;
+            ar_temp_end(&temp);
+            return;
+    }
+
+    B8 success = true;
+    if (job->depfile.len != 0) {
+        success = write_depfile(ar_str_to_cstr(temp.arena, job->depfile), job->output, job->input, result.dependencies);
+    }
+    // The object goes first so that the header, which the depfile names as
+    // the target, is the newest output.
+    if (success && job->object.len != 0) {
+        success = write_file(ar_str_to_cstr(temp.arena, job->object), result.object);
+    }
+    if (success) {
+        success = write_file(ar_str_to_cstr(temp.arena, job->output), result.header);
+    }
+    job->status = success ? BATCH_STATUS_DONE : BATCH_STATUS_FAILED;
+
+    ar_temp_end(&temp);
+}
+
+void batch_job_run(ArArena *arena, void *userdata) {
+    BatchJob *job = userdata;
+
+    if (job->server.len != 0 && !job->deps_only) {
+        remote_job_run(arena, job);
+        return;
+    }
+
+    if (job->result_arena != NULL) {
+        ar_arena_destroy(&job->result_arena);
+        job->result_arena = ar_arena_create_default();
+        job->results = NULL;
+        job->result_count = 0;
+    }
+
+    ArTemp temp = ar_temp_begin(arena);
+
+    MappedFile file;
+    if (!map_file(job->input, &file)) {
+        ar_error("Failed to open file %.*s.", (I32) job->input.len, job->input.data);
+        job->status = BATCH_STATUS_FAILED;
+        ar_temp_end(&temp);
+        return;
+    }
+
+    // Nothing parsed points into the file.
+    ParsedShader parsed = parse_shader(temp.arena, file.content, job->paths, job->files);
+    unmap_file(&file);
+
+    record_dependencies(job, parsed.dependencies);
+    if (parsed.program_count == 0) {
+        if (job->discovered) {
+            job->status = BATCH_STATUS_SKIPPED;
+        } else {
+            ar_error("%.*s: No program defined.", (I32) job->input.len, job->input.data);
+            job->status = BATCH_STATUS_FAILED;
+        }
+        ar_temp_end(&temp);
+        return;
+    }
+
+    if (job->depfile.len != 0) {
+        const char *depfile = ar_str_to_cstr(temp.arena, job->depfile);
+        if (!write_depfile(depfile, job->output, job->input, parsed.dependencies)) {
+            job->status = BATCH_STATUS_FAILED;
+            ar_temp_end(&temp);
+            return;
+        }
+    }
+
+    if (job->deps_only) {
+        job->status = BATCH_STATUS_DONE;
+        ar_temp_end(&temp);
+        return;
+    }
+
+    CompiledShader *programs;
+    if (!compile_shader(temp.arena, parsed, job->compile_options, &programs)) {
+        job->status = BATCH_STATUS_FAILED;
+        ar_temp_end(&temp);
+        return;
+    }
+
+    if (job->result_arena != NULL) {
+        keep_results(job, programs, parsed.program_count);
+        job->status = BATCH_STATUS_DONE;
+        ar_temp_end(&temp);
+        return;
+    }
+
+    // The object goes first so that the header, which the depfile names as
+    // the target, is the newest output.
+    if (job->object.len != 0) {
+        Buffer object = { .arena = temp.arena };
+        render_object(&object, programs, parsed.program_count, job->output_options);
+        if (!write_file(ar_str_to_cstr(temp.arena, job->object), buffer_str(object))) {
+            job->status = BATCH_STATUS_FAILED;
+            ar_temp_end(&temp);
+            return;
+        }
+    }
+
+    const char *output = ar_str_to_cstr(temp.arena, job->output);
+    job->status = write_header(programs, parsed.program_count, parsed.ctypes, job->output_options, output) ? BATCH_STATUS_DONE : BATCH_STATUS_FAILED;
+
+    ar_temp_end(&temp);
+}
+
+// Pushes a BatchJob per line. Relative paths are relative to the manifest,
+// which is their root.
+static void read_manifest(ArArena *arena, Buffer *jobs, ArStr manifest) {
+    ArStr file = read_file(arena, manifest);
+    ArStr manifest_dir = dirname(manifest);
+
+    U64 start = 0;
+    for (U64 i = 0; i <= file.len; i++) {
+        if (i != file.len && file.data[i] != '\n') {
+            continue;
+        }
+
+        ArStr line = ar_str_trim(ar_str(file.data + start, i - start));
+        start = i + 1;
+        if (line.len == 0 || line.data[0] == '#') {
+            continue;
+        }
+
+        BatchJob job = { .input = line };
+        if (line.data[0] != '/') {
+            job.input = ar_str_pushf(arena, "%.*s/%.*s", (I32) manifest_dir.len, manifest_dir.data, (I32) line.len, line.data);
+            job.root = manifest_dir;
+        }
+        buffer_push(jobs, &job, sizeof(job));
+    }
+}
+
+// Directory of 'path' relative to 'root', empty if it's the root itself or
+// not below it. Paths going up with '..' are treated as not below it.
+static ArStr relative_dir(ArStr path, ArStr root) {
+    ArStr dir = dirname(path);
+    if (root.len == 0 || dir.len <= root.len + 1 ||
+            !ar_str_match(ar_str_chop_end(dir, dir.len - root.len), root, AR_STR_MATCH_FLAG_EXACT) ||
+            dir.data[root.len] != '/') {
+        return (ArStr) {0};
+    }
+
+    ArStr relative = ar_str_chop_start(dir, root.len + 1);
+    for (U64 start = 0; start < relative.len;) {
+        U64 end = start;
+        while (end < relative.len && relative.data[end] != '/') {
+            end++;
+        }
+        if (end - start == 2 && relative.data[start] == '.' && relative.data[start + 1] == '.') {
+            return (ArStr) {0};
+        }
+        start = end + 1;
+    }
+    return relative;
+}
+
+static I32 job_cmp(const void *a, const void *b) {
+    const BatchJob *_a = a;
+    const BatchJob *_b = b;
+    U64 len = ar_min(_a->input.len, _b->input.len);
+    I32 cmp = memcmp(_a->input.data, _b->input.data, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (_a->input.len > _b->input.len) - (_a->input.len < _b->input.len);
+}
+
+B8 batch_create(ArArena *arena, Options options, Batch *batch) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // Expand manifests and directories.
+    Buffer job_buffer = { .arena = scratch.arena };
+    for (ArStrListNode *curr = options.inputs.first; curr != NULL; curr = curr->next) {
+        ArStr input = curr->str;
+        if (input.len > 1 && input.data[0] == '@') {
+            read_manifest(arena, &job_buffer, ar_str_chop_start(input, 1));
+        } else if (is_directory(input)) {
+            while (input.len > 1 && input.data[input.len - 1] == '/') {
+                input.len--;
+            }
+            ArStrList discovered = {0};
+            collect_files(arena, &discovered, input, ar_str_lit(".glsl"));
+            for (ArStrListNode *file = discovered.first; file != NULL; file = file->next) {
+                BatchJob job = {
+                    .input = file->str,
+                    .root = input,
+                    .discovered = true,
+                };
+                buffer_push(&job_buffer, &job, sizeof(job));
+            }
+        } else {
+            BatchJob job = { .input = input };
+            buffer_push(&job_buffer, &job, sizeof(job));
+        }
+    }
+
+    U64 job_count = job_buffer.len / sizeof(BatchJob);
+    if (job_count == 0) {
+        ar_error("No input files provided.");
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    BatchJob *jobs = ar_arena_push_arr_no_zero(arena, BatchJob, job_count);
+    memcpy(jobs, job_buffer.data, job_buffer.len);
+
+    // Sort so that scheduling, diagnostics and name clash resolution don't
+    // depend on argument or directory order. Duplicate inputs are dropped.
+    qsort(jobs, job_count, sizeof(BatchJob), job_cmp);
+    U64 unique_count = 0;
+    U64 i;
+    for (i = 0; i < job_count; i++) {
+        if (unique_count > 0 && job_cmp(&jobs[unique_count - 1], &jobs[i]) == 0) {
+            jobs[unique_count - 1].discovered &= jobs[i].discovered;
+            continue;
+        }
+        jobs[unique_count++] = jobs[i];
+    }
+    job_count = unique_count;
+
+    if (options.pack.len != 0 && (options.depfile || options.depfile_path.len != 0 || options.deps_only || options.client.len != 0)) {
+        ar_error("--pack can't be used with depfiles or --client.");
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    if (options.depfile_path.len != 0 && job_count != 1) {
+        ar_error("-MF can only be used with a single input.");
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    B8 legacy_output = options.output_dir.len == 0 && job_count == 1;
+    ArStr output_dir = options.output_dir.len == 0 ? ar_str_lit(".") : options.output_dir;
+    if (!make_directory(output_dir)) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    ArHashMap *outputs = ar_hash_map_init((ArHashMapDesc) {
+            .arena = scratch.arena,
+            .capacity = job_count * 2,
+
+            .hash_func = hash_str,
+            .eq_func = str_eq,
+
+            .key_size = sizeof(ArStr),
+            .value_size = sizeof(ArStr),
+            .null_value = &(ArStr) {0},
+        });
+
+    B8 success = true;
+    for (i = 0; i < job_count; i++) {
+        BatchJob *job = &jobs[i];
+
+        // Inputs found through a directory or manifest keep their path
+        // relative to it, so equal names in different directories don't
+        // clash.
+        if (legacy_output) {
+            job->output = ar_str_lit("header.h");
+        } else {
+            ArStr name = stem(job->input);
+            ArStr subdir = relative_dir(job->input, job->root);
+            if (subdir.len == 0) {
+                job->output = ar_str_pushf(arena, "%.*s/%.*s.h", (I32) output_dir.len, output_dir.data, (I32) name.len, name.data);
+            } else {
+                job->output = ar_str_pushf(arena, "%.*s/%.*s/%.*s.h",
+                        (I32) output_dir.len, output_dir.data,
+                        (I32) subdir.len, subdir.data,
+                        (I32) name.len, name.data);
+                if (!make_directory(dirname(job->output))) {
+                    success = false;
+                    continue;
+                }
+            }
+        }
+
+        // Left for inputs given directly, or from different roots, that
+        // share a name.
+        ArStr other = ar_hash_map_get(outputs, job->output, ArStr);
+        if (other.len != 0) {
+            ar_error("%.*s: Output %.*s clashes with %.*s.",
+                    (I32) job->input.len, job->input.data,
+                    (I32) job->output.len, job->output.data,
+                    (I32) other.len, other.data);
+            success = false;
+            continue;
+        }
+        ar_hash_map_insert(outputs, job->output, job->input);
+
+        if (options.depfile_path.len != 0) {
+            job->depfile = options.depfile_path;
+        } else if (options.depfile || options.deps_only) {
+            job->depfile = ar_str_pushf(arena, "%.*s.d", (I32) job->output.len, job->output.data);
+        }
+        job->deps_only = options.deps_only;
+        job->server = options.client;
+        job->output_options = options.output_options;
+        if (options.output_options.spv_format == SPV_FORMAT_OBJECT) {
+            job->object = ar_str_pushf(arena, "%.*s.o", (I32) ar_str_chop_end(job->output, 2).len, job->output.data);
+        }
+
+        ArStrList paths = {0};
+        ar_str_list_push(arena, &paths, dirname(job->input));
+        ar_str_list_push(arena, &paths, ar_str_lit("."));
+        for (ArStrListNode *curr = options.include_paths.first; curr != NULL; curr = curr->next) {
+            ar_str_list_push(arena, &paths, curr->str);
+        }
+        job->paths = paths;
+    }
+
+    ar_scratch_release(&scratch);
+    if (!success) {
+        return false;
+    }
+
+    U32 worker_count = options.jobs;
+    if (worker_count == 0) {
+        worker_count = cpu_count();
+    }
+    U32 pool_size = ar_min(worker_count, job_count);
+
+    // Jobs split the threads between them rather than each spawning one per
+    // CPU, so a lone job still compiles its stages in parallel.
+    CompileOptions compile_options = {
+        .optimize = options.optimize,
+        .threads = ar_max(worker_count / ar_max(pool_size, 1), 1),
+    };
+    // Clients use the server's cache.
+    if (options.cache_dir.len != 0 && !options.deps_only && options.client.len == 0) {
+        compile_options.cache = shader_cache_create(options.cache_dir, options.cache_size);
+    }
+    FileCache *file_cache = file_cache_create();
+    for (i = 0; i < job_count; i++) {
+        jobs[i].compile_options = compile_options;
+        jobs[i].files = file_cache;
+        if (options.pack.len != 0) {
+            jobs[i].result_arena = ar_arena_create_default();
+        }
+    }
+
+    *batch = (Batch) {
+        .jobs = jobs,
+        .job_count = job_count,
+        .deps_only = options.deps_only,
+        .compile_options = compile_options,
+        .files = file_cache,
+        .pool = thread_pool_create(pool_size),
+        .pack = options.pack,
+    };
+
+    return true;
+}
+
+void batch_destroy(Batch *batch) {
+    for (U64 i = 0; i < batch->job_count; i++) {
+        if (batch->jobs[i].dependency_arena != NULL) {
+            ar_arena_destroy(&batch->jobs[i].dependency_arena);
+        }
+        if (batch->jobs[i].result_arena != NULL) {
+            ar_arena_destroy(&batch->jobs[i].result_arena);
+        }
+    }
+    if (batch->compile_options.cache != NULL) {
+        shader_cache_destroy(&batch->compile_options.cache);
+    }
+    file_cache_destroy(&batch->files);
+    thread_pool_destroy(&batch->pool);
+}
+
+B8 batch_run(Batch *batch) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    // Include lookups are only trusted for a single run, files may have been
+    // created or removed since the last one.
+    file_cache_refresh(batch->files);
+
+    // Only report on the jobs run this time around.
+    B8 *scheduled = ar_arena_push_arr(scratch.arena, B8, batch->job_count);
+    U64 scheduled_count = 0;
+    for (U64 i = 0; i < batch->job_count; i++) {
+        if (batch->jobs[i].status == BATCH_STATUS_PENDING) {
+            thread_pool_submit(batch->pool, batch_job_run, &batch->jobs[i]);
+            scheduled[i] = true;
+            scheduled_count++;
+        }
+    }
+    thread_pool_wait(batch->pool);
+
+    B8 success = true;
+    U64 counts[BATCH_STATUS_COUNT] = {0};
+    for (U64 i = 0; i < batch->job_count; i++) {
+        if (!scheduled[i]) {
+            continue;
+        }
+        counts[batch->jobs[i].status]++;
+        if (batch->jobs[i].status == BATCH_STATUS_FAILED) {
+            ar_error("%.*s: Failed.", (I32) batch->jobs[i].input.len, batch->jobs[i].input.data);
+            success = false;
+        }
+    }
+
+    if (scheduled_count > 1) {
+        ar_info("%s %llu, skipped %llu, failed %llu using %u workers.",
+                batch->deps_only ? "Scanned" : "Compiled",
+                (unsigned long long) counts[BATCH_STATUS_DONE],
+                (unsigned long long) counts[BATCH_STATUS_SKIPPED],
+                (unsigned long long) counts[BATCH_STATUS_FAILED],
+                thread_pool_worker_count(batch->pool));
+    }
+
+    if (batch->compile_options.cache != NULL) {
+        ShaderCacheStats stats = shader_cache_stats(batch->compile_options.cache);
+        ar_info("Cache: %llu hits, %llu misses, %llu stores, %llu evictions.",
+                (unsigned long long) stats.hits,
+                (unsigned long long) stats.misses,
+                (unsigned long long) stats.stores,
+                (unsigned long long) stats.evictions);
+    }
+
+    // Jobs that weren't run this time still hold their last result. A failed
+    // job leaves the previous pack alone rather than dropping its program.
+    if (batch->pack.len != 0 && success) {
+        U64 program_count = 0;
+        for (U64 i = 0; i < batch->job_count; i++) {
+            program_count += batch->jobs[i].result_count;
+        }
+        CompiledShader *programs = ar_arena_push_arr_no_zero(scratch.arena, CompiledShader, program_count);
+        U64 offset = 0;
+        for (U64 i = 0; i < batch->job_count; i++) {
+            for (U64 j = 0; j < batch->jobs[i].result_count; j++) {
+                programs[offset++] = batch->jobs[i].results[j];
+            }
+        }
+        success = write_pack(ar_str_to_cstr(scratch.arena, batch->pack), programs, program_count);
+    }
+
+    ar_scratch_release(&scratch);
+    return success;
+}
+
+B8 compile_batch(ArArena *arena, Options options) {
+    Batch batch;
+    if (!batch_create(arena, options, &batch)) {
+        return false;
+    }
+    B8 success = batch_run(&batch);
+    batch_destroy(&batch);
+    return success;
+}
@@ -0,0 +1,277 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Entry layout, integers little endian:
+// U32 magic
+// U32 version
+// U64 spv length
+// U64 unoptimized spv length
+// U64 reflection length
+// SPIR-V
+// Serialized ReflectedStage
+#define CACHE_MAGIC 0x43485341 // 'ASHC'
+#define CACHE_VERSION 5
+#define CACHE_HEADER_SIZE 32
+// Temporary files older than this are left over from a writer that died.
+#define CACHE_STALE_TMP_SECONDS (60*60)
+
+struct ShaderCache {
+    ArArena *arena;
+    ArStr dir;
+    U64 max_size;
+
+    pthread_mutex_t mutex;
+    // Total size of all entries on disk. Only exact right after an eviction
+    // scan since other processes may share the directory.
+    U64 size;
+    U64 tmp_counter;
+    ShaderCacheStats stats;
+};
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    ArStr path;
+    U64 size;
+    I64 mtime;
+};
+
+static ArStr entry_path(ArArena *arena, const ShaderCache *cache, const U8 key[SHA256_SIZE]) {
+    char hex[SHA256_SIZE*2 + 1];
+    for (U32 i = 0; i < SHA256_SIZE; i++) {
+        snprintf(&hex[i*2], 3, "%.2x", key[i]);
+    }
+    return ar_str_pushf(arena, "%.*s/%.2s/%s", (I32) cache->dir.len, cache->dir.data, hex, hex);
+}
+
+// Appends every entry in the cache directory. Returns the total size.
+// Temporary files, see shader_cache_put, may still be written by another
+// thread or process and are skipped, unless they're stale.
+static U64 scan_entries(ArArena *arena, const ShaderCache *cache, CacheEntry **entries, U64 *count) {
+    ArStrList files = {0};
+    collect_files(arena, &files, cache->dir, ar_str_lit(""));
+
+    *count = 0;
+    for (ArStrListNode *curr = files.first; curr != NULL; curr = curr->next) {
+        (*count)++;
+    }
+
+    *entries = ar_arena_push_arr(arena, CacheEntry, *count);
+    U64 total = 0;
+    U64 i = 0;
+    time_t now = time(NULL);
+    for (ArStrListNode *curr = files.first; curr != NULL; curr = curr->next) {
+        const char *path = ar_str_to_cstr(arena, curr->str);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        const char *name = strrchr(path, '/');
+        if (strstr(name != NULL ? name : path, ".tmp.") != NULL) {
+            if (now - st.st_mtime > CACHE_STALE_TMP_SECONDS) {
+                unlink(path);
+            }
+            continue;
+        }
+        (*entries)[i++] = (CacheEntry) {
+            .path = curr->str,
+            .size = st.st_size,
+            .mtime = st.st_mtime,
+        };
+        total += st.st_size;
+    }
+    *count = i;
+
+    return total;
+}
+
+static I32 entry_cmp(const void *a, const void *b) {
+    const CacheEntry *_a = a;
+    const CacheEntry *_b = b;
+    return (_a->mtime > _b->mtime) - (_a->mtime < _b->mtime);
+}
+
+// Removes the least recently used entries until the cache is at three
+// quarters of its size cap, so that eviction doesn't run on every store.
+// Must be called with the mutex held.
+static void evict(ShaderCache *cache) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    CacheEntry *entries = NULL;
+    U64 count = 0;
+    U64 total = scan_entries(scratch.arena, cache, &entries, &count);
+    qsort(entries, count, sizeof(CacheEntry), entry_cmp);
+
+    U64 target = cache->max_size / 4 * 3;
+    for (U64 i = 0; i < count && total > target; i++) {
+        if (unlink(ar_str_to_cstr(scratch.arena, entries[i].path)) == 0) {
+            total -= entries[i].size;
+            cache->stats.evictions++;
+        }
+    }
+    cache->size = total;
+
+    ar_scratch_release(&scratch);
+}
+
+ShaderCache *shader_cache_create(ArStr dir, U64 max_size) {
+    if (!make_directory(dir)) {
+        return NULL;
+    }
+
+    ArArena *arena = ar_arena_create_default();
+    ShaderCache *cache = ar_arena_push_arr(arena, ShaderCache, 1);
+    cache->arena = arena;
+    cache->dir = ar_str_push_copy(arena, dir);
+    cache->max_size = max_size;
+    pthread_mutex_init(&cache->mutex, NULL);
+
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    CacheEntry *entries = NULL;
+    U64 count = 0;
+    cache->size = scan_entries(scratch.arena, cache, &entries, &count);
+    ar_scratch_release(&scratch);
+
+    return cache;
+}
+
+void shader_cache_destroy(ShaderCache **cache) {
+    ShaderCache *c = *cache;
+    pthread_mutex_destroy(&c->mutex);
+    ArArena *arena = c->arena;
+    ar_arena_destroy(&arena);
+    *cache = NULL;
+}
+
+B8 shader_cache_get(ShaderCache *cache, ArArena *arena, const U8 key[SHA256_SIZE], CompiledStage *stage) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    const char *path = ar_str_to_cstr(scratch.arena, entry_path(scratch.arena, cache, key));
+
+    B8 hit = false;
+    FILE *fp = fopen(path, "rb");
+    if (fp != NULL) {
+        fseek(fp, 0, SEEK_END);
+        U64 len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        U8 *data = ar_arena_push_no_zero(scratch.arena, len);
+        len = fread(data, 1, len, fp);
+        fclose(fp);
+
+        BufferReader reader = { .data = ar_str(data, len) };
+        U32 magic = buffer_read_u32(&reader);
+        U32 version = buffer_read_u32(&reader);
+        U64 spv_len = buffer_read_u64(&reader);
+        U64 unoptimized_len = buffer_read_u64(&reader);
+        U64 reflection_len = buffer_read_u64(&reader);
+        const U8 *spv = buffer_read(&reader, spv_len);
+
+        if (!reader.error &&
+                magic == CACHE_MAGIC &&
+                version == CACHE_VERSION &&
+                spv_len % sizeof(U32) == 0 &&
+                reader.offset + reflection_len == len) {
+            ReflectedStage reflection;
+            if (deserialize_reflected_stage(arena, &reader, &reflection)) {
+                U8 *spv_copy = ar_arena_push_arr_no_zero(arena, U8, spv_len);
+                memcpy(spv_copy, spv, spv_len);
+                *stage = (CompiledStage) {
+                    .spv = ar_str(spv_copy, spv_len),
+                    .unoptimized_size = unoptimized_len,
+                    .reflection = reflection,
+                };
+                hit = true;
+            }
+        }
+
+        if (hit) {
+            // Touch the entry so that eviction sees it as recently used.
+            utimes(path, NULL);
+        } else {
+            ar_error("%s: Corrupt cache entry, removing it.", path);
+            unlink(path);
+        }
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    if (hit) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    ar_scratch_release(&scratch);
+    return hit;
+}
+
+void shader_cache_put(ShaderCache *cache, const U8 key[SHA256_SIZE], CompiledStage stage) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    Buffer reflection = { .arena = scratch.arena };
+    serialize_reflected_stage(&reflection, stage.reflection);
+
+    Buffer entry = { .arena = scratch.arena };
+    buffer_reserve(&entry, CACHE_HEADER_SIZE + stage.spv.len + reflection.len);
+    buffer_push_u32(&entry, CACHE_MAGIC);
+    buffer_push_u32(&entry, CACHE_VERSION);
+    buffer_push_u64(&entry, stage.spv.len);
+    buffer_push_u64(&entry, stage.unoptimized_size);
+    buffer_push_u64(&entry, reflection.len);
+    buffer_push(&entry, stage.spv.data, stage.spv.len);
+    buffer_push(&entry, reflection.data, reflection.len);
+
+    ArStr path = entry_path(scratch.arena, cache, key);
+    if (!make_directory(dirname(path))) {
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    U64 tmp_id = cache->tmp_counter++;
+    pthread_mutex_unlock(&cache->mutex);
+
+    // Write to a temporary file and rename it into place so that readers,
+    // including other processes, never see a partial entry.
+    const char *tmp_path = ar_str_to_cstr(scratch.arena, ar_str_pushf(scratch.arena, "%.*s.tmp.%d.%llu",
+                (I32) path.len, path.data, (I32) getpid(), (unsigned long long) tmp_id));
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        ar_error("Failed to open file %s.", tmp_path);
+        ar_scratch_release(&scratch);
+        return;
+    }
+    B8 written = fwrite(entry.data, 1, entry.len, fp) == entry.len;
+    written &= fclose(fp) == 0;
+    if (!written || rename(tmp_path, ar_str_to_cstr(scratch.arena, path)) != 0) {
+        ar_error("Failed to write cache entry %s.", tmp_path);
+        unlink(tmp_path);
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    cache->stats.stores++;
+    cache->size += entry.len;
+    if (cache->max_size != 0 && cache->size > cache->max_size) {
+        evict(cache);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    ar_scratch_release(&scratch);
+}
+
+ShaderCacheStats shader_cache_stats(ShaderCache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    ShaderCacheStats stats = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+    return stats;
+}
@@ -5,57 +5,68 @@
 #include <glslang/Include/glslang_c_interface.h>
 #include <glslang/Include/glslang_c_shader_types.h>
 #include <glslang/Public/resource_limits_c.h>
+#include <spirv-tools/libspirv.h>
 
-typedef enum {
-    SHADER_TYPE_VERTEX,
-    SHADER_TYPE_FRAGMENT,
-} ShaderType;
+#include <pthread.h>
 
-static glslang_shader_t *create_shader(ArArena *arena, ArStr glsl, ShaderType type) {
-    glslang_stage_t stage;
+// Settings shared by every stage. Everything in here that affects the output
+// has to be part of the cache key.
+static const glslang_input_t BASE_INPUT = {
+    .language = GLSLANG_SOURCE_GLSL,
+    .client = GLSLANG_CLIENT_VULKAN,
+    .client_version = GLSLANG_TARGET_VULKAN_1_2,
+    .target_language = GLSLANG_TARGET_SPV,
+    .target_language_version = GLSLANG_TARGET_SPV_1_5,
+
+    .default_version = 450,
+    .default_profile = GLSLANG_NO_PROFILE,
+    .force_default_version_and_profile = false,
+    .forward_compatible = false,
+    .messages = GLSLANG_MSG_DEFAULT_BIT,
+};
+
+static glslang_stage_t glslang_stage(ShaderType type) {
     switch (type) {
         case SHADER_TYPE_VERTEX:
-            stage = GLSLANG_STAGE_VERTEX;
-            break;
+            return GLSLANG_STAGE_VERTEX;
         case SHADER_TYPE_FRAGMENT:
-            stage = GLSLANG_STAGE_FRAGMENT;
+            return GLSLANG_STAGE_FRAGMENT;
+        case SHADER_TYPE_COMPUTE:
+            return GLSLANG_STAGE_COMPUTE;
+        case SHADER_TYPE_COUNT:
             break;
     }
+    return GLSLANG_STAGE_VERTEX;
+}
 
+// 'preamble' is either empty or null terminated like 'glsl'.
+static glslang_shader_t *create_shader(ArArena *arena, ArStr glsl, ArStr preamble, ShaderType type) {
     ArTemp scratch = ar_scratch_get(&arena, 1);
-    const char *code_cstr = ar_str_to_cstr(arena, glsl);
-    glslang_input_t input = {
-        .language = GLSLANG_SOURCE_GLSL,
-        .stage = stage,
-        .client = GLSLANG_CLIENT_VULKAN,
-        .client_version = GLSLANG_TARGET_VULKAN_1_2,
-        .target_language = GLSLANG_TARGET_SPV,
-        .target_language_version = GLSLANG_TARGET_SPV_1_5,
-
-        .code = code_cstr,
-        .default_version = 450,
-        .default_profile = GLSLANG_NO_PROFILE,
-        .force_default_version_and_profile = false,
-        .forward_compatible = false,
-        .messages = GLSLANG_MSG_DEFAULT_BIT,
-        .resource = glslang_default_resource(),
-    };
+    glslang_input_t input = BASE_INPUT;
+    input.stage = glslang_stage(type);
+    // The parser null terminates the sources, so they're used in place.
+    input.code = (const char *) glsl.data;
+    input.resource = glslang_default_resource();
 
     glslang_shader_t *shader = glslang_shader_create(&input);
+    // Goes ahead of the source but after its '#version'.
+    if (preamble.len != 0) {
+        glslang_shader_set_preamble(shader, (const char *) preamble.data);
+    }
 
     if (!glslang_shader_preprocess(shader, &input)) {
-        ar_error("GLSLANG: Preprocessing failed.");
-        ar_error("%s", glslang_shader_get_info_log(shader));
-        ar_error("%s", glslang_shader_get_info_debug_log(shader));
+        report_error("GLSLANG: Preprocessing failed.");
+        report_error("%s", glslang_shader_get_info_log(shader));
+        report_error("%s", glslang_shader_get_info_debug_log(shader));
         glslang_shader_delete(shader);
         ar_scratch_release(&scratch);
         return NULL;
     }
 
     if (!glslang_shader_parse(shader, &input)) {
-        ar_error("GLSLANG: Parsing failed.");
-        ar_error("%s", glslang_shader_get_info_log(shader));
-        ar_error("%s", glslang_shader_get_info_debug_log(shader));
+        report_error("GLSLANG: Parsing failed.");
+        report_error("%s", glslang_shader_get_info_log(shader));
+        report_error("%s", glslang_shader_get_info_debug_log(shader));
         glslang_shader_delete(shader);
         ar_scratch_release(&scratch);
         return NULL;
@@ -65,61 +76,737 @@ static glslang_shader_t *create_shader(ArArena *arena, ArStr glsl, ShaderType ty
     return shader;
 }
 
-CompiledShader compile_shader(ArArena *arena, ParsedShader shader) {
-    glslang_initialize_process();
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static U32 init_count;
 
-    glslang_shader_t *vertex_shader = create_shader(arena, shader.program.vertex_source, SHADER_TYPE_VERTEX);
-    glslang_shader_t *fragment_shader = create_shader(arena, shader.program.fragment_source, SHADER_TYPE_FRAGMENT);
+void compiler_init(void) {
+    pthread_mutex_lock(&init_mutex);
+    if (init_count++ == 0) {
+        glslang_initialize_process();
+    }
+    pthread_mutex_unlock(&init_mutex);
+}
 
-    glslang_program_t *program = glslang_program_create();
-    glslang_program_add_shader(program, vertex_shader);
-    glslang_program_add_shader(program, fragment_shader);
+void compiler_terminate(void) {
+    pthread_mutex_lock(&init_mutex);
+    if (init_count > 0 && --init_count == 0) {
+        glslang_finalize_process();
+    }
+    pthread_mutex_unlock(&init_mutex);
+}
+
+static void optimizer_message(spv_message_level_t level, const char *source, const spv_position_t *position, const char *message) {
+    (void) source;
+    if (level <= SPV_MSG_ERROR) {
+        report_error("SPIRV-Tools: %s (word %llu)", message, (unsigned long long) position->index);
+    }
+}
+
+// Runs the SPIRV-Tools passes for 'level' over 'spv'. The validator runs
+// first so that broken modules are reported instead of miscompiled.
+static B8 optimize_spv(ArArena *arena, ArStr spv, OptimizeLevel level, ArStr *optimized) {
+    // Matches BASE_INPUT.client_version.
+    spv_optimizer_t *optimizer = spvOptimizerCreate(SPV_ENV_VULKAN_1_2);
+    spvOptimizerSetMessageConsumer(optimizer, optimizer_message);
+    switch (level) {
+        case OPTIMIZE_NONE:
+            break;
+        case OPTIMIZE_PERFORMANCE:
+            spvOptimizerRegisterPerformancePasses(optimizer);
+            break;
+        case OPTIMIZE_SIZE:
+            spvOptimizerRegisterPassFromFlag(optimizer, "--strip-debug");
+            spvOptimizerRegisterSizePasses(optimizer);
+            break;
+    }
 
-    if (!glslang_program_link(program, GLSLANG_MSG_SPV_RULES_BIT | GLSLANG_MSG_VULKAN_RULES_BIT)) {
-        ar_error("GLSLANG: Linking failed.");
-        ar_error("%s", glslang_program_get_info_log(program));
-        ar_error("%s", glslang_program_get_info_debug_log(program));
-        glslang_program_delete(program);
-        glslang_shader_delete(vertex_shader);
-        glslang_shader_delete(fragment_shader);
-        return (CompiledShader) {0};
+    spv_optimizer_options options = spvOptimizerOptionsCreate();
+    spvOptimizerOptionsSetRunValidator(options, true);
+
+    spv_binary binary = NULL;
+    B8 success = spvOptimizerRun(optimizer, (const U32 *) spv.data, spv.len / sizeof(U32), &binary, options) == SPV_SUCCESS;
+    if (success) {
+        U64 len = binary->wordCount * sizeof(U32);
+        U8 *data = ar_arena_push_arr_no_zero(arena, U8, len);
+        memcpy(data, binary->code, len);
+        *optimized = ar_str(data, len);
     }
 
-    glslang_program_SPIRV_generate(program, GLSLANG_STAGE_VERTEX);
+    spvBinaryDestroy(binary);
+    spvOptimizerOptionsDestroy(options);
+    spvOptimizerDestroy(optimizer);
+    return success;
+}
+
+typedef struct LinkJob LinkJob;
+
+typedef struct StageJob StageJob;
+struct StageJob {
+    ShaderType type;
+    ArStr glsl;
+    // Variant defines, see variant_preamble.
+    ArStr preamble;
+    ShaderCache *cache;
+    OptimizeLevel optimize;
+    // Owned by the stage so that both stages can allocate without locking.
+    ArArena *arena;
+    // Errors of this stage when the caller collects them, NULL otherwise.
+    Diagnostics *diagnostics;
+    // Cache key, only set with a cache.
+    U8 key[SHA256_SIZE];
+    // Parsed on a cache miss, linked by the owner, which then generates the
+    // stage's SPIR-V.
+    glslang_shader_t *shader;
+    LinkJob *owner;
+    B8 cached;
+    // Preprocessing or parsing failed.
+    B8 failed;
+
+    B8 success;
+    ArStr spv;
+    U64 unoptimized_size;
+    ReflectedStage reflection;
+};
+
+// Hashes the tool version, the glslang settings, the optimization level, the
+// variant defines and the expanded source.
+static void stage_cache_key(ArStr glsl, ArStr preamble, ShaderType type, OptimizeLevel optimize, U8 key[SHA256_SIZE]) {
+    Sha256 ctx;
+    sha256_init(&ctx);
+
+    sha256_update(&ctx, ARKIN_SHADER_VERSION, sizeof(ARKIN_SHADER_VERSION));
+
+    const U32 settings[] = {
+        glslang_stage(type),
+        BASE_INPUT.language,
+        BASE_INPUT.client,
+        BASE_INPUT.client_version,
+        BASE_INPUT.target_language,
+        BASE_INPUT.target_language_version,
+        BASE_INPUT.default_version,
+        BASE_INPUT.default_profile,
+        BASE_INPUT.force_default_version_and_profile,
+        BASE_INPUT.forward_compatible,
+        BASE_INPUT.messages,
+        optimize,
+    };
+    for (U32 i = 0; i < ar_arrlen(settings); i++) {
+        U8 bytes[4] = { settings[i], settings[i] >> 8, settings[i] >> 16, settings[i] >> 24 };
+        sha256_update(&ctx, bytes, sizeof(bytes));
+    }
+
+    U8 preamble_len[8];
+    for (U32 i = 0; i < sizeof(preamble_len); i++) {
+        preamble_len[i] = (U64) preamble.len >> (i*8);
+    }
+    sha256_update(&ctx, preamble_len, sizeof(preamble_len));
+    sha256_update(&ctx, preamble.data, preamble.len);
+    sha256_update(&ctx, glsl.data, glsl.len);
+    sha256_final(&ctx, key);
+}
+
+// Looks the stage up in the cache, and preprocesses and parses it on a miss.
+// Stages don't share any glslang state so they can run concurrently.
+static void parse_stage(void *item) {
+    StageJob *job = item;
+    Diagnostics *previous = diagnostics_swap(job->diagnostics);
+
+    if (job->cache != NULL) {
+        stage_cache_key(job->glsl, job->preamble, job->type, job->optimize, job->key);
+
+        CompiledStage cached;
+        if (shader_cache_get(job->cache, job->arena, job->key, &cached)) {
+            job->spv = cached.spv;
+            job->unoptimized_size = cached.unoptimized_size;
+            job->reflection = cached.reflection;
+            job->cached = true;
+            job->success = true;
+            diagnostics_swap(previous);
+            return;
+        }
+    }
+
+    job->shader = create_shader(job->arena, job->glsl, job->preamble, job->type);
+    job->failed = job->shader == NULL;
+    diagnostics_swap(previous);
+}
+
+// Generates SPIR-V for and reflects a stage of the linked 'program'.
+static void generate_stage(StageJob *job, glslang_program_t *program, Reflector *reflector) {
+    glslang_program_SPIRV_generate(program, glslang_stage(job->type));
     U64 len = glslang_program_SPIRV_get_size(program) * sizeof(U32);
-    U8 *data = ar_arena_push_arr_no_zero(arena, U8, len);
+    U8 *data = ar_arena_push_arr_no_zero(job->arena, U8, len);
     glslang_program_SPIRV_get(program, (U32 *) data);
     const char *spirv_messages = glslang_program_SPIRV_get_messages(program);
-    if (spirv_messages != NULL) {
+    if (spirv_messages != NULL && diagnostics_current() == NULL) {
         ar_info("GLSLANG SPIR-V messages: %s", spirv_messages);
     }
-    ArStr vertex_spv = ar_str(data, len);
 
-    glslang_program_SPIRV_generate(program, GLSLANG_STAGE_FRAGMENT);
-    len = glslang_program_SPIRV_get_size(program) * sizeof(U32);
-    data = ar_arena_push_arr_no_zero(arena, U8, len);
-    glslang_program_SPIRV_get(program, (U32 *) data);
-    spirv_messages = glslang_program_SPIRV_get_messages(program);
-    if (spirv_messages != NULL) {
-        ar_info("GLSLANG SPIR-V messages: %s", spirv_messages);
+    // Reflect before optimizing, '-Os' strips the names.
+    job->spv = ar_str(data, len);
+    job->unoptimized_size = len;
+    job->reflection = reflector_reflect(reflector, job->arena, job->spv);
+
+    if (job->optimize != OPTIMIZE_NONE && !optimize_spv(job->arena, job->spv, job->optimize, &job->spv)) {
+        report_error("SPIRV-Tools: Optimization failed.");
+        return;
+    }
+    job->success = true;
+
+    if (job->cache != NULL) {
+        shader_cache_put(job->cache, job->key, (CompiledStage) {
+                .spv = job->spv,
+                .unoptimized_size = job->unoptimized_size,
+                .reflection = job->reflection,
+            });
     }
-    ArStr fragment_spv = ar_str(data, len);
+}
+
+// A glslang program, either the vertex and fragment stage of a graphics
+// program or a compute stage alone. Programs and variants using the same
+// pair of jobs share the link.
+struct LinkJob {
+    // Of the first program or variant using the link, for errors.
+    ArStr name;
+    StageJob *stages[2];
+    U32 stage_count;
+    ArArena *arena;
+    Diagnostics *diagnostics;
+    B8 success;
+};
 
+// Links the program once, which gives the glslang cross-stage checks such as
+// block and interpolation qualifier mismatches, then generates the stages it
+// owns from it. Stages it doesn't own, or that came out of the cache, are
+// parsed again: a parsed shader can only go into one program, linking
+// changes its tree. The cache remembers pairs that linked before.
+static void link_program(void *item) {
+    LinkJob *link = item;
+    Diagnostics *previous = diagnostics_swap(link->diagnostics);
+
+    // Their errors are reported already.
+    B8 all_cached = true;
+    for (U32 i = 0; i < link->stage_count; i++) {
+        if (link->stages[i]->failed) {
+            diagnostics_swap(previous);
+            return;
+        }
+        all_cached &= link->stages[i]->cached;
+    }
+
+    ShaderCache *cache = link->stages[0]->cache;
+    U8 key[SHA256_SIZE];
+    if (cache != NULL) {
+        Sha256 ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, "link", 4);
+        for (U32 i = 0; i < link->stage_count; i++) {
+            sha256_update(&ctx, link->stages[i]->key, SHA256_SIZE);
+        }
+        sha256_final(&ctx, key);
+
+        // A lone stage has nothing to check against.
+        CompiledStage linked;
+        if (all_cached && (link->stage_count == 1 || shader_cache_get(cache, link->arena, key, &linked))) {
+            link->success = true;
+            diagnostics_swap(previous);
+            return;
+        }
+    }
+
+    glslang_shader_t *fresh[2] = {0};
+    glslang_program_t *program = glslang_program_create();
+    B8 parsed = true;
+    for (U32 i = 0; i < link->stage_count; i++) {
+        StageJob *job = link->stages[i];
+        glslang_shader_t *shader = job->owner == link ? job->shader : NULL;
+        if (shader == NULL) {
+            shader = fresh[i] = create_shader(link->arena, job->glsl, job->preamble, job->type);
+        }
+        if (shader == NULL) {
+            parsed = false;
+            break;
+        }
+        glslang_program_add_shader(program, shader);
+    }
+
+    if (parsed && glslang_program_link(program, GLSLANG_MSG_SPV_RULES_BIT | GLSLANG_MSG_VULKAN_RULES_BIT)) {
+        link->success = true;
+        Reflector *reflector = reflector_thread();
+        for (U32 i = 0; i < link->stage_count; i++) {
+            if (link->stages[i]->owner == link && link->stages[i]->shader != NULL) {
+                generate_stage(link->stages[i], program, reflector);
+            }
+        }
+    } else if (parsed) {
+        report_error("%.*s: GLSLANG: Linking failed.", (I32) link->name.len, link->name.data);
+        report_error("%s", glslang_program_get_info_log(program));
+        report_error("%s", glslang_program_get_info_debug_log(program));
+    }
     glslang_program_delete(program);
-    glslang_shader_delete(vertex_shader);
-    glslang_shader_delete(fragment_shader);
 
-    glslang_finalize_process();
+    for (U32 i = 0; i < link->stage_count; i++) {
+        StageJob *job = link->stages[i];
+        if (fresh[i] != NULL) {
+            glslang_shader_delete(fresh[i]);
+        }
+        if (job->owner == link && job->shader != NULL) {
+            glslang_shader_delete(job->shader);
+            job->shader = NULL;
+        }
+    }
+
+    // An empty entry, only its presence matters.
+    if (link->success && cache != NULL && link->stage_count > 1) {
+        shader_cache_put(cache, key, (CompiledStage) {0});
+    }
+    diagnostics_swap(previous);
+}
+
+typedef struct WorkQueue WorkQueue;
+struct WorkQueue {
+    void (*run)(void *item);
+    U8 *items;
+    U64 item_size;
+    U32 count;
+    // Index of the next item to take, shared by the threads.
+    U32 next;
+};
+
+static void *queue_worker(void *userdata) {
+    WorkQueue *queue = userdata;
+    while (true) {
+        U32 i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (i >= queue->count) {
+            break;
+        }
+        queue->run(&queue->items[i * queue->item_size]);
+    }
+    return NULL;
+}
+
+// Items don't depend on each other, so they're spread over up to 'threads'
+// threads, this one included. 0 uses one per CPU.
+static void run_queue(ArArena *arena, WorkQueue *queue, U32 threads) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    U32 thread_count = threads != 0 ? threads : cpu_count();
+    thread_count = ar_min(queue->count, thread_count);
+    thread_count = thread_count > 0 ? thread_count - 1 : 0;
+    pthread_t *handles = ar_arena_push_arr_no_zero(scratch.arena, pthread_t, thread_count);
+    U32 started = 0;
+    while (started < thread_count && pthread_create(&handles[started], NULL, queue_worker, queue) == 0) {
+        started++;
+    }
+    queue_worker(queue);
+    for (U32 i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    ar_scratch_release(&scratch);
+}
+
+// Every fragment input needs a vertex output of the same type at the same
+// location.
+static B8 link_stages(ArStr name, ReflectedStage vertex, ReflectedStage fragment) {
+    B8 success = true;
+    for (U32 i = 0; i < fragment.input_count; i++) {
+        ReflectedVariable input = fragment.inputs[i];
+
+        ReflectedVariable *output = NULL;
+        for (U32 j = 0; j < vertex.output_count; j++) {
+            if (vertex.outputs[j].location == input.location) {
+                output = &vertex.outputs[j];
+                break;
+            }
+        }
+
+        if (output == NULL) {
+            report_error("%.*s: Linking failed: Fragment input %.*s (location = %u) has no matching vertex output.",
+                    (I32) name.len, name.data,
+                    (I32) input.type.name.len, input.type.name.data, input.location);
+            success = false;
+        } else if (!reflected_type_eq(output->type, input.type)) {
+            report_error("%.*s: Linking failed: Fragment input %.*s and vertex output %.*s (location = %u) have different types.",
+                    (I32) name.len, name.data,
+                    (I32) input.type.name.len, input.type.name.data,
+                    (I32) output->type.name.len, output->type.name.data,
+                    input.location);
+            success = false;
+        }
+    }
 
+    return success;
+}
+
+U32 variant_count(const VariantAxis *axes, U32 axis_count) {
+    U32 count = 1;
+    for (U32 i = 0; i < axis_count; i++) {
+        count *= axes[i].value_count != 0 ? axes[i].value_count : 2;
+    }
+    return count;
+}
+
+U32 variant_first_key(const CompiledStage *variants, U32 key) {
+    for (U32 i = 0; i < key; i++) {
+        if (variants[i].spv.data == variants[key].spv.data) {
+            return i;
+        }
+    }
+    return key;
+}
+
+// Defines of variant 'key', null terminated. Empty without axes.
+static ArStr variant_preamble(ArArena *arena, const VariantAxis *axes, U32 axis_count, U32 key) {
+    if (axis_count == 0) {
+        return (ArStr) {0};
+    }
+
+    Buffer preamble = { .arena = arena };
+    for (U32 i = 0; i < axis_count; i++) {
+        VariantAxis axis = axes[i];
+        U32 states = axis.value_count != 0 ? axis.value_count : 2;
+        for (U32 j = 0; j < axis.value_count; j++) {
+            buffer_pushf(&preamble, "#define %.*s_%.*s %u\n",
+                    (I32) axis.name.len, axis.name.data,
+                    (I32) axis.values[j].len, axis.values[j].data,
+                    j);
+        }
+        buffer_pushf(&preamble, "#define %.*s %u\n", (I32) axis.name.len, axis.name.data, key % states);
+        key /= states;
+    }
+    buffer_push(&preamble, "", 1);
+    return ar_str(preamble.data, preamble.len - 1);
+}
+
+// Jobs of a single program, indexed by variant key.
+typedef struct ProgramJobs ProgramJobs;
+struct ProgramJobs {
+    U32 *vertex;
+    U32 *fragment;
+    U32 *compute;
+    // LinkJob of each variant.
+    U32 *link;
+};
+
+// Index of the job compiling 'stage' with 'preamble', adding it the first
+// time the pair comes up.
+static U32 stage_job(ArArena *arena, ArHashMap *job_map, Buffer *jobs, ParsedStage stage, U32 stage_index, ArStr preamble, CompileOptions options) {
+    ArStr key = ar_str_pushf(arena, "%u\n%.*s", stage_index, (I32) preamble.len, preamble.data);
+    U32 index = ar_hash_map_get(job_map, key, U32);
+    if (index != 0) {
+        return index - 1;
+    }
+
+    StageJob job = {
+        .type = stage.type,
+        .glsl = stage.source,
+        .preamble = preamble,
+        .cache = options.cache,
+        .optimize = options.optimize,
+        .arena = ar_arena_create_default(),
+    };
+    buffer_push(jobs, &job, sizeof(job));
+    index = jobs->len / sizeof(StageJob);
+    ar_hash_map_insert(job_map, key, index);
+    return index - 1;
+}
+
+// Index of the link of jobs 'stages', adding it the first time they come up.
+static U32 link_job(ArArena *arena, ArHashMap *link_map, Buffer *links, ArStr name, StageJob *jobs, const U32 *stages, U32 stage_count) {
+    ArStr key = stage_count == 1 ? ar_str_pushf(arena, "%u", stages[0]) : ar_str_pushf(arena, "%u %u", stages[0], stages[1]);
+    U32 index = ar_hash_map_get(link_map, key, U32);
+    if (index != 0) {
+        return index - 1;
+    }
+
+    LinkJob link = {
+        .name = name,
+        .stage_count = stage_count,
+        .arena = ar_arena_create_default(),
+    };
+    for (U32 i = 0; i < stage_count; i++) {
+        link.stages[i] = &jobs[stages[i]];
+    }
+    buffer_push(links, &link, sizeof(link));
+    index = links->len / sizeof(LinkJob);
+    ar_hash_map_insert(link_map, key, index);
+    return index - 1;
+}
+
+static CompiledShader program_base(ParsedProgram program) {
+    U32 count = variant_count(program.axes, program.axis_count);
     return (CompiledShader) {
-        .name = shader.program.name,
-        .vertex = {
-            .spv = vertex_spv,
-            .reflection = reflect_spv(arena, vertex_spv),
-        },
-        .fragment = {
-            .spv = fragment_spv,
-            .reflection = reflect_spv(arena, fragment_spv),
-        },
+        .name = program.name,
+        .type = program.type,
+        .axes = program.axes,
+        .axis_count = program.axis_count,
+        .variant_count = count,
     };
 }
+
+static void assemble_compute(ArArena *arena, ParsedProgram program, ProgramJobs jobs, const CompiledStage *stages, CompiledShader *compiled) {
+    *compiled = program_base(program);
+    compiled->compute_variants = ar_arena_push_arr_no_zero(arena, CompiledStage, compiled->variant_count);
+    for (U32 key = 0; key < compiled->variant_count; key++) {
+        compiled->compute_variants[key] = stages[jobs.compute[key]];
+    }
+    compiled->compute = compiled->compute_variants[0];
+}
+
+// Checks the interface of every variant, returns false if any of them doesn't
+// match or didn't link. Variants with the same pair of jobs are only checked
+// once.
+static B8 assemble_graphics(ArArena *arena, ParsedProgram program, ProgramJobs jobs, const LinkJob *links, const CompiledStage *stages, CompiledShader *compiled) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    *compiled = program_base(program);
+    compiled->vertex_variants = ar_arena_push_arr_no_zero(arena, CompiledStage, compiled->variant_count);
+    compiled->fragment_variants = ar_arena_push_arr_no_zero(arena, CompiledStage, compiled->variant_count);
+
+    B8 linked = true;
+    for (U32 key = 0; key < compiled->variant_count; key++) {
+        CompiledStage vertex = stages[jobs.vertex[key]];
+        CompiledStage fragment = stages[jobs.fragment[key]];
+        B8 seen = false;
+        for (U32 i = 0; i < key && !seen; i++) {
+            seen = jobs.vertex[i] == jobs.vertex[key] && jobs.fragment[i] == jobs.fragment[key];
+        }
+        if (!seen) {
+            ArStr name = key == 0 ? program.name : ar_str_pushf(scratch.arena, "%.*s (variant %u)", (I32) program.name.len, program.name.data, key);
+            linked &= link_stages(name, vertex.reflection, fragment.reflection);
+            linked &= links[jobs.link[key]].success;
+        }
+        compiled->vertex_variants[key] = vertex;
+        compiled->fragment_variants[key] = fragment;
+    }
+    compiled->vertex = compiled->vertex_variants[0];
+    compiled->fragment = compiled->fragment_variants[0];
+
+    ar_scratch_release(&scratch);
+    return linked;
+}
+
+static U32 unique_variants(const CompiledStage *variants, U32 count) {
+    U32 unique = 0;
+    for (U32 key = 0; key < count; key++) {
+        unique += variant_first_key(variants, key) == key;
+    }
+    return unique;
+}
+
+static void log_program(CompiledShader compiled, CompileOptions options) {
+    ArStr name = compiled.name;
+    if (options.optimize != OPTIMIZE_NONE && compiled.type == PROGRAM_TYPE_COMPUTE) {
+        ar_info("%.*s: Compute %llu -> %llu bytes.",
+                (I32) name.len, name.data,
+                (unsigned long long) compiled.compute.unoptimized_size,
+                (unsigned long long) compiled.compute.spv.len);
+    } else if (options.optimize != OPTIMIZE_NONE) {
+        ar_info("%.*s: Vertex %llu -> %llu bytes, fragment %llu -> %llu bytes.",
+                (I32) name.len, name.data,
+                (unsigned long long) compiled.vertex.unoptimized_size,
+                (unsigned long long) compiled.vertex.spv.len,
+                (unsigned long long) compiled.fragment.unoptimized_size,
+                (unsigned long long) compiled.fragment.spv.len);
+    }
+
+    if (compiled.variant_count > 1 && compiled.type == PROGRAM_TYPE_COMPUTE) {
+        ar_info("%.*s: %u variants, %u unique compute stages.",
+                (I32) name.len, name.data, compiled.variant_count,
+                unique_variants(compiled.compute_variants, compiled.variant_count));
+    } else if (compiled.variant_count > 1) {
+        ar_info("%.*s: %u variants, %u unique vertex and %u unique fragment stages.",
+                (I32) name.len, name.data, compiled.variant_count,
+                unique_variants(compiled.vertex_variants, compiled.variant_count),
+                unique_variants(compiled.fragment_variants, compiled.variant_count));
+    }
+}
+
+// Everything a CompiledStage holds, serialized. Byte-identical SPIR-V alone
+// isn't enough to share a stage, '-Os' strips the names reflection sees.
+static ArStr stage_identity(ArArena *arena, const StageJob *job) {
+    Buffer identity = { .arena = arena };
+    buffer_push_u64(&identity, job->unoptimized_size);
+    buffer_push_u64(&identity, job->spv.len);
+    buffer_push(&identity, job->spv.data, job->spv.len);
+    serialize_reflected_stage(&identity, job->reflection);
+    return buffer_str(identity);
+}
+
+B8 compile_shader(ArArena *arena, ParsedShader shader, CompileOptions options, CompiledShader **programs) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // One job per unique stage and variant defines. Programs sharing a
+    // module, and variants that don't change the defines a stage sees, share
+    // the job. Job index + 1 by key.
+    ArHashMapDesc job_map_desc = {
+        .arena = scratch.arena,
+        .capacity = 32,
+
+        .hash_func = hash_str,
+        .eq_func = str_eq,
+
+        .key_size = sizeof(ArStr),
+        .value_size = sizeof(U32),
+        .null_value = &(U32) {0},
+    };
+    ArHashMap *job_map = ar_hash_map_init(job_map_desc);
+    Buffer job_buffer = { .arena = scratch.arena };
+
+    ProgramJobs *program_jobs = ar_arena_push_arr(scratch.arena, ProgramJobs, shader.program_count);
+    for (U64 i = 0; i < shader.program_count; i++) {
+        ParsedProgram program = shader.programs[i];
+        U32 count = variant_count(program.axes, program.axis_count);
+        ProgramJobs *pjobs = &program_jobs[i];
+        if (program.type == PROGRAM_TYPE_COMPUTE) {
+            pjobs->compute = ar_arena_push_arr_no_zero(scratch.arena, U32, count);
+        } else {
+            pjobs->vertex = ar_arena_push_arr_no_zero(scratch.arena, U32, count);
+            pjobs->fragment = ar_arena_push_arr_no_zero(scratch.arena, U32, count);
+        }
+        for (U32 key = 0; key < count; key++) {
+            ArStr preamble = variant_preamble(scratch.arena, program.axes, program.axis_count, key);
+            if (program.type == PROGRAM_TYPE_COMPUTE) {
+                pjobs->compute[key] = stage_job(scratch.arena, job_map, &job_buffer,
+                        shader.stages[program.compute], program.compute, preamble, options);
+            } else {
+                pjobs->vertex[key] = stage_job(scratch.arena, job_map, &job_buffer,
+                        shader.stages[program.vertex], program.vertex, preamble, options);
+                pjobs->fragment[key] = stage_job(scratch.arena, job_map, &job_buffer,
+                        shader.stages[program.fragment], program.fragment, preamble, options);
+            }
+        }
+    }
+    StageJob *jobs = (StageJob *) job_buffer.data;
+    U32 job_count = job_buffer.len / sizeof(StageJob);
+
+    // One link per unique pair of jobs, in the order programs and variants
+    // first use them. Each job is owned by the first link using it.
+    ArHashMap *link_map = ar_hash_map_init(job_map_desc);
+    Buffer link_buffer = { .arena = scratch.arena };
+    for (U64 i = 0; i < shader.program_count; i++) {
+        ParsedProgram program = shader.programs[i];
+        U32 count = variant_count(program.axes, program.axis_count);
+        ProgramJobs *pjobs = &program_jobs[i];
+        pjobs->link = ar_arena_push_arr_no_zero(scratch.arena, U32, count);
+        for (U32 key = 0; key < count; key++) {
+            ArStr name = key == 0 ? program.name : ar_str_pushf(scratch.arena, "%.*s (variant %u)", (I32) program.name.len, program.name.data, key);
+            if (program.type == PROGRAM_TYPE_COMPUTE) {
+                pjobs->link[key] = link_job(scratch.arena, link_map, &link_buffer, name, jobs, &pjobs->compute[key], 1);
+            } else {
+                U32 pair[] = { pjobs->vertex[key], pjobs->fragment[key] };
+                pjobs->link[key] = link_job(scratch.arena, link_map, &link_buffer, name, jobs, pair, 2);
+            }
+        }
+    }
+    LinkJob *links = (LinkJob *) link_buffer.data;
+    U32 link_count = link_buffer.len / sizeof(LinkJob);
+    for (U32 i = 0; i < link_count; i++) {
+        for (U32 j = 0; j < links[i].stage_count; j++) {
+            if (links[i].stages[j]->owner == NULL) {
+                links[i].stages[j]->owner = &links[i];
+            }
+        }
+    }
+
+    // Each job and link collects into its own Diagnostics, merged in order
+    // once all are done.
+    Diagnostics *diagnostics = diagnostics_current();
+    Diagnostics *job_diagnostics = ar_arena_push_arr(scratch.arena, Diagnostics, job_count);
+    Diagnostics *link_diagnostics = ar_arena_push_arr(scratch.arena, Diagnostics, link_count);
+    if (diagnostics != NULL) {
+        for (U32 i = 0; i < job_count; i++) {
+            job_diagnostics[i].arena = jobs[i].arena;
+            jobs[i].diagnostics = &job_diagnostics[i];
+        }
+        for (U32 i = 0; i < link_count; i++) {
+            link_diagnostics[i].arena = links[i].arena;
+            links[i].diagnostics = &link_diagnostics[i];
+        }
+    }
+
+    // Stages are parsed in parallel, then every program is linked once, also
+    // in parallel, and generates the stages it owns.
+    WorkQueue parse_queue = {
+        .run = parse_stage,
+        .items = (U8 *) jobs,
+        .item_size = sizeof(StageJob),
+        .count = job_count,
+    };
+    run_queue(scratch.arena, &parse_queue, options.threads);
+    WorkQueue link_queue = {
+        .run = link_program,
+        .items = (U8 *) links,
+        .item_size = sizeof(LinkJob),
+        .count = link_count,
+    };
+    run_queue(scratch.arena, &link_queue, options.threads);
+
+    if (diagnostics != NULL) {
+        for (U32 i = 0; i < job_count; i++) {
+            for (ArStrListNode *curr = job_diagnostics[i].errors.first; curr != NULL; curr = curr->next) {
+                diagnostics_report("%.*s", (I32) curr->str.len, curr->str.data);
+            }
+        }
+        for (U32 i = 0; i < link_count; i++) {
+            for (ArStrListNode *curr = link_diagnostics[i].errors.first; curr != NULL; curr = curr->next) {
+                diagnostics_report("%.*s", (I32) curr->str.len, curr->str.data);
+            }
+        }
+    }
+
+    // Copied once, identical stages of different jobs included. Job index + 1
+    // by stage_identity.
+    ArHashMap *spv_map = ar_hash_map_init(job_map_desc);
+    B8 success = true;
+    CompiledStage *stages = ar_arena_push_arr(scratch.arena, CompiledStage, job_count);
+    for (U32 i = 0; i < job_count; i++) {
+        if (!jobs[i].success) {
+            success = false;
+            continue;
+        }
+
+        ArStr identity = stage_identity(scratch.arena, &jobs[i]);
+        U32 first = ar_hash_map_get(spv_map, identity, U32);
+        if (first != 0) {
+            stages[i] = stages[first - 1];
+            continue;
+        }
+        U32 index = i + 1;
+        ar_hash_map_insert(spv_map, identity, index);
+        stages[i] = (CompiledStage) {
+            .spv = ar_str_push_copy(arena, jobs[i].spv),
+            .unoptimized_size = jobs[i].unoptimized_size,
+            .reflection = reflected_stage_copy(arena, jobs[i].reflection),
+        };
+    }
+
+    // Interfaces are only checked once every stage compiled, but every
+    // program is checked to report all mismatches at once.
+    *programs = ar_arena_push_arr(arena, CompiledShader, shader.program_count);
+    B8 compiled_stages = success;
+    for (U64 i = 0; i < shader.program_count && compiled_stages; i++) {
+        ParsedProgram program = shader.programs[i];
+        CompiledShader *compiled = &(*programs)[i];
+        if (program.type == PROGRAM_TYPE_COMPUTE) {
+            assemble_compute(arena, program, program_jobs[i], stages, compiled);
+        } else if (!assemble_graphics(arena, program, program_jobs[i], links, stages, compiled)) {
+            *compiled = (CompiledShader) {0};
+            success = false;
+            continue;
+        }
+
+        if (diagnostics == NULL) {
+            log_program(*compiled, options);
+        }
+    }
+
+    // Owners delete the shaders they link.
+    for (U32 i = 0; i < job_count; i++) {
+        ar_arena_destroy(&jobs[i].arena);
+    }
+    for (U32 i = 0; i < link_count; i++) {
+        ar_arena_destroy(&links[i].arena);
+    }
+    ar_scratch_release(&scratch);
+
+    return success;
+}
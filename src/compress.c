@@ -0,0 +1,585 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <time.h>
+
+// Packed stage layout:
+// U8 flags, bit 0 set if the payload is LZ compressed
+// Varint SPIR-V word count
+// Varint payload size, only if LZ compressed
+// Payload
+//
+// The payload starts with the five header words as varints. Every
+// instruction follows as a varint tag, 'opcode << 6 | result index << 4 |
+// min(word count, 15)', a varint 'word count - 15' if the count didn't fit,
+// and every operand as a varint. The result id operand is zigzag encoded as
+// the difference to the previous result id, which is usually small.
+//
+// LZ sequences, similar to LZ4: a token byte with the literal count in the
+// high nibble and 'match length - 4' in the low one, both extended by bytes
+// that are added on while they are 255. Then the literals, a U16 offset and
+// the match. The last sequence only has literals.
+#define PACK_FLAG_LZ 1
+#define SPV_HEADER_WORDS 5
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 14
+
+// Decode benchmark runs at least this long per stage.
+#define DECODE_BENCH_NS 100000000
+
+static void push_varint(Buffer *buffer, U32 value) {
+    U8 bytes[5];
+    U32 len = 0;
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value != 0) {
+            bytes[len] |= 0x80;
+        }
+        len++;
+    } while (value != 0);
+    buffer_push(buffer, bytes, len);
+}
+
+// glslang numbers ids as it creates them, so a result id is usually a little
+// above the previous one. Picks the first of the two operands a result id can
+// be in that looks like one, 0 if neither does. Guessing wrong only costs
+// size since the index is stored.
+#define RESULT_ID_WINDOW 64
+
+static U32 result_index(const U32 *instruction, U32 count, U32 last_result) {
+    for (U32 i = 1; i <= 2 && i < count; i++) {
+        if (instruction[i] > last_result && instruction[i] - last_result <= RESULT_ID_WINDOW) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+typedef struct PayloadWriter PayloadWriter;
+struct PayloadWriter {
+    Buffer payload;
+    U64 words_written;
+    // Largest 'output bytes written - payload bytes read' while decoding in
+    // place, see arkin_shader_decode.
+    I64 max_overtake;
+};
+
+// Called after the bytes of every output word were pushed.
+static void word_done(PayloadWriter *writer) {
+    writer->words_written++;
+    I64 overtake = (I64) (writer->words_written * sizeof(U32)) - (I64) writer->payload.len;
+    if (overtake > writer->max_overtake) {
+        writer->max_overtake = overtake;
+    }
+}
+
+// Returns false if the module is malformed.
+static B8 encode_payload(PayloadWriter *writer, const U32 *words, U64 word_count) {
+    if (word_count < SPV_HEADER_WORDS) {
+        return false;
+    }
+
+    for (U32 i = 0; i < SPV_HEADER_WORDS; i++) {
+        push_varint(&writer->payload, words[i]);
+        word_done(writer);
+    }
+
+    U32 last_result = 0;
+    U64 i = SPV_HEADER_WORDS;
+    while (i < word_count) {
+        U32 opcode = words[i] & 0xffff;
+        U32 count = words[i] >> 16;
+        if (count == 0 || count > word_count - i) {
+            return false;
+        }
+        U32 index = result_index(&words[i], count, last_result);
+
+        push_varint(&writer->payload, opcode << 6 | index << 4 | ar_min(count, 15));
+        if (count >= 15) {
+            push_varint(&writer->payload, count - 15);
+        }
+        word_done(writer);
+
+        for (U32 j = 1; j < count; j++) {
+            U32 word = words[i + j];
+            if (j == index) {
+                I32 delta = (I32) (word - last_result);
+                last_result = word;
+                word = ((U32) delta << 1) ^ (U32) (delta >> 31);
+            }
+            push_varint(&writer->payload, word);
+            word_done(writer);
+        }
+        i += count;
+    }
+    return true;
+}
+
+static void push_lz_length(Buffer *buffer, U64 length) {
+    while (length >= 255) {
+        U8 byte = 255;
+        buffer_push(buffer, &byte, 1);
+        length -= 255;
+    }
+    U8 byte = length;
+    buffer_push(buffer, &byte, 1);
+}
+
+static void push_lz_sequence(Buffer *out, const U8 *literals, U64 literal_count, U64 offset, U64 match) {
+    U8 token = ar_min(literal_count, 15) << 4;
+    if (match != 0) {
+        token |= ar_min(match - LZ_MIN_MATCH, 15);
+    }
+    buffer_push(out, &token, 1);
+    if (literal_count >= 15) {
+        push_lz_length(out, literal_count - 15);
+    }
+    buffer_push(out, literals, literal_count);
+
+    if (match != 0) {
+        U8 offset_bytes[2] = { offset, offset >> 8 };
+        buffer_push(out, offset_bytes, 2);
+        if (match - LZ_MIN_MATCH >= 15) {
+            push_lz_length(out, match - LZ_MIN_MATCH - 15);
+        }
+    }
+}
+
+static U32 lz_hash(const U8 *data) {
+    U32 value;
+    memcpy(&value, data, sizeof(value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Greedy single candidate matcher. Not the best ratio, but the decoder stays
+// trivial and the payload is already dense.
+static void lz_compress(Buffer *out, ArStr in) {
+    ArTemp scratch = ar_scratch_get(&out->arena, 1);
+    // Positions are stored off by one so that 0 means empty.
+    U32 *table = ar_arena_push_arr(scratch.arena, U32, 1 << LZ_HASH_BITS);
+
+    U64 literal_start = 0;
+    U64 i = 0;
+    while (i + LZ_MIN_MATCH <= in.len) {
+        U32 hash = lz_hash(&in.data[i]);
+        U64 candidate = table[hash];
+        table[hash] = i + 1;
+
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET ||
+                memcmp(&in.data[candidate - 1], &in.data[i], LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        candidate--;
+
+        U64 match = LZ_MIN_MATCH;
+        while (i + match < in.len && in.data[candidate + match] == in.data[i + match]) {
+            match++;
+        }
+
+        push_lz_sequence(out, &in.data[literal_start], i - literal_start, i - candidate, match);
+        i += match;
+        literal_start = i;
+    }
+    push_lz_sequence(out, &in.data[literal_start], in.len - literal_start, 0, 0);
+
+    ar_scratch_release(&scratch);
+}
+
+B8 pack_spv(ArArena *arena, ArStr spv, Compression compression, PackedSpv *result) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    U64 word_count = spv.len / sizeof(U32);
+    U32 *words = ar_arena_push_arr_no_zero(scratch.arena, U32, word_count);
+    memcpy(words, spv.data, word_count * sizeof(U32));
+
+    PayloadWriter writer = { .payload = { .arena = scratch.arena } };
+    if (!encode_payload(&writer, words, word_count)) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    Buffer packed = { .arena = arena };
+    U8 flags = compression == COMPRESSION_SMOLV_LZ ? PACK_FLAG_LZ : 0;
+    buffer_push(&packed, &flags, 1);
+    push_varint(&packed, word_count);
+
+    U64 decode_words = word_count;
+    if (flags & PACK_FLAG_LZ) {
+        push_varint(&packed, writer.payload.len);
+        lz_compress(&packed, buffer_str(writer.payload));
+
+        // The payload is decompressed into the end of the output buffer,
+        // which needs room for it plus however far the output runs ahead of
+        // reading it.
+        U64 decode_bytes = ar_max(word_count * sizeof(U32), (U64) ar_max(writer.max_overtake, 0) + writer.payload.len);
+        decode_words = (decode_bytes + sizeof(U32) - 1) / sizeof(U32);
+    } else {
+        buffer_push(&packed, writer.payload.data, writer.payload.len);
+    }
+
+    ar_scratch_release(&scratch);
+    *result = (PackedSpv) {
+        .data = buffer_str(packed),
+        .word_count = word_count,
+        .decode_words = decode_words,
+    };
+    return true;
+}
+
+//
+// Decoder, mirrors SPV_DECODER_SOURCE.
+//
+
+static B8 read_varint(const U8 **src, const U8 *end, U32 *value) {
+    U32 result = 0;
+    for (U32 shift = 0; shift < 35; shift += 7) {
+        if (*src == end) {
+            return false;
+        }
+        U8 byte = *(*src)++;
+        result |= (U32) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static B8 read_lz_length(const U8 **src, const U8 *end, U64 *length) {
+    U8 byte;
+    do {
+        if (*src == end) {
+            return false;
+        }
+        byte = *(*src)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static B8 lz_decompress(const U8 *src, const U8 *end, U8 *dst, U64 dst_size) {
+    U8 *out = dst;
+    U8 *out_end = dst + dst_size;
+    while (src < end) {
+        U8 token = *src++;
+        U64 literals = token >> 4;
+        if (literals == 15 && !read_lz_length(&src, end, &literals)) {
+            return false;
+        }
+        if ((U64) (end - src) < literals || (U64) (out_end - out) < literals) {
+            return false;
+        }
+        memmove(out, src, literals);
+        out += literals;
+        src += literals;
+        if (src == end) {
+            break;
+        }
+
+        if (end - src < 2) {
+            return false;
+        }
+        U64 offset = src[0] | (U64) src[1] << 8;
+        src += 2;
+        U64 match = token & 15;
+        if (match == 15 && !read_lz_length(&src, end, &match)) {
+            return false;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (U64) (out - dst) || (U64) (out_end - out) < match) {
+            return false;
+        }
+        for (U64 i = 0; i < match; i++) {
+            out[i] = out[i - offset];
+        }
+        out += match;
+    }
+    return out == out_end;
+}
+
+// Decoding in place, a word may only be written over payload bytes already
+// read. Holds for a 'dst' of 'decode_words', a smaller one fails here.
+static B8 overtakes(B8 in_place, const U32 *out, const U8 *src) {
+    return in_place && (const U8 *) (out + 1) > src;
+}
+
+U64 unpack_spv(ArStr packed, U32 *dst, U64 dst_words) {
+    const U8 *src = packed.data;
+    const U8 *end = packed.data + packed.len;
+    U32 word_count;
+    if (src == end) {
+        return 0;
+    }
+    U8 flags = *src++;
+    if (!read_varint(&src, end, &word_count) || word_count < SPV_HEADER_WORDS || word_count > dst_words) {
+        return 0;
+    }
+
+    B8 in_place = (flags & PACK_FLAG_LZ) != 0;
+    if (in_place) {
+        U32 size;
+        if (!read_varint(&src, end, &size) || size > dst_words * sizeof(U32)) {
+            return 0;
+        }
+        U8 *payload = (U8 *) dst + dst_words * sizeof(U32) - size;
+        if (!lz_decompress(src, end, payload, size)) {
+            return 0;
+        }
+        src = payload;
+        end = payload + size;
+    }
+
+    U32 *out = dst;
+    U32 *out_end = dst + word_count;
+    for (U32 i = 0; i < SPV_HEADER_WORDS; i++) {
+        U32 word;
+        if (!read_varint(&src, end, &word) || overtakes(in_place, out, src)) {
+            return 0;
+        }
+        *out++ = word;
+    }
+
+    U32 last_result = 0;
+    while (out < out_end) {
+        U32 tag;
+        U32 count;
+        if (!read_varint(&src, end, &tag)) {
+            return 0;
+        }
+        count = tag & 15;
+        if (count == 15) {
+            U32 extra;
+            if (!read_varint(&src, end, &extra)) {
+                return 0;
+            }
+            count += extra;
+        }
+        if (count == 0 || count > (U64) (out_end - out) || overtakes(in_place, out, src)) {
+            return 0;
+        }
+
+        U32 index = (tag >> 4) & 3;
+        *out++ = count << 16 | tag >> 6;
+        for (U32 i = 1; i < count; i++) {
+            U32 word;
+            if (!read_varint(&src, end, &word) || overtakes(in_place, out, src)) {
+                return 0;
+            }
+            if (i == index) {
+                last_result += (word >> 1) ^ -(word & 1);
+                word = last_result;
+            }
+            *out++ = word;
+        }
+    }
+    return src == end ? word_count : 0;
+}
+
+static F64 elapsed_ns(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+}
+
+B8 verify_packed_spv(PackedSpv packed, ArStr spv) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    U32 *dst = ar_arena_push_arr_no_zero(scratch.arena, U32, packed.decode_words);
+    B8 success = unpack_spv(packed.data, dst, packed.decode_words) == packed.word_count &&
+        memcmp(dst, spv.data, spv.len) == 0;
+    ar_scratch_release(&scratch);
+    return success;
+}
+
+B8 benchmark_packed_spv(PackedSpv packed, ArStr spv, F64 *bytes_per_second) {
+    if (!verify_packed_spv(packed, spv)) {
+        return false;
+    }
+
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    U32 *dst = ar_arena_push_arr_no_zero(scratch.arena, U32, packed.decode_words);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    U64 iterations = 0;
+    F64 elapsed = 0;
+    do {
+        unpack_spv(packed.data, dst, packed.decode_words);
+        iterations++;
+        elapsed = elapsed_ns(start);
+    } while (elapsed < DECODE_BENCH_NS);
+    *bytes_per_second = spv.len * iterations / (elapsed / 1e9);
+
+    ar_scratch_release(&scratch);
+    return true;
+}
+
+// Emitted once per translation unit by every header with packed stages.
+// Keep in sync with unpack_spv.
+const char *SPV_DECODER_SOURCE =
+    "#ifndef ARKIN_SHADER_DECODER\n"
+    "#define ARKIN_SHADER_DECODER\n"
+    "\n"
+    "#include <stddef.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "static int arkin_shader_read_varint(const uint8_t **src, const uint8_t *end, uint32_t *value) {\n"
+    "    uint32_t result = 0;\n"
+    "    for (uint32_t shift = 0; shift < 35; shift += 7) {\n"
+    "        if (*src == end) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        uint8_t byte = *(*src)++;\n"
+    "        result |= (uint32_t) (byte & 0x7f) << shift;\n"
+    "        if (!(byte & 0x80)) {\n"
+    "            *value = result;\n"
+    "            return 1;\n"
+    "        }\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "static int arkin_shader_read_length(const uint8_t **src, const uint8_t *end, size_t *length) {\n"
+    "    uint8_t byte;\n"
+    "    do {\n"
+    "        if (*src == end) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        byte = *(*src)++;\n"
+    "        *length += byte;\n"
+    "    } while (byte == 255);\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "static int arkin_shader_unlz(const uint8_t *src, const uint8_t *end, uint8_t *dst, size_t dst_size) {\n"
+    "    uint8_t *out = dst;\n"
+    "    uint8_t *out_end = dst + dst_size;\n"
+    "    while (src < end) {\n"
+    "        uint8_t token = *src++;\n"
+    "        size_t literals = token >> 4;\n"
+    "        if (literals == 15 && !arkin_shader_read_length(&src, end, &literals)) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        if ((size_t) (end - src) < literals || (size_t) (out_end - out) < literals) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        memmove(out, src, literals);\n"
+    "        out += literals;\n"
+    "        src += literals;\n"
+    "        if (src == end) {\n"
+    "            break;\n"
+    "        }\n"
+    "\n"
+    "        if (end - src < 2) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        size_t offset = src[0] | (size_t) src[1] << 8;\n"
+    "        src += 2;\n"
+    "        size_t match = token & 15;\n"
+    "        if (match == 15 && !arkin_shader_read_length(&src, end, &match)) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        match += 4;\n"
+    "        if (offset == 0 || offset > (size_t) (out - dst) || (size_t) (out_end - out) < match) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        for (size_t i = 0; i < match; i++) {\n"
+    "            out[i] = out[i - offset];\n"
+    "        }\n"
+    "        out += match;\n"
+    "    }\n"
+    "    return out == out_end;\n"
+    "}\n"
+    "\n"
+    "// Decoding in place, a word may only be written over bytes already read.\n"
+    "static int arkin_shader_overtakes(int in_place, const uint32_t *out, const uint8_t *src) {\n"
+    "    return in_place && (const uint8_t *) (out + 1) > src;\n"
+    "}\n"
+    "\n"
+    "// Expands a packed stage into 'dst', which must hold at least the stage's\n"
+    "// '_DECODE_WORDS' words. Returns the SPIR-V word count, or 0 if 'src' is\n"
+    "// corrupt or 'dst' too small.\n"
+    "static size_t arkin_shader_decode(const uint8_t *src, size_t src_size, uint32_t *dst, size_t dst_words) {\n"
+    "    const uint8_t *end = src + src_size;\n"
+    "    uint32_t word_count;\n"
+    "    if (src == end) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "    uint8_t flags = *src++;\n"
+    "    if (!arkin_shader_read_varint(&src, end, &word_count) || word_count < 5 || word_count > dst_words) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "\n"
+    "    // Decompress into the end of 'dst' and expand from there. The encoder\n"
+    "    // sized '_DECODE_WORDS' so that the output never overtakes the input,\n"
+    "    // a smaller 'dst' is caught before it does.\n"
+    "    int in_place = flags & 1;\n"
+    "    if (in_place) {\n"
+    "        uint32_t size;\n"
+    "        if (!arkin_shader_read_varint(&src, end, &size) || size > dst_words*4) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        uint8_t *packed = (uint8_t *) dst + dst_words*4 - size;\n"
+    "        if (!arkin_shader_unlz(src, end, packed, size)) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        src = packed;\n"
+    "        end = packed + size;\n"
+    "    }\n"
+    "\n"
+    "    uint32_t *out = dst;\n"
+    "    uint32_t *out_end = dst + word_count;\n"
+    "    for (int i = 0; i < 5; i++) {\n"
+    "        uint32_t word;\n"
+    "        if (!arkin_shader_read_varint(&src, end, &word) || arkin_shader_overtakes(in_place, out, src)) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        *out++ = word;\n"
+    "    }\n"
+    "\n"
+    "    // Every instruction is a tag, 'opcode << 6 | result index << 4 | word\n"
+    "    // count', followed by its operands. The result id is stored as the\n"
+    "    // difference to the previous one.\n"
+    "    uint32_t last_result = 0;\n"
+    "    while (out < out_end) {\n"
+    "        uint32_t tag;\n"
+    "        uint32_t count;\n"
+    "        if (!arkin_shader_read_varint(&src, end, &tag)) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "        count = tag & 15;\n"
+    "        if (count == 15) {\n"
+    "            uint32_t extra;\n"
+    "            if (!arkin_shader_read_varint(&src, end, &extra)) {\n"
+    "                return 0;\n"
+    "            }\n"
+    "            count += extra;\n"
+    "        }\n"
+    "        if (count == 0 || count > (size_t) (out_end - out) || arkin_shader_overtakes(in_place, out, src)) {\n"
+    "            return 0;\n"
+    "        }\n"
+    "\n"
+    "        uint32_t result_index = (tag >> 4) & 3;\n"
+    "        *out++ = count << 16 | tag >> 6;\n"
+    "        for (uint32_t i = 1; i < count; i++) {\n"
+    "            uint32_t word;\n"
+    "            if (!arkin_shader_read_varint(&src, end, &word) || arkin_shader_overtakes(in_place, out, src)) {\n"
+    "                return 0;\n"
+    "            }\n"
+    "            if (i == result_index) {\n"
+    "                last_result += (word >> 1) ^ -(word & 1);\n"
+    "                word = last_result;\n"
+    "            }\n"
+    "            *out++ = word;\n"
+    "        }\n"
+    "    }\n"
+    "    return src == end ? word_count : 0;\n"
+    "}\n"
+    "\n"
+    "#endif\n";
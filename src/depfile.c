@@ -0,0 +1,52 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+// Escapes a path for use in a Makefile rule. Ninja reads the same syntax.
+static void push_escaped_path(Buffer *buffer, ArStr path) {
+    for (U64 i = 0; i < path.len; i++) {
+        U8 c = path.data[i];
+        switch (c) {
+            case ' ':
+            case '#':
+                buffer_push(buffer, "\\", 1);
+                break;
+            case '$':
+                buffer_push(buffer, "$", 1);
+                break;
+        }
+        buffer_push(buffer, &c, 1);
+    }
+}
+
+B8 write_depfile(const char *filepath, ArStr target, ArStr input, ArStrList dependencies) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    Buffer buffer = { .arena = scratch.arena };
+    push_escaped_path(&buffer, target);
+    buffer_push(&buffer, ":", 1);
+
+    buffer_push(&buffer, " ", 1);
+    push_escaped_path(&buffer, input);
+    for (ArStrListNode *curr = dependencies.first; curr != NULL; curr = curr->next) {
+        buffer_push(&buffer, " \\\n  ", 5);
+        push_escaped_path(&buffer, curr->str);
+    }
+    buffer_push(&buffer, "\n", 1);
+
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL) {
+        ar_error("Failed to open file %s.", filepath);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+    B8 success = fwrite(buffer.data, 1, buffer.len, fp) == buffer.len;
+    success &= fclose(fp) == 0;
+    if (!success) {
+        ar_error("Failed to write file %s.", filepath);
+    }
+
+    ar_scratch_release(&scratch);
+    return success;
+}
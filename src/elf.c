@@ -0,0 +1,254 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include <elf.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#define ELF_MACHINE EM_X86_64
+#elif defined(__aarch64__)
+#define ELF_MACHINE EM_AARCH64
+#elif defined(__riscv) && __riscv_xlen == 64
+#define ELF_MACHINE EM_RISCV
+#else
+#error "Unsupported architecture for ELF output."
+#endif
+
+// Section header indices.
+enum {
+    SECTION_NULL,
+    SECTION_RODATA,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_NOTE_GNU_STACK,
+
+    SECTION_COUNT,
+};
+
+// Alignment of every blob in '.rodata'. Enough for SIMD loads of the data.
+#define RODATA_ALIGN 16
+
+// Data already in '.rodata'. Programs sharing a stage point their symbols at
+// the same bytes.
+typedef struct Blob Blob;
+struct Blob {
+    const U8 *data;
+    U64 len;
+    U64 offset;
+};
+
+typedef struct ObjectWriter ObjectWriter;
+struct ObjectWriter {
+    Buffer rodata;
+    // Blob.
+    Buffer blobs;
+    // Global symbols only, the null symbol is added when writing the object.
+    Buffer symbols;
+    U32 symbol_count;
+    Buffer strtab;
+};
+
+static void pad_to(Buffer *buffer, U64 align) {
+    static const U8 zeroes[RODATA_ALIGN] = {0};
+    U64 padding = (align - buffer->len % align) % align;
+    buffer_push(buffer, zeroes, padding);
+}
+
+static U32 push_string(Buffer *strtab, ArStr str) {
+    U32 offset = strtab->len;
+    buffer_push(strtab, str.data, str.len);
+    buffer_push(strtab, "", 1);
+    return offset;
+}
+
+static void push_symbol(ObjectWriter *writer, ArStr name, U64 offset, U64 len) {
+    Elf64_Sym symbol = {
+        .st_name = push_string(&writer->strtab, name),
+        .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT),
+        .st_other = STV_DEFAULT,
+        .st_shndx = SECTION_RODATA,
+        .st_value = offset,
+        .st_size = len,
+    };
+    buffer_push(&writer->symbols, &symbol, sizeof(symbol));
+    writer->symbol_count++;
+}
+
+static void define_symbol(ObjectWriter *writer, ArStr name, const void *data, U64 len, U64 align) {
+    pad_to(&writer->rodata, align);
+    push_symbol(writer, name, writer->rodata.len, len);
+    buffer_push(&writer->rodata, data, len);
+}
+
+// 'NAME_STAGE_SUFFIX' holding 'data' and 'NAME_STAGE_SUFFIX_SIZE' holding its
+// length in bytes.
+static void define_blob(ObjectWriter *writer, ArArena *arena, ArStr name, const char *stage, const char *suffix, ArStr data) {
+    ArStr symbol = ar_str_pushf(arena, "%.*s_%s_%s", (I32) name.len, name.data, stage, suffix);
+    const Blob *blobs = (const Blob *) writer->blobs.data;
+    const Blob *blob = NULL;
+    for (U64 i = 0; i < writer->blobs.len / sizeof(Blob); i++) {
+        if (blobs[i].data == data.data && blobs[i].len == data.len) {
+            blob = &blobs[i];
+            break;
+        }
+    }
+    if (blob != NULL) {
+        push_symbol(writer, symbol, blob->offset, data.len);
+    } else {
+        pad_to(&writer->rodata, RODATA_ALIGN);
+        Blob new_blob = {
+            .data = data.data,
+            .len = data.len,
+            .offset = writer->rodata.len,
+        };
+        buffer_push(&writer->blobs, &new_blob, sizeof(new_blob));
+        define_symbol(writer, symbol, data.data, data.len, RODATA_ALIGN);
+    }
+
+    U8 size[sizeof(U64)];
+    for (U32 i = 0; i < sizeof(size); i++) {
+        size[i] = (U64) data.len >> (i*8);
+    }
+    ArStr size_symbol = ar_str_pushf(arena, "%.*s_SIZE", (I32) symbol.len, symbol.data);
+    define_symbol(writer, size_symbol, size, sizeof(size), sizeof(U64));
+}
+
+static void define_stage(ObjectWriter *writer, ArArena *arena, ArStr name, const char *stage_name, CompiledStage stage, OutputOptions options) {
+    define_blob(writer, arena, name, stage_name, "SPV", stage.spv);
+    if (options.embed_reflection) {
+        Buffer reflection = { .arena = arena };
+        serialize_reflected_stage(&reflection, stage.reflection);
+        define_blob(writer, arena, name, stage_name, "REFLECTION", buffer_str(reflection));
+    }
+}
+
+// Every unique variant past the base one, as 'NAME_VS_V<key>_SPV'.
+static void define_variants(ObjectWriter *writer, ArArena *arena, CompiledShader shader, const char *stage_name, const CompiledStage *variants, OutputOptions options) {
+    for (U32 key = 1; key < shader.variant_count; key++) {
+        if (variant_first_key(variants, key) != key) {
+            continue;
+        }
+        const char *variant_name = ar_str_to_cstr(arena, ar_str_pushf(arena, "%s_V%u", stage_name, key));
+        define_stage(writer, arena, shader.name, variant_name, variants[key], options);
+    }
+}
+
+void render_object(Buffer *out, const CompiledShader *programs, U64 program_count, OutputOptions options) {
+    ArTemp scratch = ar_scratch_get(&out->arena, 1);
+
+    ObjectWriter writer = {
+        .rodata = { .arena = scratch.arena },
+        .blobs = { .arena = scratch.arena },
+        .symbols = { .arena = scratch.arena },
+        .strtab = { .arena = scratch.arena },
+    };
+    buffer_push(&writer.strtab, "", 1);
+
+    for (U64 i = 0; i < program_count; i++) {
+        CompiledShader program = programs[i];
+        if (program.type == PROGRAM_TYPE_COMPUTE) {
+            define_stage(&writer, scratch.arena, program.name, "CS", program.compute, options);
+            define_variants(&writer, scratch.arena, program, "CS", program.compute_variants, options);
+            continue;
+        }
+        define_stage(&writer, scratch.arena, program.name, "VS", program.vertex, options);
+        define_stage(&writer, scratch.arena, program.name, "FS", program.fragment, options);
+        define_variants(&writer, scratch.arena, program, "VS", program.vertex_variants, options);
+        define_variants(&writer, scratch.arena, program, "FS", program.fragment_variants, options);
+    }
+
+    Buffer shstrtab = { .arena = scratch.arena };
+    buffer_push(&shstrtab, "", 1);
+    U32 rodata_name = push_string(&shstrtab, ar_str_lit(".rodata"));
+    U32 symtab_name = push_string(&shstrtab, ar_str_lit(".symtab"));
+    U32 strtab_name = push_string(&shstrtab, ar_str_lit(".strtab"));
+    U32 shstrtab_name = push_string(&shstrtab, ar_str_lit(".shstrtab"));
+    // Marks the object as not needing an executable stack.
+    U32 note_name = push_string(&shstrtab, ar_str_lit(".note.GNU-stack"));
+
+    // Layout: ELF header, .rodata, .symtab, .strtab, .shstrtab, section
+    // headers.
+    U64 start = out->len;
+    Elf64_Ehdr header = {0};
+    buffer_push(out, &header, sizeof(header));
+
+    pad_to(out, RODATA_ALIGN);
+    U64 rodata_offset = out->len - start;
+    buffer_push(out, writer.rodata.data, writer.rodata.len);
+
+    pad_to(out, sizeof(U64));
+    U64 symtab_offset = out->len - start;
+    Elf64_Sym null_symbol = {0};
+    buffer_push(out, &null_symbol, sizeof(null_symbol));
+    buffer_push(out, writer.symbols.data, writer.symbols.len);
+
+    U64 strtab_offset = out->len - start;
+    buffer_push(out, writer.strtab.data, writer.strtab.len);
+
+    U64 shstrtab_offset = out->len - start;
+    buffer_push(out, shstrtab.data, shstrtab.len);
+
+    pad_to(out, sizeof(U64));
+    U64 section_offset = out->len - start;
+    Elf64_Shdr sections[SECTION_COUNT] = {
+        [SECTION_RODATA] = {
+            .sh_name = rodata_name,
+            .sh_type = SHT_PROGBITS,
+            .sh_flags = SHF_ALLOC,
+            .sh_offset = rodata_offset,
+            .sh_size = writer.rodata.len,
+            .sh_addralign = RODATA_ALIGN,
+        },
+        [SECTION_SYMTAB] = {
+            .sh_name = symtab_name,
+            .sh_type = SHT_SYMTAB,
+            .sh_offset = symtab_offset,
+            .sh_size = (writer.symbol_count + 1) * sizeof(Elf64_Sym),
+            .sh_link = SECTION_STRTAB,
+            // Index of the first global symbol.
+            .sh_info = 1,
+            .sh_addralign = sizeof(U64),
+            .sh_entsize = sizeof(Elf64_Sym),
+        },
+        [SECTION_STRTAB] = {
+            .sh_name = strtab_name,
+            .sh_type = SHT_STRTAB,
+            .sh_offset = strtab_offset,
+            .sh_size = writer.strtab.len,
+            .sh_addralign = 1,
+        },
+        [SECTION_SHSTRTAB] = {
+            .sh_name = shstrtab_name,
+            .sh_type = SHT_STRTAB,
+            .sh_offset = shstrtab_offset,
+            .sh_size = shstrtab.len,
+            .sh_addralign = 1,
+        },
+        [SECTION_NOTE_GNU_STACK] = {
+            .sh_name = note_name,
+            .sh_type = SHT_PROGBITS,
+            .sh_offset = section_offset,
+            .sh_addralign = 1,
+        },
+    };
+    buffer_push(out, sections, sizeof(sections));
+
+    header = (Elf64_Ehdr) {
+        .e_ident = {
+            ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+            ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV,
+        },
+        .e_type = ET_REL,
+        .e_machine = ELF_MACHINE,
+        .e_version = EV_CURRENT,
+        .e_shoff = section_offset,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = SECTION_COUNT,
+        .e_shstrndx = SECTION_SHSTRTAB,
+    };
+    memcpy(&out->data[start], &header, sizeof(header));
+
+    ar_scratch_release(&scratch);
+}
@@ -0,0 +1,402 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+// Contents and units get a block of their own so that replaced ones can be
+// freed. Readers that began before a block was replaced may still point into
+// it, so it's retired first and only freed once they have all ended.
+typedef struct CacheBlock CacheBlock;
+struct CacheBlock {
+    CacheBlock *prev;
+    CacheBlock *next;
+    // Value of FileCache.epoch once the block was retired.
+    U64 epoch;
+};
+
+typedef struct FileCacheEntry FileCacheEntry;
+struct FileCacheEntry {
+    CacheBlock *block;
+    ArStr content;
+    // Identity of the file the content was read from.
+    U64 dev;
+    U64 ino;
+    U64 size;
+    struct timespec mtime;
+};
+
+typedef struct UnitEntry UnitEntry;
+struct UnitEntry {
+    CacheBlock *block;
+    // Data of the content the unit was parsed from.
+    const U8 *content;
+    IncludeUnit unit;
+};
+
+typedef struct PathEntry PathEntry;
+struct PathEntry {
+    // Only trusted while it matches the cache's.
+    U64 generation;
+    // Empty if there's no regular file at the path.
+    ArStr canonical;
+};
+
+struct FileCache {
+    ArArena *arena;
+    pthread_mutex_t mutex;
+    // Path -> FileCacheEntry *.
+    ArHashMap *entries;
+    // Canonical path -> UnitEntry *.
+    ArHashMap *units;
+    // Path -> PathEntry *.
+    ArHashMap *paths;
+    U64 generation;
+
+    // Blocks still in use.
+    CacheBlock *live;
+    // Replaced blocks, linked through 'next'.
+    CacheBlock *retired;
+    FileCacheReader *readers;
+    // Incremented on every retirement.
+    U64 epoch;
+};
+
+// Outlive the calls to ar_hash_map_init, unlike a compound literal.
+static FileCacheEntry *const NULL_ENTRY = NULL;
+static UnitEntry *const NULL_UNIT = NULL;
+static PathEntry *const NULL_PATH = NULL;
+
+FileCache *file_cache_create(void) {
+    ArArena *arena = ar_arena_create_default();
+    FileCache *cache = ar_arena_push_arr(arena, FileCache, 1);
+    cache->arena = arena;
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->entries = ar_hash_map_init((ArHashMapDesc) {
+            .arena = arena,
+            .capacity = 1024,
+
+            .hash_func = hash_str,
+            .eq_func = str_eq,
+
+            .key_size = sizeof(ArStr),
+            .value_size = sizeof(FileCacheEntry *),
+            .null_value = &NULL_ENTRY,
+        });
+    cache->units = ar_hash_map_init((ArHashMapDesc) {
+            .arena = arena,
+            .capacity = 256,
+
+            .hash_func = hash_str,
+            .eq_func = str_eq,
+
+            .key_size = sizeof(ArStr),
+            .value_size = sizeof(UnitEntry *),
+            .null_value = &NULL_UNIT,
+        });
+    cache->paths = ar_hash_map_init((ArHashMapDesc) {
+            .arena = arena,
+            .capacity = 1024,
+
+            .hash_func = hash_str,
+            .eq_func = str_eq,
+
+            .key_size = sizeof(ArStr),
+            .value_size = sizeof(PathEntry *),
+            .null_value = &NULL_PATH,
+        });
+    return cache;
+}
+
+static void free_blocks(CacheBlock *block) {
+    while (block != NULL) {
+        CacheBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void file_cache_destroy(FileCache **cache) {
+    FileCache *c = *cache;
+    free_blocks(c->live);
+    free_blocks(c->retired);
+    pthread_mutex_destroy(&c->mutex);
+    ArArena *arena = c->arena;
+    ar_arena_destroy(&arena);
+    *cache = NULL;
+}
+
+// Returns the 'size' bytes following the block header, NULL if out of memory.
+// Must be called with the mutex held.
+static void *block_alloc(FileCache *cache, U64 size, CacheBlock **block) {
+    CacheBlock *b = malloc(sizeof(CacheBlock) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+    *b = (CacheBlock) { .next = cache->live };
+    if (cache->live != NULL) {
+        cache->live->prev = b;
+    }
+    cache->live = b;
+    *block = b;
+    return b + 1;
+}
+
+// Frees every retired block no active reader began before. Must be called
+// with the mutex held.
+static void free_retired(FileCache *cache) {
+    U64 oldest = UINT64_MAX;
+    for (FileCacheReader *curr = cache->readers; curr != NULL; curr = curr->next) {
+        oldest = ar_min(oldest, curr->epoch);
+    }
+
+    CacheBlock **link = &cache->retired;
+    while (*link != NULL) {
+        CacheBlock *block = *link;
+        if (block->epoch <= oldest) {
+            *link = block->next;
+            free(block);
+        } else {
+            link = &block->next;
+        }
+    }
+}
+
+// Must be called with the mutex held.
+static void block_retire(FileCache *cache, CacheBlock *block) {
+    if (block == NULL) {
+        return;
+    }
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        cache->live = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+
+    block->epoch = ++cache->epoch;
+    block->prev = NULL;
+    block->next = cache->retired;
+    cache->retired = block;
+    free_retired(cache);
+}
+
+void file_cache_begin_read(FileCache *cache, FileCacheReader *reader) {
+    pthread_mutex_lock(&cache->mutex);
+    *reader = (FileCacheReader) {
+        .next = cache->readers,
+        .epoch = cache->epoch,
+    };
+    if (cache->readers != NULL) {
+        cache->readers->prev = reader;
+    }
+    cache->readers = reader;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void file_cache_end_read(FileCache *cache, FileCacheReader *reader) {
+    pthread_mutex_lock(&cache->mutex);
+    if (reader->prev != NULL) {
+        reader->prev->next = reader->next;
+    } else {
+        cache->readers = reader->next;
+    }
+    if (reader->next != NULL) {
+        reader->next->prev = reader->prev;
+    }
+    free_retired(cache);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+static B8 entry_matches(const FileCacheEntry *entry, const struct stat *st) {
+    return entry->dev == (U64) st->st_dev &&
+        entry->ino == (U64) st->st_ino &&
+        entry->size == (U64) st->st_size &&
+        entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+B8 file_cache_read(FileCache *cache, ArStr path, ArStr *content) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    struct stat st;
+    if (stat(ar_str_to_cstr(scratch.arena, path), &st) != 0 || !S_ISREG(st.st_mode)) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    FileCacheEntry *entry = ar_hash_map_get(cache->entries, path, FileCacheEntry *);
+    if (entry != NULL && entry_matches(entry, &st)) {
+        *content = entry->content;
+        pthread_mutex_unlock(&cache->mutex);
+        ar_scratch_release(&scratch);
+        return true;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    // Read without holding the lock. Two threads may read the same file, the
+    // last one to finish wins. The mapping is copied rather than kept, a file
+    // truncated while mapped would fault parses still reading it.
+    MappedFile file;
+    if (!map_file(path, &file)) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    CacheBlock *block;
+    U8 *data = block_alloc(cache, file.content.len, &block);
+    if (data == NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        unmap_file(&file);
+        ar_error("Out of memory reading %.*s.", (I32) path.len, path.data);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+    memcpy(data, file.content.data, file.content.len);
+
+    entry = ar_hash_map_get(cache->entries, path, FileCacheEntry *);
+    if (entry == NULL) {
+        entry = ar_arena_push_arr(cache->arena, FileCacheEntry, 1);
+        ArStr key = ar_str_push_copy(cache->arena, path);
+        ar_hash_map_insert(cache->entries, key, entry);
+    } else {
+        // The unit parsed from the old content goes with it, so that a new
+        // content allocated at the same address can't match the unit.
+        UnitEntry *unit = ar_hash_map_get(cache->units, path, UnitEntry *);
+        if (unit != NULL && unit->content == entry->content.data) {
+            block_retire(cache, unit->block);
+            *unit = (UnitEntry) {0};
+        }
+        block_retire(cache, entry->block);
+    }
+    *entry = (FileCacheEntry) {
+        .block = block,
+        .content = ar_str(data, file.content.len),
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime = st.st_mtim,
+    };
+    *content = entry->content;
+    pthread_mutex_unlock(&cache->mutex);
+
+    unmap_file(&file);
+    ar_scratch_release(&scratch);
+    return true;
+}
+
+B8 file_cache_get_unit(FileCache *cache, ArStr path, ArStr content, IncludeUnit *unit) {
+    pthread_mutex_lock(&cache->mutex);
+    UnitEntry *entry = ar_hash_map_get(cache->units, path, UnitEntry *);
+    B8 found = entry != NULL && entry->content == content.data;
+    if (found) {
+        *unit = entry->unit;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return found;
+}
+
+// Copies 'str' to 'data' and moves 'data' past it.
+static ArStr push_block_str(U8 **data, ArStr str) {
+    ArStr copy = ar_str(*data, str.len);
+    memcpy(*data, str.data, str.len);
+    *data += str.len;
+    return copy;
+}
+
+void file_cache_put_unit(FileCache *cache, ArStr path, ArStr content, IncludeUnit unit) {
+    // The steps and their strings share one block.
+    U64 size = unit.step_count * sizeof(IncludeStep);
+    for (U64 i = 0; i < unit.step_count; i++) {
+        size += unit.steps[i].name.len + unit.steps[i].value.len;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    // Skip units of content replaced since it was read, its block may be
+    // freed and the address reused by a later content.
+    FileCacheEntry *file = ar_hash_map_get(cache->entries, path, FileCacheEntry *);
+    if (file == NULL || file->content.data != content.data) {
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+
+    CacheBlock *block;
+    IncludeStep *steps = block_alloc(cache, size, &block);
+    if (steps == NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+    U8 *strings = (U8 *) &steps[unit.step_count];
+    for (U64 i = 0; i < unit.step_count; i++) {
+        steps[i] = unit.steps[i];
+        steps[i].name = push_block_str(&strings, unit.steps[i].name);
+        steps[i].value = push_block_str(&strings, unit.steps[i].value);
+    }
+
+    UnitEntry *entry = ar_hash_map_get(cache->units, path, UnitEntry *);
+    if (entry == NULL) {
+        entry = ar_arena_push_arr(cache->arena, UnitEntry, 1);
+        ArStr key = ar_str_push_copy(cache->arena, path);
+        ar_hash_map_insert(cache->units, key, entry);
+    } else {
+        block_retire(cache, entry->block);
+    }
+    *entry = (UnitEntry) {
+        .block = block,
+        .content = content.data,
+        .unit = {
+            .steps = steps,
+            .step_count = unit.step_count,
+        },
+    };
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+B8 file_cache_resolve(FileCache *cache, ArStr path, ArStr *canonical) {
+    pthread_mutex_lock(&cache->mutex);
+    PathEntry *entry = ar_hash_map_get(cache->paths, path, PathEntry *);
+    if (entry != NULL && entry->generation == cache->generation) {
+        *canonical = entry->canonical;
+        pthread_mutex_unlock(&cache->mutex);
+        return canonical->len != 0;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    struct stat st;
+    ArStr resolved = {0};
+    if (stat(ar_str_to_cstr(scratch.arena, path), &st) == 0 && S_ISREG(st.st_mode)) {
+        resolved = canonicalize(scratch.arena, path);
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    entry = ar_hash_map_get(cache->paths, path, PathEntry *);
+    if (entry == NULL) {
+        entry = ar_arena_push_arr(cache->arena, PathEntry, 1);
+        ArStr key = ar_str_push_copy(cache->arena, path);
+        ar_hash_map_insert(cache->paths, key, entry);
+    }
+    // Refreshing usually finds the same file, keep its string then.
+    if (!ar_str_match(entry->canonical, resolved, AR_STR_MATCH_FLAG_EXACT)) {
+        entry->canonical = ar_str_push_copy(cache->arena, resolved);
+    }
+    entry->generation = cache->generation;
+    *canonical = entry->canonical;
+    pthread_mutex_unlock(&cache->mutex);
+
+    ar_scratch_release(&scratch);
+    return canonical->len != 0;
+}
+
+void file_cache_refresh(FileCache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->generation++;
+    pthread_mutex_unlock(&cache->mutex);
+}
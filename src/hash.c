@@ -0,0 +1,121 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+// SHA-256 as specified in FIPS 180-4.
+
+static const U32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static U32 rotr(U32 x, U32 n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(Sha256 *ctx, const U8 *block) {
+    U32 w[64];
+    for (U32 i = 0; i < 16; i++) {
+        w[i] = (U32) block[i*4] << 24 | (U32) block[i*4 + 1] << 16 | (U32) block[i*4 + 2] << 8 | block[i*4 + 3];
+    }
+    for (U32 i = 16; i < 64; i++) {
+        U32 s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        U32 s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    U32 a = ctx->state[0];
+    U32 b = ctx->state[1];
+    U32 c = ctx->state[2];
+    U32 d = ctx->state[3];
+    U32 e = ctx->state[4];
+    U32 f = ctx->state[5];
+    U32 g = ctx->state[6];
+    U32 h = ctx->state[7];
+
+    for (U32 i = 0; i < 64; i++) {
+        U32 s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        U32 ch = (e & f) ^ (~e & g);
+        U32 t1 = h + s1 + ch + K[i] + w[i];
+        U32 s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        U32 maj = (a & b) ^ (a & c) ^ (b & c);
+        U32 t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    *ctx = (Sha256) {
+        .state = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        },
+    };
+}
+
+void sha256_update(Sha256 *ctx, const void *data, U64 len) {
+    const U8 *bytes = data;
+    ctx->len += len;
+
+    if (ctx->buffer_len > 0) {
+        U64 count = ar_min(len, 64 - ctx->buffer_len);
+        memcpy(&ctx->buffer[ctx->buffer_len], bytes, count);
+        ctx->buffer_len += count;
+        bytes += count;
+        len -= count;
+        if (ctx->buffer_len < 64) {
+            return;
+        }
+        sha256_block(ctx, ctx->buffer);
+        ctx->buffer_len = 0;
+    }
+
+    while (len >= 64) {
+        sha256_block(ctx, bytes);
+        bytes += 64;
+        len -= 64;
+    }
+
+    memcpy(ctx->buffer, bytes, len);
+    ctx->buffer_len = len;
+}
+
+void sha256_final(Sha256 *ctx, U8 digest[SHA256_SIZE]) {
+    U64 bit_len = ctx->len * 8;
+
+    U8 pad[72] = {0x80};
+    U64 pad_len = ctx->buffer_len < 56 ? 56 - ctx->buffer_len : 120 - ctx->buffer_len;
+    for (U32 i = 0; i < 8; i++) {
+        pad[pad_len + i] = bit_len >> (56 - i*8);
+    }
+    sha256_update(ctx, pad, pad_len + 8);
+
+    for (U32 i = 0; i < 8; i++) {
+        digest[i*4] = ctx->state[i] >> 24;
+        digest[i*4 + 1] = ctx->state[i] >> 16;
+        digest[i*4 + 2] = ctx->state[i] >> 8;
+        digest[i*4 + 3] = ctx->state[i];
+    }
+}
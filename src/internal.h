@@ -1,118 +1,520 @@
 #pragma once
 
 #include "arkin_core.h"
+#include "shader.h"
 
-typedef struct ParsedShader ParsedShader;
-struct ParsedShader {
-    struct {
-        ArStr name;
-        ArStr vertex_source;
-        ArStr fragment_source;
-    } program;
-    ArHashMap *ctypes;
+#include <stdio.h>
+
+#define ARKIN_SHADER_VERSION "0.1.0"
+
+typedef struct Buffer Buffer;
+typedef struct BufferReader BufferReader;
+
+typedef struct FileCache FileCache;
+
+// 'files' is optional, included files are read through it when given.
+extern ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths, FileCache *files);
+// Resolves includes through 'source.include' instead of search paths.
+extern ParsedShader parse_shader_source(ArArena *arena, ShaderSource source);
+// Parses 'source' repeatedly and returns the throughput in bytes per second.
+extern F64 benchmark_parse(ArStr source, ArStrList paths, FileCache *files);
+extern void test_match_token_type(void);
+extern void test_parser(void);
+
+// Process wide glslang state, reference counted. Every compiler_init has to
+// be matched by a compiler_terminate once its caller is done compiling.
+extern void compiler_init(void);
+extern void compiler_terminate(void);
+
+typedef struct ShaderCache ShaderCache;
+
+typedef struct CompileOptions CompileOptions;
+struct CompileOptions {
+    // Optional, skips glslang and SPIRV-Cross for stages compiled before.
+    ShaderCache *cache;
+    // Reflection always sees the unoptimized module, names included.
+    OptimizeLevel optimize;
+    // Threads compiling stages, the calling one included. 0 uses one per CPU.
+    // Callers that are already one of many pool workers should pass 1.
+    U32 threads;
 };
 
-extern ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths);
+// Compiles every unique stage once, then links each program. '*programs' gets
+// one CompiledShader per parsed program, in the same order.
+extern B8 compile_shader(ArArena *arena, ParsedShader shader, CompileOptions options, CompiledShader **programs);
+// Number of combinations of the axes' values.
+extern U32 variant_count(const VariantAxis *axes, U32 axis_count);
+// Lowest variant key sharing the SPIR-V of 'variants[key]'.
+extern U32 variant_first_key(const CompiledStage *variants, U32 key);
+// Keeps one SPIRV-Cross context and its type pools for every stage it
+// reflects. Not thread safe, each thread needs its own.
+typedef struct Reflector Reflector;
+extern Reflector *reflector_create(void);
+extern void reflector_destroy(Reflector **reflector);
+// The calling thread's Reflector, created on first use and destroyed when the
+// thread exits. Pool workers keep theirs across jobs.
+extern Reflector *reflector_thread(void);
+extern ReflectedStage reflector_reflect(Reflector *reflector, ArArena *arena, ArStr spv);
+// Reflects with a Reflector of its own.
+extern ReflectedStage reflect_spv(ArArena *arena, ArStr spv);
+// Seconds per reflection of 'spv', with a reused Reflector and with a new one
+// each time.
+extern void benchmark_reflect(ArStr spv, F64 *reused_seconds, F64 *fresh_seconds);
+// Deep copies reflection data into 'arena'.
+extern ReflectedStage reflected_stage_copy(ArArena *arena, ReflectedStage stage);
+// Binary form of reflection data, used by the compilation cache.
+extern void serialize_reflected_stage(Buffer *buffer, ReflectedStage stage);
+extern B8 deserialize_reflected_stage(ArArena *arena, BufferReader *reader, ReflectedStage *stage);
+// Compares layout, ignoring names.
+extern B8 reflected_type_eq(ReflectedType a, ReflectedType b);
+
+typedef enum {
+    // 'const char* NAME_VS_SOURCE', a string literal of escaped bytes.
+    SPV_FORMAT_STRING,
+    // 'static const uint32_t NAME_VS_SPV[NAME_VS_SPV_WORD_COUNT]'.
+    SPV_FORMAT_WORDS,
+    // An ELF object next to the header, which only declares the symbols.
+    SPV_FORMAT_OBJECT,
+} SpvFormat;
 
-// NOTE: Booleans reflect into unsigned integers.
-// bool -> uint
-// bvec2 -> uvec2
-// bvec3 -> uvec3
-// bvec4 -> uvec4
 typedef enum {
-    REFLECTED_DATA_TYPE_UNKNOWN,
-
-    REFLECTED_DATA_TYPE_VOID,
-    REFLECTED_DATA_TYPE_STRUCT,
-    REFLECTED_DATA_TYPE_SAMPLER,
-
-    // Scalers
-    REFLECTED_DATA_TYPE_I32,
-    REFLECTED_DATA_TYPE_U32,
-    REFLECTED_DATA_TYPE_F32,
-    REFLECTED_DATA_TYPE_F64,
-
-    // Vectors
-    REFLECTED_DATA_TYPE_IVEC2,
-    REFLECTED_DATA_TYPE_UVEC2,
-    REFLECTED_DATA_TYPE_VEC2,
-    REFLECTED_DATA_TYPE_DVEC2,
-
-    REFLECTED_DATA_TYPE_IVEC3,
-    REFLECTED_DATA_TYPE_UVEC3,
-    REFLECTED_DATA_TYPE_VEC3,
-    REFLECTED_DATA_TYPE_DVEC3,
-
-    REFLECTED_DATA_TYPE_IVEC4,
-    REFLECTED_DATA_TYPE_UVEC4,
-    REFLECTED_DATA_TYPE_VEC4,
-    REFLECTED_DATA_TYPE_DVEC4,
-
-    // Matrices
-    REFLECTED_DATA_TYPE_MAT2,
-    REFLECTED_DATA_TYPE_DMAT2,
-
-    REFLECTED_DATA_TYPE_MAT3,
-    REFLECTED_DATA_TYPE_DMAT3,
-
-    REFLECTED_DATA_TYPE_MAT4,
-    REFLECTED_DATA_TYPE_DMAT4,
-
-    REFLECTED_DATA_TYPE_COUNT,
-} ReflectedDataType;
-
-typedef struct ReflectedType ReflectedType;
-struct ReflectedType {
-    ReflectedDataType data_type;
+    COMPRESSION_NONE,
+    // SPIR-V aware varint encoding ('--compress smolv').
+    COMPRESSION_SMOLV,
+    // The same followed by LZ compression ('--compress smolv-lz').
+    COMPRESSION_SMOLV_LZ,
+} Compression;
+
+typedef struct OutputOptions OutputOptions;
+struct OutputOptions {
+    SpvFormat spv_format;
+    // Packed stages are embedded as 'NAME_VS_SPV_PACKED' byte arrays along
+    // with a decoder. Not supported with SPV_FORMAT_OBJECT.
+    Compression compression;
+    // Also put each stage's serialized ReflectedStage in the object as
+    // 'NAME_VS_REFLECTION'. Only used with SPV_FORMAT_OBJECT.
+    B8 embed_reflection;
+};
+
+// Returns false if a stage couldn't be compressed.
+extern B8 render_header(Buffer *out, const CompiledShader *programs, U64 program_count, const ArHashMap *ctypes, OutputOptions options);
+extern B8 write_header(const CompiledShader *programs, U64 program_count, const ArHashMap *ctypes, OutputOptions options, const char *filepath);
+
+//
+// Diagnostics
+//
+
+// Errors collected for library callers instead of being logged.
+typedef struct Diagnostics Diagnostics;
+struct Diagnostics {
+    ArArena *arena;
+    ArStrList errors;
+};
+
+// Makes 'diagnostics' collect the errors reported on the calling thread and
+// returns the previous one. NULL goes back to logging.
+extern Diagnostics *diagnostics_swap(Diagnostics *diagnostics);
+extern Diagnostics *diagnostics_current(void);
+// Returns false if the calling thread has no Diagnostics.
+extern B8 diagnostics_report(const char *fmt, ...);
+
+// Logs with ar_error unless the calling thread collects its errors.
+#define report_error(...) do { \
+    if (!diagnostics_report(__VA_ARGS__)) { \
+        ar_error(__VA_ARGS__); \
+    } \
+} while (0)
+
+//
+// Compression
+//
+
+typedef struct PackedSpv PackedSpv;
+struct PackedSpv {
+    ArStr data;
+    U64 word_count;
+    // Size of the buffer the decoder needs, at least 'word_count'.
+    U64 decode_words;
+};
+
+// Returns false if 'spv' isn't a well formed module.
+extern B8 pack_spv(ArArena *arena, ArStr spv, Compression compression, PackedSpv *packed);
+// Returns the word count, 0 if 'packed' is corrupt or 'dst' too small.
+extern U64 unpack_spv(ArStr packed, U32 *dst, U64 dst_words);
+// Checks that 'packed' decodes to 'spv', a mismatch is a bug in the encoder.
+extern B8 verify_packed_spv(PackedSpv packed, ArStr spv);
+// Verifies 'packed', then measures how fast it decodes.
+extern B8 benchmark_packed_spv(PackedSpv packed, ArStr spv, F64 *bytes_per_second);
+// C source of 'arkin_shader_decode', the decoder embedded in headers.
+extern const char *SPV_DECODER_SOURCE;
+
+//
+// ELF objects
+//
+
+// Relocatable ELF object for the host architecture. Every stage's SPIR-V
+// goes into '.rodata' as 'NAME_VS_SPV' along with its size in bytes as
+// 'NAME_VS_SPV_SIZE'.
+extern void render_object(Buffer *out, const CompiledShader *programs, U64 program_count, OutputOptions options);
+
+//
+// Shader packs
+//
+
+// Writes every program to a single pack for 'include/arkin_pack.h' to map.
+// Returns false if two programs share a name.
+extern B8 write_pack(const char *filepath, const CompiledShader *programs, U64 program_count);
+// Times mapping a pack and looking up its stages against copying the stages
+// out of embedded strings, which is what headers require.
+extern B8 benchmark_pack(const char *filepath);
+
+//
+// File cache
+//
+
+// Thread safe in-memory cache of file contents. Every read stats the file and
+// only rereads it if its identity (device, inode, size, mtime) changed.
+extern FileCache *file_cache_create(void);
+extern void file_cache_destroy(FileCache **cache);
+
+// Contents and units read from the cache stay valid until the reader active
+// during the read ends. Replaced ones are freed once every reader that began
+// before the replacement has ended.
+typedef struct FileCacheReader FileCacheReader;
+struct FileCacheReader {
+    FileCacheReader *prev;
+    FileCacheReader *next;
+    U64 epoch;
+};
+
+extern void file_cache_begin_read(FileCache *cache, FileCacheReader *reader);
+extern void file_cache_end_read(FileCache *cache, FileCacheReader *reader);
+// Returns false without reporting an error if the file doesn't exist. Has to
+// be called between file_cache_begin_read and file_cache_end_read.
+extern B8 file_cache_read(FileCache *cache, ArStr path, ArStr *content);
+
+typedef enum {
+    INCLUDE_STEP_MODULE,
+    INCLUDE_STEP_CTYPEDEF,
+    INCLUDE_STEP_INCLUDE,
+} IncludeStepKind;
+
+typedef struct IncludeStep IncludeStep;
+struct IncludeStep {
+    IncludeStepKind kind;
+    // Module name, GLSL type or include argument.
     ArStr name;
+    // Module code or C type.
+    ArStr value;
+    // The parser's module type, modules only.
+    U32 module_type;
+};
+
+// What a file included at the top level adds to a parse, in order, so that
+// later includes of the same file don't have to parse it again.
+typedef struct IncludeUnit IncludeUnit;
+struct IncludeUnit {
+    IncludeStep *steps;
+    U64 step_count;
+};
+
+// Units are keyed by canonical path and only returned while 'content' is
+// still what the cache holds for it, i.e. the file hasn't changed since.
+extern B8 file_cache_get_unit(FileCache *cache, ArStr path, ArStr content, IncludeUnit *unit);
+// Copies 'unit' into the cache, replacing any older unit for the path.
+extern void file_cache_put_unit(FileCache *cache, ArStr path, ArStr content, IncludeUnit unit);
+
+// Looks 'path' up in the cache's view of the file system so that include
+// search paths that don't have the file only get checked once. Misses are
+// remembered too. Returns false if there's no regular file at 'path',
+// otherwise sets 'canonical' to its canonical path.
+extern B8 file_cache_resolve(FileCache *cache, ArStr path, ArStr *canonical);
+// Forgets every resolved path, for when files may have been created or
+// removed since.
+extern void file_cache_refresh(FileCache *cache);
 
-    // 0 if not an array.
-    U32 array_dimensions;
-    // Array of length 'array_dimensions'.
-    U32 *array_dimension_lengths;
+//
+// Hashing
+//
 
-    U32 vec_size;
-    U32 cols;
+#define SHA256_SIZE 32
 
-    U32 member_count;
-    ReflectedType *members;
+typedef struct Sha256 Sha256;
+struct Sha256 {
+    U32 state[8];
+    U8 buffer[64];
+    U64 buffer_len;
+    U64 len;
+};
+
+extern void sha256_init(Sha256 *ctx);
+extern void sha256_update(Sha256 *ctx, const void *data, U64 len);
+extern void sha256_final(Sha256 *ctx, U8 digest[SHA256_SIZE]);
+
+//
+// Cache
+//
+
+typedef struct ShaderCacheStats ShaderCacheStats;
+struct ShaderCacheStats {
+    U64 hits;
+    U64 misses;
+    U64 stores;
+    U64 evictions;
+};
+
+// Content addressed on-disk cache of compiled stages, safe to share between
+// threads and processes. Entries are evicted least recently used first once
+// the directory grows past 'max_size' bytes. A 'max_size' of 0 disables
+// eviction.
+extern ShaderCache *shader_cache_create(ArStr dir, U64 max_size);
+extern void shader_cache_destroy(ShaderCache **cache);
+// On a hit 'stage' is allocated on 'arena'.
+extern B8 shader_cache_get(ShaderCache *cache, ArArena *arena, const U8 key[SHA256_SIZE], CompiledStage *stage);
+extern void shader_cache_put(ShaderCache *cache, const U8 key[SHA256_SIZE], CompiledStage stage);
+extern ShaderCacheStats shader_cache_stats(ShaderCache *cache);
+
+//
+// Thread pool
+//
+
+// 'arena' belongs to the worker running the task and is never shared between
+// threads. Tasks should free what they push onto it before returning.
+typedef void ThreadPoolFunc(ArArena *arena, void *userdata);
+
+typedef struct ThreadPool ThreadPool;
+
+// A 'worker_count' of 0 creates one worker per CPU.
+extern ThreadPool *thread_pool_create(U32 worker_count);
+extern void thread_pool_destroy(ThreadPool **pool);
+extern void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *userdata);
+// Blocks until every submitted task has finished.
+extern void thread_pool_wait(ThreadPool *pool);
+extern U32 thread_pool_worker_count(const ThreadPool *pool);
+extern U32 cpu_count(void);
+
+//
+// Batch
+//
+
+typedef struct Options Options;
+struct Options {
+    // Files, directories (searched recursively for '.glsl' files) and
+    // manifests ('@file', one path per line).
+    ArStrList inputs;
+    // Extra include paths searched after the input file's directory and '.'.
+    ArStrList include_paths;
+    // Headers are written to '<output_dir>/<input basename>.h'. When empty and
+    // only a single file is given the header is written to 'header.h'.
+    ArStr output_dir;
+    // Worker thread count, 0 uses one per CPU.
+    U32 jobs;
+    // Compilation cache directory. Caching is disabled when empty.
+    ArStr cache_dir;
+    // Cache size cap in bytes.
+    U64 cache_size;
+    // Write a Makefile/Ninja depfile to '<header>.d' ('-MD').
+    B8 depfile;
+    // Depfile path, only valid with a single input ('-MF').
+    ArStr depfile_path;
+    // Only run the parser and write depfiles, never compile ('-M').
+    B8 deps_only;
+    // Keep running and recompile programs whose files change ('--watch').
+    B8 watch;
+    // Serve compile requests on this Unix domain socket ('--server').
+    ArStr server;
+    // Send compiles to the server listening on this socket ('--client').
+    ArStr client;
+    // How SPIR-V is embedded ('--spv-format', '--embed-reflection').
+    OutputOptions output_options;
+    // '-O' and '-Os'.
+    OptimizeLevel optimize;
+    // Write every program to this shader pack instead of headers ('--pack').
+    ArStr pack;
+    // Benchmark loading this shader pack and exit ('--bench-pack').
+    ArStr bench_pack;
+    // Benchmark parsing every input and exit ('--bench-parse').
+    B8 bench_parse;
+    // Benchmark reflecting every stage and exit ('--bench-reflect').
+    B8 bench_reflect;
+    // Benchmark decoding every packed stage and exit ('--bench-decode').
+    B8 bench_decode;
 };
 
 typedef enum {
-    REFLECTION_INDEX_UNIFORM_BUFFER,
-    REFLECTION_INDEX_PUSH_CONSTANT,
+    BATCH_STATUS_PENDING,
+    BATCH_STATUS_DONE,
+    BATCH_STATUS_SKIPPED,
+    BATCH_STATUS_FAILED,
+
+    BATCH_STATUS_COUNT,
+} BatchStatus;
+
+typedef struct BatchJob BatchJob;
+struct BatchJob {
+    ArStr input;
+    // Directory or manifest directory the input was found through, empty for
+    // inputs given directly. The output mirrors the input's path below it.
+    ArStr root;
+    ArStr output;
+    // Empty if no depfile should be written.
+    ArStr depfile;
+    B8 deps_only;
+    ArStrList paths;
+    // Only set for SPV_FORMAT_OBJECT.
+    ArStr object;
+    CompileOptions compile_options;
+    OutputOptions output_options;
+    // Shared between all jobs of a batch.
+    FileCache *files;
+    // Compile on the server listening on this socket instead of locally.
+    ArStr server;
+    // Found through a directory search. Files without a program are include
+    // files and get skipped instead of failing.
+    B8 discovered;
+    BatchStatus status;
 
-    REFLECTION_INDEX_COUNT,
-} ReflectionIndex;
+    // When set, the files included by the last run are recorded in
+    // 'dependencies'. The arena is recreated on every run.
+    ArArena *dependency_arena;
+    ArStrList dependencies;
 
-typedef struct ReflectedStage ReflectedStage;
-struct ReflectedStage {
-    ReflectedType *types[REFLECTION_INDEX_COUNT];
-    Usize count[REFLECTION_INDEX_COUNT];
+    // When set, the compiled programs are kept in 'results' instead of being
+    // written out. The arena is recreated on every run and 'results' is empty
+    // if the last run didn't produce any.
+    ArArena *result_arena;
+    CompiledShader *results;
+    U64 result_count;
 };
 
-typedef struct CompiledStage CompiledStage;
-struct CompiledStage {
-    ArStr spv;
-    ReflectedStage reflection;
+typedef struct Batch Batch;
+struct Batch {
+    // Sorted by input path.
+    BatchJob *jobs;
+    U64 job_count;
+    B8 deps_only;
+    CompileOptions compile_options;
+    FileCache *files;
+    ThreadPool *pool;
+    // Shader pack written after every run, empty to write headers.
+    ArStr pack;
 };
 
-typedef struct CompiledShader CompiledShader;
-struct CompiledShader {
-    ArStr name;
-    CompiledStage vertex;
-    CompiledStage fragment;
+// Expands the inputs into jobs and sets up the worker pool and cache. Returns
+// false on invalid input, such as two inputs writing the same header.
+extern B8 batch_create(ArArena *arena, Options options, Batch *batch);
+extern void batch_destroy(Batch *batch);
+// Runs every job with BATCH_STATUS_PENDING and reports the results, then
+// rewrites the shader pack if there is one and nothing failed. Returns false
+// if any job failed.
+extern B8 batch_run(Batch *batch);
+// ThreadPoolFunc running a single BatchJob.
+extern void batch_job_run(ArArena *arena, void *userdata);
+
+// Compiles every input on a fixed worker pool. Returns false if any input
+// failed.
+extern B8 compile_batch(ArArena *arena, Options options);
+
+// Compiles every input, then recompiles the inputs affected by every change
+// to them or the files they include. Only returns on failure.
+extern B8 watch_batch(ArArena *arena, Options options);
+
+//
+// Compile server
+//
+
+typedef enum {
+    REMOTE_STATUS_DONE,
+    REMOTE_STATUS_NO_PROGRAM,
+    REMOTE_STATUS_FAILED,
+
+    REMOTE_STATUS_COUNT,
+} RemoteStatus;
+
+typedef struct RemoteResult RemoteResult;
+struct RemoteResult {
+    RemoteStatus status;
+    // Contents of the generated header and object, if any.
+    ArStr header;
+    ArStr object;
+    ArStrList dependencies;
+    // Everything the server reported while compiling.
+    ArStrList errors;
 };
 
-extern CompiledShader compile_shader(ArArena *arena, ParsedShader shader);
-extern ReflectedStage reflect_spv(ArArena *arena, ArStr spv);
+// Serves compile requests on a Unix domain socket. glslang, the cache and
+// every file read stay warm between requests. Only returns on failure.
+extern B8 run_server(ArArena *arena, Options options);
+// Compiles 'input' on the server listening on 'socket_path'. Paths are sent
+// as absolute paths so the server's working directory doesn't matter.
+// Returns false if the server couldn't be reached.
+extern B8 compile_remote(ArArena *arena, ArStr socket_path, ArStr input, ArStrList paths, OptimizeLevel optimize, OutputOptions options, RemoteResult *result);
+
+//
+// Depfiles
+//
+
+// Writes 'target: input dependencies...'.
+extern B8 write_depfile(const char *filepath, ArStr target, ArStr input, ArStrList dependencies);
 
 //
 // Utils
 //
 extern char *ar_str_to_cstr(ArArena *arena, ArStr str);
+
+// Growable byte buffer backed by an arena.
+struct Buffer {
+    ArArena *arena;
+    U8 *data;
+    U64 len;
+    U64 cap;
+};
+
+extern void buffer_reserve(Buffer *buffer, U64 len);
+extern void buffer_push(Buffer *buffer, const void *data, U64 len);
+// Integers are stored little endian.
+extern void buffer_push_u32(Buffer *buffer, U32 value);
+extern void buffer_push_u64(Buffer *buffer, U64 value);
+extern void buffer_push_str(Buffer *buffer, ArStr str);
+extern void buffer_pushf(Buffer *buffer, const char *fmt, ...);
+extern ArStr buffer_str(Buffer buffer);
+
+// Reads what was written with the buffer_push functions. Reading past the end
+// sets 'error' and yields zeroes.
+struct BufferReader {
+    ArStr data;
+    U64 offset;
+    B8 error;
+};
+
+extern const U8 *buffer_read(BufferReader *reader, U64 len);
+extern U32 buffer_read_u32(BufferReader *reader);
+extern U64 buffer_read_u64(BufferReader *reader);
+extern ArStr buffer_read_str(BufferReader *reader);
+
+// Hash map callbacks for 'ArStr' keys.
+extern U64 hash_str(const void *key, U64 len);
+extern B8 str_eq(const void *a, const void *b, U64 len);
 extern ArStr read_file(ArArena *arena, ArStr path);
 
+// Read only mapping of a whole file. Empty files aren't mapped but still get
+// non-NULL content.
+typedef struct MappedFile MappedFile;
+struct MappedFile {
+    ArStr content;
+    void *mapping;
+};
+
+// Returns false without reporting an error if 'path' isn't a regular file that
+// can be opened.
+extern B8 map_file(ArStr path, MappedFile *file);
+extern void unmap_file(MappedFile *file);
+// Replaces the file with 'content' using as few write calls as possible.
+extern B8 write_file(const char *filepath, ArStr content);
+// Resolves symlinks and relative parts so that the same file is always
+// spelled the same way. Falls back to the path itself if it doesn't exist.
+extern ArStr canonicalize(ArArena *arena, ArStr path);
+
 // Strips the last part off of a path.
 // /home/user/file.txt  ->      /home/user
 // /home/user           ->      /home
@@ -124,3 +526,15 @@ extern ArStr read_file(ArArena *arena, ArStr path);
 // ./foobar.txt         ->      .
 extern ArStr dirname(ArStr filepath);
 extern void test_dirname(void);
+
+// Last part of a path with the extension removed.
+// /home/user/file.txt  ->      file
+// file.tar.gz          ->      file.tar
+// /home/user/          ->      user
+extern ArStr stem(ArStr filepath);
+
+extern B8 is_directory(ArStr path);
+// Creates a directory and all missing parents.
+extern B8 make_directory(ArStr path);
+// Recursively appends every file under 'dir' ending in 'extension'.
+extern void collect_files(ArArena *arena, ArStrList *list, ArStr dir, ArStr extension);
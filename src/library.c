@@ -0,0 +1,63 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+// Entry points of 'include/shader.h'. Each one collects the errors reported
+// on its thread instead of logging them.
+
+void shader_library_init(void) {
+    compiler_init();
+}
+
+void shader_library_terminate(void) {
+    compiler_terminate();
+}
+
+static B8 finish(Diagnostics *diagnostics, Diagnostics *previous, ArStrList *errors) {
+    diagnostics_swap(previous);
+    if (errors != NULL) {
+        *errors = diagnostics->errors;
+    }
+    return diagnostics->errors.first == NULL;
+}
+
+B8 shader_parse(ArArena *arena, ShaderSource source, ParsedShader *parsed, ArStrList *errors) {
+    Diagnostics diagnostics = { .arena = arena };
+    Diagnostics *previous = diagnostics_swap(&diagnostics);
+
+    *parsed = parse_shader_source(arena, source);
+    if (parsed->program_count == 0) {
+        report_error("%.*s: No program defined.", (I32) source.name.len, source.name.data);
+    }
+
+    return finish(&diagnostics, previous, errors);
+}
+
+B8 shader_compile(ArArena *arena, ParsedShader parsed, OptimizeLevel optimize, CompiledShader **programs, ArStrList *errors) {
+    Diagnostics diagnostics = { .arena = arena };
+    Diagnostics *previous = diagnostics_swap(&diagnostics);
+
+    // Callers parallelize by compiling on their own threads, so one call
+    // stays on the calling thread instead of spawning a pool per call.
+    CompileOptions options = {
+        .optimize = optimize,
+        .threads = 1,
+    };
+
+    // Failures that didn't report anything still need a message.
+    if (!compile_shader(arena, parsed, options, programs) && diagnostics.errors.first == NULL) {
+        report_error("Compilation failed.");
+    }
+
+    return finish(&diagnostics, previous, errors);
+}
+
+B8 shader_reflect(ArArena *arena, ArStr spv, ReflectedStage *reflection, ArStrList *errors) {
+    Diagnostics diagnostics = { .arena = arena };
+    Diagnostics *previous = diagnostics_swap(&diagnostics);
+
+    *reflection = reflect_spv(arena, spv);
+
+    return finish(&diagnostics, previous, errors);
+}
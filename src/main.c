@@ -3,6 +3,9 @@
 
 #include "internal.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 
 // void print_reflected_type(ReflectedType t, U32 level) {
 //     U8 spaces[1024] = {0};
@@ -49,123 +52,308 @@ void _info(ArStr str, const char *file, U32 line) {
 }
 #define info(str) _info(str, __FILE__, __LINE__);
 
-void write_reflected_type(FILE *fp, const ArHashMap *ctypes, const char *prefix, ReflectedType type, U32 level) {
-    if (type.data_type == REFLECTED_DATA_TYPE_STRUCT && level == 0) {
-        fprintf(fp, "typedef struct %s_%.*s %s_%.*s;\n",
-            prefix, (I32) type.name.len, type.name.data,
-            prefix, (I32) type.name.len, type.name.data);
-        fprintf(fp, "struct %s_%.*s {\n", prefix, (I32) type.name.len, type.name.data);
+static const ArStr TYPE_NAMES[REFLECTED_DATA_TYPE_COUNT] = {
+    ar_str_lit("ERR::Unkown"),
 
-        for (U32 i = 0; i < type.member_count; i++) {
-            write_reflected_type(fp, ctypes, prefix, type.members[i], level + 1);
-        }
+    ar_str_lit("void"),
+    ar_str_lit("struct"),
+    ar_str_lit("sampler"),
 
-        fprintf(fp, "};\n");
-        fprintf(fp, "\n");
+    ar_str_lit("int"),
+    ar_str_lit("uint"),
+    ar_str_lit("float"),
+    ar_str_lit("double"),
 
-        return;
+    ar_str_lit("ivec2"),
+    ar_str_lit("uvec2"),
+    ar_str_lit("vec2"),
+    ar_str_lit("dvec2"),
+
+    ar_str_lit("ivec3"),
+    ar_str_lit("uvec3"),
+    ar_str_lit("vec3"),
+    ar_str_lit("dvec3"),
+
+    ar_str_lit("ivec4"),
+    ar_str_lit("uvec4"),
+    ar_str_lit("vec4"),
+    ar_str_lit("dvec4"),
+
+    ar_str_lit("mat2"),
+    ar_str_lit("dmat2"),
+
+    ar_str_lit("mat3"),
+    ar_str_lit("dmat3"),
+
+    ar_str_lit("mat4"),
+    ar_str_lit("dmat4"),
+};
+
+static const U32 TYPE_ARR_LENS[REFLECTED_DATA_TYPE_COUNT] = {
+    0, 0, 0, 0,
+    0, 0, 0, 0,
+    2, 2, 2, 2,
+    3, 3, 3, 3,
+    4, 4, 4, 4,
+    2*2, 2*2,
+    3*3, 3*3,
+    4*4, 4*4,
+};
+
+static const char *TYPE_DEFS[REFLECTED_DATA_TYPE_COUNT] = {
+    "#error \"unknown datatype\"",
+    "#error \"void\"",
+    "#error \"struct\"",
+    "#error \"sampler\"",
+
+    "int", "unsigned int", "float", "double",
+    "int", "unsigned int", "float", "double",
+    "int", "unsigned int", "float", "double",
+    "int", "unsigned int", "float", "double",
+
+    "float", "double",
+    "float", "double",
+    "float", "double",
+};
+
+static U32 component_size(ReflectedDataType type) {
+    switch (type) {
+        case REFLECTED_DATA_TYPE_F64:
+        case REFLECTED_DATA_TYPE_DVEC2:
+        case REFLECTED_DATA_TYPE_DVEC3:
+        case REFLECTED_DATA_TYPE_DVEC4:
+        case REFLECTED_DATA_TYPE_DMAT2:
+        case REFLECTED_DATA_TYPE_DMAT3:
+        case REFLECTED_DATA_TYPE_DMAT4:
+            return 8;
+        default:
+            return 4;
     }
+}
+
+// std140 pads the columns of mat2 and mat3 out to 16 bytes.
+static B8 is_padded_matrix(ReflectedType type) {
+    return type.cols > 1 && type.matrix_stride != 0 && type.matrix_stride != type.vec_size*component_size(type.data_type);
+}
 
-    char spaces[512] = {0};
-    for (U32 i = 0; i < level*4; i++) {
-        spaces[i] = ' ';
+// Size of the C type write_element emits.
+static U32 element_size(ReflectedType type) {
+    if (is_padded_matrix(type)) {
+        return type.cols*type.matrix_stride;
     }
+    return type.cols*type.vec_size*component_size(type.data_type);
+}
 
-    if (type.data_type == REFLECTED_DATA_TYPE_STRUCT) {
-        fprintf(fp, "%sstruct {\n", spaces);
-        for (U32 i = 0; i < type.member_count; i++) {
-            write_reflected_type(fp, ctypes, prefix, type.members[i], level + 1);
-        }
-        fprintf(fp, "%s} %.*s", spaces, (I32) type.name.len, type.name.data);
+// Stride of the innermost array dimension. The reflection gives the array
+// dimensions innermost first and the stride of the outermost one.
+static U32 element_stride(ReflectedType type) {
+    U32 inner_count = 1;
+    for (U32 i = 0; i + 1 < type.array_dimensions; i++) {
+        inner_count *= type.array_dimension_lengths[i];
+    }
+    return inner_count == 0 ? 0 : type.array_stride / inner_count;
+}
+
+static void write_indent(Buffer *out, U32 level) {
+    buffer_pushf(out, "%*s", (I32) level*4, "");
+}
+
+static void write_padding(Buffer *out, U32 level, U32 *pad_count, U32 size) {
+    write_indent(out, level);
+    buffer_pushf(out, "unsigned char _pad%u[%u];\n", (*pad_count)++, size);
+}
+
+// A non-struct value without its array dimensions. User types replace the
+// builtin ones unless their layout can't match, which is the case for padded
+// matrices.
+static void write_element(Buffer *out, const ArHashMap *ctypes, ReflectedType type, U32 level, ArStr name) {
+    write_indent(out, level);
+
+    ArStr user_type = ar_hash_map_get(ctypes, TYPE_NAMES[type.data_type], ArStr);
+    if (is_padded_matrix(type)) {
+        buffer_pushf(out, "%s %.*s[%u][%u]", TYPE_DEFS[type.data_type], (I32) name.len, name.data,
+                type.cols, type.matrix_stride / component_size(type.data_type));
+    } else if (user_type.len != 0) {
+        buffer_pushf(out, "%.*s %.*s", (I32) user_type.len, user_type.data, (I32) name.len, name.data);
     } else {
-        const ArStr type_name[REFLECTED_DATA_TYPE_COUNT] = {
-            ar_str_lit("ERR::Unkown"),
-
-            ar_str_lit("void"),
-            ar_str_lit("struct"),
-            ar_str_lit("sampler"),
-
-            ar_str_lit("int"),
-            ar_str_lit("uint"),
-            ar_str_lit("float"),
-            ar_str_lit("double"),
-
-            ar_str_lit("ivec2"),
-            ar_str_lit("uvec2"),
-            ar_str_lit("vec2"),
-            ar_str_lit("dvec2"),
-
-            ar_str_lit("ivec3"),
-            ar_str_lit("uvec3"),
-            ar_str_lit("vec3"),
-            ar_str_lit("dvec3"),
-
-            ar_str_lit("ivec4"),
-            ar_str_lit("uvec4"),
-            ar_str_lit("vec4"),
-            ar_str_lit("dvec4"),
-
-            ar_str_lit("mat2"),
-            ar_str_lit("dmat2"),
-
-            ar_str_lit("mat3"),
-            ar_str_lit("dmat3"),
-
-            ar_str_lit("mat4"),
-            ar_str_lit("dmat4"),
-        };
-
-        ArStr user_type = ar_hash_map_get(ctypes, type_name[type.data_type], ArStr);
-        if (user_type.len != 0) {
-            fprintf(fp, "%s%.*s %.*s", spaces, (I32) user_type.len, user_type.data, (I32) type.name.len, type.name.data);
-        } else {
-            const U32 type_arr_lens[REFLECTED_DATA_TYPE_COUNT] = {
-                0, 0, 0, 0,
-                0, 0, 0, 0,
-                2, 2, 2, 2,
-                3, 3, 3, 3,
-                4, 4, 4, 4,
-                2*2, 2*2,
-                3*3, 3*3,
-                4*4, 4*4,
-            };
-
-            const char *type_defs[REFLECTED_DATA_TYPE_COUNT] = {
-                "#error \"unknown datatype\"",
-                "#error \"void\"",
-                "#error \"struct\"",
-                "#error \"sampler\"",
-
-                "int", "unsigned int", "float", "double",
-                "int", "unsigned int", "float", "double",
-                "int", "unsigned int", "float", "double",
-                "int", "unsigned int", "float", "double",
-
-                "float", "double",
-                "float", "double",
-                "float", "double",
-            };
-            fprintf(fp, "%s%s %.*s", spaces, type_defs[type.data_type], (I32) type.name.len, type.name.data);
-
-            U32 arr_len = type_arr_lens[type.data_type];
-            if (arr_len > 0) {
-                fprintf(fp, "[%u]", arr_len);
-            }
+        buffer_pushf(out, "%s %.*s", TYPE_DEFS[type.data_type], (I32) name.len, name.data);
+        if (TYPE_ARR_LENS[type.data_type] > 0) {
+            buffer_pushf(out, "[%u]", TYPE_ARR_LENS[type.data_type]);
         }
     }
+}
 
+// Lengths set by a specialization constant are written with its default, the
+// layout only fits that value.
+static void write_array_dimensions(Buffer *out, ReflectedType type) {
     // Iterate backwards because the reflection gave the array dimensions in
     // reverse order.
     for (I32 i = type.array_dimensions - 1; i >= 0; i--) {
-        fprintf(fp, "[%u]", type.array_dimension_lengths[i]);
+        if (type.array_dimension_spec_ids[i] != REFLECTED_NO_SPEC_ID) {
+            buffer_pushf(out, "[%u /* spec constant %u */]", type.array_dimension_lengths[i], type.array_dimension_spec_ids[i]);
+        } else {
+            buffer_pushf(out, "[%u]", type.array_dimension_lengths[i]);
+        }
+    }
+}
+
+static void write_members(Buffer *out, const ArHashMap *ctypes, const ReflectedType *members, U32 member_count, U32 level, U32 size);
+
+static void write_member(Buffer *out, const ArHashMap *ctypes, ReflectedType type, U32 level) {
+    U32 stride = element_stride(type);
+    if (type.data_type == REFLECTED_DATA_TYPE_STRUCT) {
+        write_indent(out, level);
+        buffer_pushf(out, "struct {\n");
+        write_members(out, ctypes, type.members, type.member_count, level + 1, type.array_dimensions > 0 ? stride : type.size);
+        write_indent(out, level);
+        buffer_pushf(out, "} %.*s", (I32) type.name.len, type.name.data);
+    } else if (type.array_dimensions > 0 && stride > element_size(type)) {
+        // std140 rounds array strides up to 16 bytes.
+        U32 pad_count = 0;
+        write_indent(out, level);
+        buffer_pushf(out, "struct {\n");
+        write_element(out, ctypes, type, level + 1, ar_str_lit("value"));
+        buffer_pushf(out, ";\n");
+        write_padding(out, level + 1, &pad_count, stride - element_size(type));
+        write_indent(out, level);
+        buffer_pushf(out, "} %.*s", (I32) type.name.len, type.name.data);
+    } else {
+        write_element(out, ctypes, type, level, type.name);
+    }
+
+    write_array_dimensions(out, type);
+    buffer_pushf(out, ";\n");
+}
+
+// Members at their reflected offsets, with explicit padding in between and up
+// to 'size' at the end.
+static void write_members(Buffer *out, const ArHashMap *ctypes, const ReflectedType *members, U32 member_count, U32 level, U32 size) {
+    U32 pad_count = 0;
+    U32 end = 0;
+    for (U32 i = 0; i < member_count; i++) {
+        if (members[i].offset > end) {
+            write_padding(out, level, &pad_count, members[i].offset - end);
+        }
+        write_member(out, ctypes, members[i], level);
+        end = members[i].offset + members[i].size;
+    }
+    if (size > end) {
+        write_padding(out, level, &pad_count, size - end);
+    }
+}
+
+// Checks the offset of every member and the size and stride of every
+// non-struct one, so a C layout that doesn't match fails to compile instead of
+// uploading garbage. 'path' holds the designator of the parent member.
+static void write_layout_asserts(Buffer *out, const char *struct_name, const ReflectedType *members, U32 member_count,
+        U32 base_offset, char *path, U32 path_len, U32 path_cap) {
+    for (U32 i = 0; i < member_count; i++) {
+        ReflectedType member = members[i];
+        U32 len = path_len + snprintf(&path[path_len], path_cap - path_len, "%s%.*s",
+                path_len == 0 ? "" : ".", (I32) member.name.len, member.name.data);
+        if (len >= path_cap) {
+            continue;
+        }
+        U32 offset = base_offset + member.offset;
+        buffer_pushf(out, "_Static_assert(offsetof(%s, %s) == %u, \"%s offset\");\n", struct_name, path, offset, path);
+
+        if (member.data_type != REFLECTED_DATA_TYPE_STRUCT && member.size != 0) {
+            buffer_pushf(out, "_Static_assert(sizeof(((%s *) 0)->%s) == %u, \"%s size\");\n", struct_name, path, member.size, path);
+        }
+
+        U32 element_len = len;
+        for (U32 j = 0; j < member.array_dimensions && element_len < path_cap; j++) {
+            element_len += snprintf(&path[element_len], path_cap - element_len, "[0]");
+        }
+        if (element_len >= path_cap) {
+            continue;
+        }
+        if (member.array_dimensions > 0) {
+            buffer_pushf(out, "_Static_assert(sizeof(((%s *) 0)->%s) == %u, \"%s stride\");\n", struct_name, path, element_stride(member), path);
+        }
+        if (member.data_type == REFLECTED_DATA_TYPE_STRUCT) {
+            write_layout_asserts(out, struct_name, member.members, member.member_count, offset, path, element_len, path_cap);
+        }
+    }
+}
+
+static B8 has_runtime_array(ReflectedType type) {
+    if (type.member_count == 0) {
+        return false;
     }
-    fprintf(fp, ";\n");
+    ReflectedType last = type.members[type.member_count - 1];
+    return last.array_dimensions > 0 && last.array_dimension_lengths[last.array_dimensions - 1] == 0;
 }
 
-void write_reflected_types(FILE *fp, const ArHashMap *ctypes, const char *prefix, ReflectedStage stage) {
+// 'STRUCT_Element' for the elements of a storage buffer's trailing runtime
+// array, where it starts and 'STRUCT_SIZE(count)' for the size of the buffer
+// holding 'count' of them.
+static void write_runtime_array(Buffer *out, const ArHashMap *ctypes, const char *struct_name, ReflectedType array) {
+    // The outermost dimension is the runtime one.
+    ReflectedType element = array;
+    element.array_dimensions--;
+    element.offset = 0;
+    element.size = array.array_stride;
+    if (element.array_dimensions > 0) {
+        element.array_stride = array.array_stride / element.array_dimension_lengths[element.array_dimensions - 1];
+    } else if (element.data_type != REFLECTED_DATA_TYPE_STRUCT) {
+        element.size = element_size(element);
+    }
+
+    char element_name[512];
+    char path[512];
+    snprintf(element_name, sizeof(element_name), "%s_Element", struct_name);
+    buffer_pushf(out, "typedef struct %s %s;\n", element_name, element_name);
+    buffer_pushf(out, "struct %s {\n", element_name);
+    if (element.data_type == REFLECTED_DATA_TYPE_STRUCT && element.array_dimensions == 0) {
+        write_members(out, ctypes, element.members, element.member_count, 1, array.array_stride);
+        buffer_pushf(out, "};\n");
+        write_layout_asserts(out, element_name, element.members, element.member_count, 0, path, 0, sizeof(path));
+    } else {
+        element.name = ar_str_lit("value");
+        write_members(out, ctypes, &element, 1, 1, array.array_stride);
+        buffer_pushf(out, "};\n");
+        write_layout_asserts(out, element_name, &element, 1, 0, path, 0, sizeof(path));
+    }
+
+    buffer_pushf(out, "#define %s_ARRAY_OFFSET %u\n", struct_name, array.offset);
+    buffer_pushf(out, "#define %s_ELEMENT_STRIDE %u\n", struct_name, array.array_stride);
+    buffer_pushf(out, "_Static_assert(sizeof(%s) == %s_ELEMENT_STRIDE, \"%s stride\");\n", element_name, struct_name, element_name);
+    buffer_pushf(out, "#define %s_SIZE(count) (%s_ARRAY_OFFSET + (size_t) (count) * %s_ELEMENT_STRIDE)\n",
+            struct_name, struct_name, struct_name);
+}
+
+// Blocks become 'typedef struct PREFIX_NAME' laid out like the GPU sees them,
+// so they can be copied straight into mapped buffer memory. A trailing runtime
+// array is left out of it and written by write_runtime_array, the struct
+// itself is left out when that's the only member.
+void write_reflected_type(Buffer *out, const ArHashMap *ctypes, const char *prefix, ReflectedType type) {
+    if (type.data_type != REFLECTED_DATA_TYPE_STRUCT) {
+        return;
+    }
+
+    char struct_name[512];
+    snprintf(struct_name, sizeof(struct_name), "%s_%.*s", prefix, (I32) type.name.len, type.name.data);
+    U32 fixed_count = has_runtime_array(type) ? type.member_count - 1 : type.member_count;
+    if (fixed_count > 0) {
+        buffer_pushf(out, "typedef struct %s %s;\n", struct_name, struct_name);
+        buffer_pushf(out, "struct %s {\n", struct_name);
+        write_members(out, ctypes, type.members, fixed_count, 1, type.size);
+        buffer_pushf(out, "};\n");
+
+        char path[512];
+        write_layout_asserts(out, struct_name, type.members, fixed_count, 0, path, 0, sizeof(path));
+    }
+    if (fixed_count != type.member_count) {
+        write_runtime_array(out, ctypes, struct_name, type.members[fixed_count]);
+    }
+    buffer_pushf(out, "\n");
+}
+
+void write_reflected_types(Buffer *out, const ArHashMap *ctypes, const char *prefix, ReflectedStage stage) {
     for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
         for (U32 j = 0; j < stage.count[i]; j++) {
-            write_reflected_type(fp, ctypes, prefix, stage.types[i][j], 0);
+            write_reflected_type(out, ctypes, prefix, stage.types[i][j]);
         }
     }
 }
@@ -173,59 +361,1118 @@ void write_reflected_types(FILE *fp, const ArHashMap *ctypes, const char *prefix
 const char *test = "hehe"
                     "wow";
 
-void write_header(CompiledShader shader, const ArHashMap *ctypes, const char *filepath) {
-    FILE *fp = fopen(filepath, "wb");
+// Two lowercase hex digits for every byte value.
+static const char HEX_LUT[512] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
 
-    fprintf(fp, "#ifndef %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
-    fprintf(fp, "#define %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
+#define SPV_STRING_BYTES_PER_LINE 20
+#define SPV_WORDS_PER_LINE 8
+#define SPV_PACKED_BYTES_PER_LINE 16
 
-    fprintf(fp, "\n");
-    fprintf(fp, "// Vertex\n");
+// 'const char* NAME_VS_SOURCE = "\x03\x02..."', 20 bytes per line with the
+// continuation lines lined up under the opening quote.
+static void write_spv_string(Buffer *out, ArStr name, const char *stage, ArStr spv) {
+    U64 start = out->len;
+    buffer_pushf(out, "const char* %.*s_%s_SOURCE = \"", (I32) name.len, name.data, stage);
+    U64 indent = out->len - start - 1;
+
+    U64 line_count = spv.len / SPV_STRING_BYTES_PER_LINE;
+    buffer_reserve(out, spv.len*4 + line_count*(indent + 3) + 3);
+
+    U8 *curr = &out->data[out->len];
+    for (U64 i = 0; i < spv.len; i++) {
+        curr[0] = '\\';
+        curr[1] = 'x';
+        memcpy(&curr[2], &HEX_LUT[spv.data[i]*2], 2);
+        curr += 4;
+
+        if ((i + 1) % SPV_STRING_BYTES_PER_LINE == 0) {
+            *curr++ = '"';
+            *curr++ = '\n';
+            memset(curr, ' ', indent);
+            curr += indent;
+            *curr++ = '"';
+        }
+    }
+    memcpy(curr, "\";\n", 3);
+    curr += 3;
+    out->len = curr - out->data;
+}
+
+// 'static const uint32_t NAME_VS_SPV[]', which is aligned for
+// vkCreateShaderModule, and its length in words.
+static void write_spv_words(Buffer *out, ArStr name, const char *stage, ArStr spv) {
+    U64 word_count = spv.len / sizeof(U32);
+    buffer_pushf(out, "#define %.*s_%s_SPV_WORD_COUNT %llu\n", (I32) name.len, name.data, stage, (unsigned long long) word_count);
+    buffer_pushf(out, "static const uint32_t %.*s_%s_SPV[%.*s_%s_SPV_WORD_COUNT] = {\n",
+            (I32) name.len, name.data, stage,
+            (I32) name.len, name.data, stage);
+
+    // '    0x07230203, 0x00010000,\n'
+    U64 line_count = (word_count + SPV_WORDS_PER_LINE - 1) / SPV_WORDS_PER_LINE;
+    buffer_reserve(out, word_count*12 + line_count*4 + 3);
+
+    U8 *curr = &out->data[out->len];
+    for (U64 i = 0; i < word_count; i++) {
+        if (i % SPV_WORDS_PER_LINE == 0) {
+            memset(curr, ' ', 4);
+            curr += 4;
+        }
+
+        // The module is stored little endian.
+        const U8 *word = &spv.data[i*sizeof(U32)];
+        curr[0] = '0';
+        curr[1] = 'x';
+        memcpy(&curr[2], &HEX_LUT[word[3]*2], 2);
+        memcpy(&curr[4], &HEX_LUT[word[2]*2], 2);
+        memcpy(&curr[6], &HEX_LUT[word[1]*2], 2);
+        memcpy(&curr[8], &HEX_LUT[word[0]*2], 2);
+        curr[10] = ',';
+        curr[11] = (i + 1) % SPV_WORDS_PER_LINE == 0 || i + 1 == word_count ? '\n' : ' ';
+        curr += 12;
+    }
+    memcpy(curr, "};\n", 3);
+    curr += 3;
+    out->len = curr - out->data;
+}
+
+// 'static const uint8_t NAME_VS_SPV_PACKED[]', decoded with
+// arkin_shader_decode.
+static void write_spv_packed(Buffer *out, ArStr name, const char *stage, PackedSpv packed) {
+    buffer_pushf(out, "#define %.*s_%s_SPV_WORD_COUNT %llu\n", (I32) name.len, name.data, stage, (unsigned long long) packed.word_count);
+    buffer_pushf(out, "#define %.*s_%s_SPV_DECODE_WORDS %llu\n", (I32) name.len, name.data, stage, (unsigned long long) packed.decode_words);
+    buffer_pushf(out, "#define %.*s_%s_SPV_PACKED_SIZE %llu\n", (I32) name.len, name.data, stage, (unsigned long long) packed.data.len);
+    buffer_pushf(out, "static const uint8_t %.*s_%s_SPV_PACKED[%.*s_%s_SPV_PACKED_SIZE] = {\n",
+            (I32) name.len, name.data, stage,
+            (I32) name.len, name.data, stage);
+
+    // '    0x03, 0x02,\n'
+    U64 line_count = (packed.data.len + SPV_PACKED_BYTES_PER_LINE - 1) / SPV_PACKED_BYTES_PER_LINE;
+    buffer_reserve(out, packed.data.len*6 + line_count*4 + 3);
+
+    U8 *curr = &out->data[out->len];
+    for (U64 i = 0; i < packed.data.len; i++) {
+        if (i % SPV_PACKED_BYTES_PER_LINE == 0) {
+            memset(curr, ' ', 4);
+            curr += 4;
+        }
+        curr[0] = '0';
+        curr[1] = 'x';
+        memcpy(&curr[2], &HEX_LUT[packed.data.data[i]*2], 2);
+        curr[4] = ',';
+        curr[5] = (i + 1) % SPV_PACKED_BYTES_PER_LINE == 0 || i + 1 == packed.data.len ? '\n' : ' ';
+        curr += 6;
+    }
+    memcpy(curr, "};\n", 3);
+    curr += 3;
+    out->len = curr - out->data;
+}
+
+// Declarations of the symbols render_object defines.
+static void write_spv_externs(Buffer *out, ArStr name, const char *stage, B8 embed_reflection) {
+    buffer_pushf(out, "extern const uint32_t %.*s_%s_SPV[];\n", (I32) name.len, name.data, stage);
+    buffer_pushf(out, "extern const uint64_t %.*s_%s_SPV_SIZE;\n", (I32) name.len, name.data, stage);
+    if (embed_reflection) {
+        buffer_pushf(out, "extern const uint8_t %.*s_%s_REFLECTION[];\n", (I32) name.len, name.data, stage);
+        buffer_pushf(out, "extern const uint64_t %.*s_%s_REFLECTION_SIZE;\n", (I32) name.len, name.data, stage);
+    }
+}
+
+// 'NAME_CS_LOCAL_SIZE_X/Y/Z' for computing dispatch sizes at compile time.
+// Dimensions set by a specialization constant hold its default and also get
+// 'NAME_CS_LOCAL_SIZE_X_SPEC_ID'.
+static void write_workgroup_size(Buffer *out, const char *prefix, ReflectedStage stage) {
+    if (stage.workgroup_size[0] == 0) {
+        return;
+    }
+    static const char AXES[3] = { 'X', 'Y', 'Z' };
+    for (U32 i = 0; i < 3; i++) {
+        buffer_pushf(out, "#define %s_LOCAL_SIZE_%c %u\n", prefix, AXES[i], stage.workgroup_size[i]);
+        if (stage.workgroup_size_spec_ids[i] != REFLECTED_NO_SPEC_ID) {
+            buffer_pushf(out, "#define %s_LOCAL_SIZE_%c_SPEC_ID %u\n", prefix, AXES[i], stage.workgroup_size_spec_ids[i]);
+        }
+    }
+}
+
+// Vulkan format suffix of a vertex input's components, NULL for types that
+// can't be vertex inputs.
+static const char *vertex_format_suffix(ReflectedDataType type) {
+    switch (type) {
+        case REFLECTED_DATA_TYPE_I32:
+        case REFLECTED_DATA_TYPE_IVEC2:
+        case REFLECTED_DATA_TYPE_IVEC3:
+        case REFLECTED_DATA_TYPE_IVEC4:
+            return "SINT";
+        case REFLECTED_DATA_TYPE_U32:
+        case REFLECTED_DATA_TYPE_UVEC2:
+        case REFLECTED_DATA_TYPE_UVEC3:
+        case REFLECTED_DATA_TYPE_UVEC4:
+            return "UINT";
+        case REFLECTED_DATA_TYPE_UNKNOWN:
+        case REFLECTED_DATA_TYPE_VOID:
+        case REFLECTED_DATA_TYPE_STRUCT:
+        case REFLECTED_DATA_TYPE_SAMPLER:
+        case REFLECTED_DATA_TYPE_COUNT:
+            return NULL;
+        default:
+            return "SFLOAT";
+    }
+}
+
+static U32 array_element_count(ReflectedType type) {
+    U32 count = 1;
+    for (U32 i = 0; i < type.array_dimensions; i++) {
+        count *= type.array_dimension_lengths[i];
+    }
+    return count;
+}
+
+// 'PREFIX_Vertex' with the inputs packed in location order, its stride and,
+// when vulkan.h is included, the descriptions of a single interleaved buffer
+// at binding 0. Builtin C types keep the struct packed, user types may be
+// aligned beyond their size.
+static void write_vertex_layout(Buffer *out, const char *prefix, ReflectedStage stage) {
+    if (stage.input_count == 0) {
+        return;
+    }
+    for (U32 i = 0; i < stage.input_count; i++) {
+        if (vertex_format_suffix(stage.inputs[i].type.data_type) == NULL) {
+            return;
+        }
+    }
+
+    ArTemp scratch = ar_scratch_get(&out->arena, 1);
+    U32 *offsets = ar_arena_push_arr_no_zero(scratch.arena, U32, stage.input_count);
+    U32 stride = 0;
+    U32 alignment = 4;
+    U32 attribute_count = 0;
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ReflectedType type = stage.inputs[i].type;
+        U32 component = component_size(type.data_type);
+        stride = (stride + component - 1) / component * component;
+        alignment = ar_max(alignment, component);
+        offsets[i] = stride;
+        stride += element_size(type)*array_element_count(type);
+        attribute_count += type.cols*array_element_count(type);
+    }
+    stride = (stride + alignment - 1) / alignment * alignment;
+
+    buffer_pushf(out, "typedef struct %s_Vertex %s_Vertex;\n", prefix, prefix);
+    buffer_pushf(out, "struct %s_Vertex {\n", prefix);
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ReflectedType type = stage.inputs[i].type;
+        buffer_pushf(out, "    %s %.*s", TYPE_DEFS[type.data_type], (I32) type.name.len, type.name.data);
+        write_array_dimensions(out, type);
+        if (TYPE_ARR_LENS[type.data_type] > 0) {
+            buffer_pushf(out, "[%u]", TYPE_ARR_LENS[type.data_type]);
+        }
+        buffer_pushf(out, ";\n");
+    }
+    buffer_pushf(out, "};\n");
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ArStr name = stage.inputs[i].type.name;
+        buffer_pushf(out, "_Static_assert(offsetof(%s_Vertex, %.*s) == %u, \"%.*s offset\");\n",
+                prefix, (I32) name.len, name.data, offsets[i], (I32) name.len, name.data);
+    }
+    buffer_pushf(out, "#define %s_VERTEX_STRIDE %u\n", prefix, stride);
+    buffer_pushf(out, "_Static_assert(sizeof(%s_Vertex) == %s_VERTEX_STRIDE, \"%s_Vertex stride\");\n", prefix, prefix, prefix);
+    buffer_pushf(out, "#define %s_ATTRIBUTE_COUNT %u\n", prefix, attribute_count);
+
+    buffer_pushf(out, "#ifdef VK_VERSION_1_0\n");
+    buffer_pushf(out, "static const VkVertexInputBindingDescription %s_BINDING = { 0, %s_VERTEX_STRIDE, VK_VERTEX_INPUT_RATE_VERTEX };\n", prefix, prefix);
+    buffer_pushf(out, "static const VkVertexInputAttributeDescription %s_ATTRIBUTES[%s_ATTRIBUTE_COUNT] = {\n", prefix, prefix);
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ReflectedType type = stage.inputs[i].type;
+        U32 component = component_size(type.data_type);
+        // Matrices take a location per column, 64 bit vectors with more than
+        // two components take two.
+        U32 column_size = element_size(type) / type.cols;
+        U32 column_locations = component == 8 && type.vec_size > 2 ? 2 : 1;
+        U32 column_count = type.cols*array_element_count(type);
+        for (U32 j = 0; j < column_count; j++) {
+            buffer_pushf(out, "    { %u, 0, VK_FORMAT_", stage.inputs[i].location + j*column_locations);
+            for (U32 k = 0; k < type.vec_size; k++) {
+                buffer_pushf(out, "%c%u", "RGBA"[k], component*8);
+            }
+            buffer_pushf(out, "_%s, %u },\n", vertex_format_suffix(type.data_type), offsets[i] + j*column_size);
+        }
+    }
+    buffer_pushf(out, "};\n");
+    buffer_pushf(out, "#endif\n");
+
+    ar_scratch_release(&scratch);
+}
+
+// '%.9g' leaves out the '.' of whole numbers, which C needs to read them as
+// floating point.
+static void write_float(Buffer *out, F64 value, I32 digits, const char *suffix) {
+    char number[64];
+    snprintf(number, sizeof(number), "%.*g", digits, value);
+    buffer_pushf(out, "%s%s%s", number, strpbrk(number, ".eEn") == NULL ? ".0" : "", suffix);
+}
+
+// Constants without a name, such as those behind 'local_size_x_id', are
+// called 'constant_ID'.
+static void write_spec_constant_name(Buffer *out, ReflectedSpecConstant constant) {
+    if (constant.name.len == 0) {
+        buffer_pushf(out, "constant_%u", constant.id);
+    } else {
+        buffer_pushf(out, "%.*s", (I32) constant.name.len, constant.name.data);
+    }
+}
+
+// 'PREFIX_SpecConstants' with a member per specialization constant, its
+// defaults and, when vulkan.h is included, the map entries of a
+// VkSpecializationInfo pointing at it.
+static void write_spec_constants(Buffer *out, const char *prefix, ReflectedStage stage) {
+    if (stage.spec_constant_count == 0) {
+        return;
+    }
+
+    buffer_pushf(out, "typedef struct %s_SpecConstants %s_SpecConstants;\n", prefix, prefix);
+    buffer_pushf(out, "struct %s_SpecConstants {\n", prefix);
+    for (U32 i = 0; i < stage.spec_constant_count; i++) {
+        buffer_pushf(out, "    %s ", TYPE_DEFS[stage.spec_constants[i].data_type]);
+        write_spec_constant_name(out, stage.spec_constants[i]);
+        buffer_pushf(out, ";\n");
+    }
+    buffer_pushf(out, "};\n");
+    buffer_pushf(out, "#define %s_SPEC_CONSTANT_COUNT %llu\n", prefix, (unsigned long long) stage.spec_constant_count);
+
+    buffer_pushf(out, "static const %s_SpecConstants %s_SPEC_CONSTANT_DEFAULTS = {\n", prefix, prefix);
+    for (U32 i = 0; i < stage.spec_constant_count; i++) {
+        ReflectedSpecConstant constant = stage.spec_constants[i];
+        buffer_pushf(out, "    .");
+        write_spec_constant_name(out, constant);
+        buffer_pushf(out, " = ");
+        switch (constant.data_type) {
+            case REFLECTED_DATA_TYPE_I32:
+                buffer_pushf(out, "%d", (I32) (U32) constant.default_value);
+                break;
+            case REFLECTED_DATA_TYPE_F32: {
+                U32 bits = constant.default_value;
+                F32 value;
+                memcpy(&value, &bits, sizeof(value));
+                write_float(out, value, 9, "f");
+            } break;
+            case REFLECTED_DATA_TYPE_F64: {
+                F64 value;
+                memcpy(&value, &constant.default_value, sizeof(value));
+                write_float(out, value, 17, "");
+            } break;
+            default:
+                buffer_pushf(out, "%uu", (U32) constant.default_value);
+                break;
+        }
+        buffer_pushf(out, ",\n");
+    }
+    buffer_pushf(out, "};\n");
+
+    buffer_pushf(out, "#ifdef VK_VERSION_1_0\n");
+    buffer_pushf(out, "static const VkSpecializationMapEntry %s_SPEC_MAP_ENTRIES[%s_SPEC_CONSTANT_COUNT] = {\n", prefix, prefix);
+    for (U32 i = 0; i < stage.spec_constant_count; i++) {
+        buffer_pushf(out, "    { %u, offsetof(%s_SpecConstants, ", stage.spec_constants[i].id, prefix);
+        write_spec_constant_name(out, stage.spec_constants[i]);
+        buffer_pushf(out, "), sizeof(((%s_SpecConstants *) 0)->", prefix);
+        write_spec_constant_name(out, stage.spec_constants[i]);
+        buffer_pushf(out, ") },\n");
+    }
+    buffer_pushf(out, "};\n");
+    buffer_pushf(out, "#endif\n");
+}
+
+// SPIR-V sizes of every packed stage of a program, for reporting the ratio.
+typedef struct PackedTotals PackedTotals;
+struct PackedTotals {
+    U64 spv_size;
+    U64 packed_size;
+};
+
+static B8 write_stage(Buffer *out, CompiledShader shader, const ArHashMap *ctypes, OutputOptions options,
+        ShaderType type, const char *title, const char *stage_name, CompiledStage stage, PackedTotals *totals) {
+    buffer_pushf(out, "\n");
+    buffer_pushf(out, "// %s\n", title);
 
     // Create push constants and uniform buffer types.
     char prefix[512] = {0};
-    snprintf(prefix, 512, "%.*s_VS", (I32) shader.name.len, shader.name.data);
-    write_reflected_types(fp, ctypes, prefix, shader.vertex.reflection);
+    snprintf(prefix, 512, "%.*s_%s", (I32) shader.name.len, shader.name.data, stage_name);
+    write_reflected_types(out, ctypes, prefix, stage.reflection);
+    write_workgroup_size(out, prefix, stage.reflection);
+    write_spec_constants(out, prefix, stage.reflection);
+    if (type == SHADER_TYPE_VERTEX) {
+        write_vertex_layout(out, prefix, stage.reflection);
+    }
+
+    if (options.compression != COMPRESSION_NONE) {
+        ArTemp scratch = ar_scratch_get(&out->arena, 1);
+        PackedSpv packed;
+        if (!pack_spv(scratch.arena, stage.spv, options.compression, &packed) ||
+                !verify_packed_spv(packed, stage.spv)) {
+            report_error("%.*s: Failed to compress the %s stage.", (I32) shader.name.len, shader.name.data, title);
+            ar_scratch_release(&scratch);
+            return false;
+        }
+        totals->spv_size += stage.spv.len;
+        totals->packed_size += packed.data.len;
+
+        write_spv_packed(out, shader.name, stage_name, packed);
+        ar_scratch_release(&scratch);
+        return true;
+    }
 
     // Create SPV source variable.
-    U32 len = fprintf(fp, "const char* %.*s_VS_SOURCE = \"", (I32) shader.name.len, shader.name.data);
-    for (U64 i = 0; i < shader.vertex.spv.len; i++) {
-        fprintf(fp, "\\x%.2x", shader.vertex.spv.data[i]);
-        if ((i + 1) % 20 == 0) {
-            fprintf(fp, "\"\n");
-            for (U32 j = 0; j < len-1; j++) {
-                fputc(' ', fp);
+    switch (options.spv_format) {
+        case SPV_FORMAT_STRING:
+            write_spv_string(out, shader.name, stage_name, stage.spv);
+            break;
+        case SPV_FORMAT_WORDS:
+            write_spv_words(out, shader.name, stage_name, stage.spv);
+            break;
+        case SPV_FORMAT_OBJECT:
+            write_spv_externs(out, shader.name, stage_name, options.embed_reflection);
+            break;
+    }
+    return true;
+}
+
+// Stage name of the symbols holding variant 'key', which are the base ones or
+// those of the first variant with the same SPIR-V.
+static void variant_stage_name(char *out, U64 size, const char *stage_name, const CompiledStage *variants, U32 key) {
+    U32 first = variant_first_key(variants, key);
+    if (first == 0) {
+        snprintf(out, size, "%s", stage_name);
+    } else {
+        snprintf(out, size, "%s_V%u", stage_name, first);
+    }
+}
+
+// Every unique variant past the base one, as 'NAME_VS_V<key>'.
+static B8 write_variant_stages(Buffer *out, CompiledShader shader, const ArHashMap *ctypes, OutputOptions options,
+        ShaderType type, const char *title, const char *stage_name, const CompiledStage *variants, PackedTotals *totals) {
+    B8 success = true;
+    for (U32 key = 1; key < shader.variant_count; key++) {
+        if (variant_first_key(variants, key) != key) {
+            continue;
+        }
+        char variant_title[64];
+        char variant_name[64];
+        snprintf(variant_title, sizeof(variant_title), "%s variant %u", title, key);
+        snprintf(variant_name, sizeof(variant_name), "%s_V%u", stage_name, key);
+        success &= write_stage(out, shader, ctypes, options, type, variant_title, variant_name, variants[key], totals);
+    }
+    return success;
+}
+
+typedef struct VariantTable VariantTable;
+struct VariantTable {
+    const char *type;
+    // Of the per variant symbols the table points at.
+    const char *suffix;
+    const char *address_of;
+};
+
+static const VariantTable PACKED_VARIANT_TABLES[] = {
+    { "const uint8_t *const", "SPV_PACKED", "" },
+    { "const uint64_t", "SPV_PACKED_SIZE", "" },
+    { "const uint64_t", "SPV_DECODE_WORDS", "" },
+    { "const uint64_t", "SPV_WORD_COUNT", "" },
+};
+// The sources are pointer variables, so the table points at them.
+static const VariantTable STRING_VARIANT_TABLES[] = {
+    { "const char *const *const", "SOURCE", "&" },
+};
+static const VariantTable WORDS_VARIANT_TABLES[] = {
+    { "const uint32_t *const", "SPV", "" },
+};
+
+// 'NAME_VS_VARIANT_*[NAME_VARIANT_COUNT]', indexed by variant key.
+static void write_variant_table(Buffer *out, CompiledShader shader, OutputOptions options, const char *stage_name, const CompiledStage *variants) {
+    ArStr name = shader.name;
+    const VariantTable *tables = WORDS_VARIANT_TABLES;
+    U32 table_count = ar_arrlen(WORDS_VARIANT_TABLES);
+    if (options.compression != COMPRESSION_NONE) {
+        tables = PACKED_VARIANT_TABLES;
+        table_count = ar_arrlen(PACKED_VARIANT_TABLES);
+    } else if (options.spv_format == SPV_FORMAT_STRING) {
+        tables = STRING_VARIANT_TABLES;
+        table_count = ar_arrlen(STRING_VARIANT_TABLES);
+    }
+
+    buffer_pushf(out, "\n");
+    for (U32 i = 0; i < table_count; i++) {
+        buffer_pushf(out, "static %s %.*s_%s_VARIANT_%s[%.*s_VARIANT_COUNT] = {\n",
+                tables[i].type, (I32) name.len, name.data, stage_name, tables[i].suffix, (I32) name.len, name.data);
+        for (U32 key = 0; key < shader.variant_count; key++) {
+            char symbol_stage[64];
+            variant_stage_name(symbol_stage, sizeof(symbol_stage), stage_name, variants, key);
+            buffer_pushf(out, "    %s%.*s_%s_%s,\n",
+                    tables[i].address_of, (I32) name.len, name.data, symbol_stage, tables[i].suffix);
+        }
+        buffer_pushf(out, "};\n");
+    }
+
+    // Sizes of the decoded SPIR-V in bytes.
+    buffer_pushf(out, "static const uint64_t %.*s_%s_VARIANT_SPV_SIZE[%.*s_VARIANT_COUNT] = {\n",
+            (I32) name.len, name.data, stage_name, (I32) name.len, name.data);
+    for (U32 key = 0; key < shader.variant_count; key++) {
+        buffer_pushf(out, "    %llu,\n", (unsigned long long) variants[key].spv.len);
+    }
+    buffer_pushf(out, "};\n");
+}
+
+// Key constants, a variant's key is the sum of one constant per axis.
+static void write_variant_keys(Buffer *out, CompiledShader shader) {
+    ArStr name = shader.name;
+    buffer_pushf(out, "\n");
+    buffer_pushf(out, "// Variants\n");
+    buffer_pushf(out, "#define %.*s_VARIANT_COUNT %u\n", (I32) name.len, name.data, shader.variant_count);
+
+    U32 stride = 1;
+    for (U32 i = 0; i < shader.axis_count; i++) {
+        VariantAxis axis = shader.axes[i];
+        if (axis.value_count == 0) {
+            buffer_pushf(out, "#define %.*s_VARIANT_%.*s %u\n",
+                    (I32) name.len, name.data, (I32) axis.name.len, axis.name.data, stride);
+            stride *= 2;
+            continue;
+        }
+        for (U32 j = 0; j < axis.value_count; j++) {
+            buffer_pushf(out, "#define %.*s_VARIANT_%.*s_%.*s %u\n",
+                    (I32) name.len, name.data,
+                    (I32) axis.name.len, axis.name.data,
+                    (I32) axis.values[j].len, axis.values[j].data,
+                    j*stride);
+        }
+        stride *= axis.value_count;
+    }
+}
+
+static const char *DESCRIPTOR_TYPE_NAMES[REFLECTED_DESCRIPTOR_TYPE_COUNT] = {
+    "VK_DESCRIPTOR_TYPE_SAMPLER",
+    "VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER",
+    "VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE",
+    "VK_DESCRIPTOR_TYPE_STORAGE_IMAGE",
+    "VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER",
+    "VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER",
+    "VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER",
+    "VK_DESCRIPTOR_TYPE_STORAGE_BUFFER",
+    "VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT",
+};
+
+typedef struct ProgramBinding ProgramBinding;
+struct ProgramBinding {
+    ReflectedBinding binding;
+    // Indexed by ShaderType, set for the stages declaring it.
+    B8 stages[SHADER_TYPE_COUNT];
+};
+
+// Adds the bindings of 'stage' to the sorted 'bindings'. The first declaration
+// wins when stages disagree on a binding.
+static void merge_bindings(ProgramBinding *bindings, U32 *binding_count, ArStr program, ShaderType type, ReflectedStage stage) {
+    for (U32 i = 0; i < stage.binding_count; i++) {
+        ReflectedBinding binding = stage.bindings[i];
+
+        U32 j = 0;
+        while (j < *binding_count && (bindings[j].binding.set < binding.set ||
+                    (bindings[j].binding.set == binding.set && bindings[j].binding.binding < binding.binding))) {
+            j++;
+        }
+
+        if (j < *binding_count && bindings[j].binding.set == binding.set && bindings[j].binding.binding == binding.binding) {
+            ReflectedBinding existing = bindings[j].binding;
+            if (existing.descriptor_type != binding.descriptor_type || existing.count != binding.count) {
+                ar_warn("%.*s: '%.*s' and '%.*s' both use binding %u of set %u, keeping '%.*s'.",
+                        (I32) program.len, program.data,
+                        (I32) existing.name.len, existing.name.data,
+                        (I32) binding.name.len, binding.name.data,
+                        binding.binding, binding.set,
+                        (I32) existing.name.len, existing.name.data);
             }
-            fputc('\"', fp);
+            bindings[j].stages[type] = true;
+            continue;
         }
+
+        memmove(&bindings[j + 1], &bindings[j], (*binding_count - j) * sizeof(ProgramBinding));
+        bindings[j] = (ProgramBinding) { .binding = binding };
+        bindings[j].stages[type] = true;
+        (*binding_count)++;
     }
-    fprintf(fp, "\";\n");
+}
 
-    fprintf(fp, "\n");
-    fprintf(fp, "// Fragment\n");
+// Every stage of the program, variants included, so the layouts fit all of
+// them.
+static U32 program_stages(CompiledShader shader, ReflectedStage *stages, ShaderType *types) {
+    U32 count = 0;
+    U32 variant_count = shader.axis_count == 0 ? 1 : shader.variant_count;
+    for (U32 key = 0; key < variant_count; key++) {
+        if (shader.type == PROGRAM_TYPE_COMPUTE) {
+            types[count] = SHADER_TYPE_COMPUTE;
+            stages[count++] = shader.axis_count == 0 ? shader.compute.reflection : shader.compute_variants[key].reflection;
+        } else {
+            types[count] = SHADER_TYPE_VERTEX;
+            stages[count++] = shader.axis_count == 0 ? shader.vertex.reflection : shader.vertex_variants[key].reflection;
+            types[count] = SHADER_TYPE_FRAGMENT;
+            stages[count++] = shader.axis_count == 0 ? shader.fragment.reflection : shader.fragment_variants[key].reflection;
+        }
+    }
+    return count;
+}
 
-    // Create push constants and uniform buffer types.
-    snprintf(prefix, 512, "%.*s_FS", (I32) shader.name.len, shader.name.data);
-    write_reflected_types(fp, ctypes, prefix, shader.fragment.reflection);
+// 'NAME_SET_LAYOUTS' with a 'NAME_SET<n>_BINDINGS' array per set and
+// 'NAME_POOL_SIZES' for allocating one of each set, built from the bindings of
+// every stage. The tables are only declared when vulkan.h was included before
+// the header.
+static void write_descriptor_sets(Buffer *out, CompiledShader shader) {
+    static const char *STAGE_BITS[SHADER_TYPE_COUNT] = {
+        [SHADER_TYPE_VERTEX] = "VK_SHADER_STAGE_VERTEX_BIT",
+        [SHADER_TYPE_FRAGMENT] = "VK_SHADER_STAGE_FRAGMENT_BIT",
+        [SHADER_TYPE_COMPUTE] = "VK_SHADER_STAGE_COMPUTE_BIT",
+    };
 
-    // Create SPV source variable.
-    len = fprintf(fp, "const char* %.*s_FS_SOURCE = \"", (I32) shader.name.len, shader.name.data);
-    for (U64 i = 0; i < shader.fragment.spv.len; i++) {
-        fprintf(fp, "\\x%.2x", shader.fragment.spv.data[i]);
-        if ((i + 1) % 20 == 0) {
-            fprintf(fp, "\"\n");
-            for (U32 j = 0; j < len-1; j++) {
-                fputc(' ', fp);
+    ArTemp scratch = ar_scratch_get(&out->arena, 1);
+    U32 max_stage_count = 2*(shader.axis_count == 0 ? 1 : shader.variant_count);
+    ReflectedStage *stages = ar_arena_push_arr_no_zero(scratch.arena, ReflectedStage, max_stage_count);
+    ShaderType *types = ar_arena_push_arr_no_zero(scratch.arena, ShaderType, max_stage_count);
+    U32 stage_count = program_stages(shader, stages, types);
+
+    U32 max_binding_count = 0;
+    for (U32 i = 0; i < stage_count; i++) {
+        max_binding_count += stages[i].binding_count;
+    }
+    if (max_binding_count == 0) {
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    ProgramBinding *bindings = ar_arena_push_arr_no_zero(scratch.arena, ProgramBinding, max_binding_count);
+    U32 binding_count = 0;
+    for (U32 i = 0; i < stage_count; i++) {
+        merge_bindings(bindings, &binding_count, shader.name, types[i], stages[i]);
+    }
+
+    ArStr name = shader.name;
+    U32 set_count = bindings[binding_count - 1].binding.set + 1;
+    U32 pool_sizes[REFLECTED_DESCRIPTOR_TYPE_COUNT] = {0};
+    U32 pool_size_count = 0;
+    for (U32 i = 0; i < binding_count; i++) {
+        ReflectedBinding binding = bindings[i].binding;
+        pool_size_count += pool_sizes[binding.descriptor_type] == 0 && binding.count != 0;
+        pool_sizes[binding.descriptor_type] += binding.count;
+    }
+
+    buffer_pushf(out, "\n");
+    buffer_pushf(out, "// Descriptor sets\n");
+    buffer_pushf(out, "#define %.*s_SET_COUNT %u\n", (I32) name.len, name.data, set_count);
+    U32 first = 0;
+    for (U32 set = 0; set < set_count; set++) {
+        U32 end = first;
+        while (end < binding_count && bindings[end].binding.set == set) {
+            end++;
+        }
+        buffer_pushf(out, "#define %.*s_SET%u_BINDING_COUNT %u\n", (I32) name.len, name.data, set, end - first);
+        first = end;
+    }
+    buffer_pushf(out, "#define %.*s_POOL_SIZE_COUNT %u\n", (I32) name.len, name.data, pool_size_count);
+
+    buffer_pushf(out, "#ifdef VK_VERSION_1_0\n");
+    first = 0;
+    for (U32 set = 0; set < set_count; set++) {
+        if (first == binding_count || bindings[first].binding.set != set) {
+            continue;
+        }
+        buffer_pushf(out, "static const VkDescriptorSetLayoutBinding %.*s_SET%u_BINDINGS[%.*s_SET%u_BINDING_COUNT] = {\n",
+                (I32) name.len, name.data, set, (I32) name.len, name.data, set);
+        for (; first < binding_count && bindings[first].binding.set == set; first++) {
+            ReflectedBinding binding = bindings[first].binding;
+            buffer_pushf(out, "    { %u, %s, %u, ", binding.binding, DESCRIPTOR_TYPE_NAMES[binding.descriptor_type], binding.count);
+            B8 separator = false;
+            for (U32 type = 0; type < SHADER_TYPE_COUNT; type++) {
+                if (bindings[first].stages[type]) {
+                    buffer_pushf(out, "%s%s", separator ? " | " : "", STAGE_BITS[type]);
+                    separator = true;
+                }
+            }
+            buffer_pushf(out, ", NULL }, // %.*s\n", (I32) binding.name.len, binding.name.data);
+        }
+        buffer_pushf(out, "};\n");
+    }
+
+    buffer_pushf(out, "static const VkDescriptorSetLayoutCreateInfo %.*s_SET_LAYOUTS[%.*s_SET_COUNT] = {\n",
+            (I32) name.len, name.data, (I32) name.len, name.data);
+    first = 0;
+    for (U32 set = 0; set < set_count; set++) {
+        B8 empty = first == binding_count || bindings[first].binding.set != set;
+        buffer_pushf(out, "    { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, NULL, 0, %.*s_SET%u_BINDING_COUNT, ",
+                (I32) name.len, name.data, set);
+        if (empty) {
+            buffer_pushf(out, "NULL },\n");
+        } else {
+            buffer_pushf(out, "%.*s_SET%u_BINDINGS },\n", (I32) name.len, name.data, set);
+        }
+        while (first < binding_count && bindings[first].binding.set == set) {
+            first++;
+        }
+    }
+    buffer_pushf(out, "};\n");
+
+    // Runtime sized arrays have no count to reserve.
+    if (pool_size_count != 0) {
+        buffer_pushf(out, "static const VkDescriptorPoolSize %.*s_POOL_SIZES[%.*s_POOL_SIZE_COUNT] = {\n",
+                (I32) name.len, name.data, (I32) name.len, name.data);
+        for (U32 type = 0; type < REFLECTED_DESCRIPTOR_TYPE_COUNT; type++) {
+            if (pool_sizes[type] != 0) {
+                buffer_pushf(out, "    { %s, %u },\n", DESCRIPTOR_TYPE_NAMES[type], pool_sizes[type]);
+            }
+        }
+        buffer_pushf(out, "};\n");
+    }
+    buffer_pushf(out, "#endif\n");
+
+    ar_scratch_release(&scratch);
+}
+
+// Each program gets its own guard, so headers defining the same program can
+// be included together.
+static B8 render_program(Buffer *out, CompiledShader shader, const ArHashMap *ctypes, OutputOptions options) {
+    buffer_pushf(out, "#ifndef %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
+    buffer_pushf(out, "#define %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
+    buffer_pushf(out, "\n");
+    // For the layout checks of the reflected structs.
+    buffer_pushf(out, "#include <stddef.h>\n");
+    if (options.compression != COMPRESSION_NONE) {
+        buffer_pushf(out, "\n");
+        buffer_pushf(out, "%s", SPV_DECODER_SOURCE);
+    } else if (options.spv_format != SPV_FORMAT_STRING || shader.axis_count != 0) {
+        buffer_pushf(out, "#include <stdint.h>\n");
+    }
+
+    B8 success = true;
+    PackedTotals totals = {0};
+    if (shader.type == PROGRAM_TYPE_COMPUTE) {
+        success &= write_stage(out, shader, ctypes, options, SHADER_TYPE_COMPUTE, "Compute", "CS", shader.compute, &totals);
+    } else {
+        success &= write_stage(out, shader, ctypes, options, SHADER_TYPE_VERTEX, "Vertex", "VS", shader.vertex, &totals);
+        success &= write_stage(out, shader, ctypes, options, SHADER_TYPE_FRAGMENT, "Fragment", "FS", shader.fragment, &totals);
+    }
+    write_descriptor_sets(out, shader);
+
+    if (shader.axis_count != 0 && shader.type == PROGRAM_TYPE_COMPUTE) {
+        success &= write_variant_stages(out, shader, ctypes, options, SHADER_TYPE_COMPUTE, "Compute", "CS", shader.compute_variants, &totals);
+        write_variant_keys(out, shader);
+        write_variant_table(out, shader, options, "CS", shader.compute_variants);
+    } else if (shader.axis_count != 0) {
+        success &= write_variant_stages(out, shader, ctypes, options, SHADER_TYPE_VERTEX, "Vertex", "VS", shader.vertex_variants, &totals);
+        success &= write_variant_stages(out, shader, ctypes, options, SHADER_TYPE_FRAGMENT, "Fragment", "FS", shader.fragment_variants, &totals);
+        write_variant_keys(out, shader);
+        write_variant_table(out, shader, options, "VS", shader.vertex_variants);
+        write_variant_table(out, shader, options, "FS", shader.fragment_variants);
+    }
+
+    buffer_pushf(out, "\n");
+    buffer_pushf(out, "#endif\n");
+
+    // Decode speed is left to '--bench-decode'.
+    if (success && totals.spv_size != 0 && diagnostics_current() == NULL) {
+        ar_info("%.*s: Packed %llu -> %llu bytes (%.1f%%).",
+                (I32) shader.name.len, shader.name.data,
+                (unsigned long long) totals.spv_size,
+                (unsigned long long) totals.packed_size,
+                100.0 * totals.packed_size / totals.spv_size);
+    }
+    return success;
+}
+
+B8 render_header(Buffer *out, const CompiledShader *programs, U64 program_count, const ArHashMap *ctypes, OutputOptions options) {
+    B8 success = true;
+    for (U64 i = 0; i < program_count; i++) {
+        if (i != 0) {
+            buffer_pushf(out, "\n");
+        }
+        success &= render_program(out, programs[i], ctypes, options);
+    }
+    return success;
+}
+
+B8 write_header(const CompiledShader *programs, U64 program_count, const ArHashMap *ctypes, OutputOptions options, const char *filepath) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    Buffer header = { .arena = scratch.arena };
+    B8 success = render_header(&header, programs, program_count, ctypes, options) && write_file(filepath, buffer_str(header));
+
+    ar_scratch_release(&scratch);
+    return success;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [options] <input>...\n", program);
+    printf("\n");
+    printf("Inputs can be shader files, directories which are searched for '.glsl'\n");
+    printf("files, or '@manifest' files listing one input per line.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -o <dir>     Write headers to '<dir>/<input name>.h'. Inputs found through a\n");
+    printf("                 directory or manifest keep their subdirectory below it.\n");
+    printf("    -I <dir>     Add an include search path.\n");
+    printf("    -j <count>   Number of worker threads. Defaults to one per CPU.\n");
+    printf("    -MD          Also write a Makefile/Ninja depfile to '<header>.d'.\n");
+    printf("    -MF <file>   Write the depfile to <file>. Single input only.\n");
+    printf("    -M           Only write depfiles, don't compile.\n");
+    printf("    -O           Optimize SPIR-V for performance.\n");
+    printf("    -Os          Optimize SPIR-V for size and strip debug info.\n");
+    printf("    -O0          Don't optimize SPIR-V (default).\n");
+    printf("    -h           Show this message.\n");
+    printf("    --cache-dir <dir>\n");
+    printf("                 Cache compiled stages in <dir>.\n");
+    printf("    --cache-size <size>\n");
+    printf("                 Cache size cap, accepts K, M and G suffixes. Defaults to 256M.\n");
+    printf("    --watch      Keep running and recompile programs when they or any file\n");
+    printf("                 they include change. New files require a restart.\n");
+    printf("    --server <socket>\n");
+    printf("                 Serve compile requests on a Unix domain socket, keeping\n");
+    printf("                 the compiler and included files loaded between requests.\n");
+    printf("    --client <socket>\n");
+    printf("                 Send compiles to a server started with '--server'.\n");
+    printf("    --spv-format <string|words|object>\n");
+    printf("                 Embed SPIR-V as a 'const char*' string (default), as an\n");
+    printf("                 aligned 'uint32_t' array with a word count, or in an ELF\n");
+    printf("                 object next to the header, which declares its symbols.\n");
+    printf("    --compress <smolv|smolv-lz>\n");
+    printf("                 Embed SPIR-V packed with a SPIR-V aware varint encoding,\n");
+    printf("                 optionally followed by LZ compression, along with a small\n");
+    printf("                 decoder. Reports the ratio.\n");
+    printf("    --embed-reflection\n");
+    printf("                 Also put the reflection data in the object.\n");
+    printf("    --pack <file>\n");
+    printf("                 Write every program to a single shader pack instead of\n");
+    printf("                 headers, loaded at runtime with 'arkin_pack.h'.\n");
+    printf("    --bench-pack <file>\n");
+    printf("                 Time loading a shader pack against copying the same SPIR-V\n");
+    printf("                 out of headers, then exit.\n");
+    printf("    --bench-parse\n");
+    printf("                 Report how fast every input file parses and the peak memory\n");
+    printf("                 used, then exit.\n");
+    printf("    --bench-reflect\n");
+    printf("                 Time reflecting every stage with a reused SPIRV-Cross\n");
+    printf("                 context against a new one per stage, then exit.\n");
+    printf("    --bench-decode\n");
+    printf("                 Report how fast every stage decodes when packed with\n");
+    printf("                 '--compress', smolv-lz by default, then exit.\n");
+}
+
+// Returns the argument of an option 'len' characters long, either attached
+// ('-Ipath') or as the next argument ('-I path').
+static const char *option_arg(I32 argc, char **argv, I32 *i, U32 len) {
+    if (argv[*i][len] != '\0') {
+        return &argv[*i][len];
+    }
+    if (*i + 1 >= argc) {
+        ar_error("%s: Missing argument.", argv[*i]);
+        return NULL;
+    }
+    (*i)++;
+    return argv[*i];
+}
+
+// Returns the argument of a long option, either attached ('--opt=value') or
+// as the next argument ('--opt value'). NULL if 'argv[*i]' isn't 'name'.
+static const char *long_option_arg(I32 argc, char **argv, I32 *i, const char *name, B8 *error) {
+    U64 len = strlen(name);
+    if (strncmp(argv[*i], name, len) != 0) {
+        return NULL;
+    }
+
+    if (argv[*i][len] == '=') {
+        return &argv[*i][len + 1];
+    }
+    if (argv[*i][len] != '\0') {
+        return NULL;
+    }
+
+    if (*i + 1 >= argc) {
+        ar_error("%s: Missing argument.", argv[*i]);
+        *error = true;
+        return NULL;
+    }
+    (*i)++;
+    return argv[*i];
+}
+
+// Parses sizes like '512', '64K', '256M' and '2G'.
+static U64 parse_size(const char *str) {
+    char *end = NULL;
+    U64 size = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'k':
+        case 'K':
+            size <<= 10;
+            break;
+        case 'm':
+        case 'M':
+            size <<= 20;
+            break;
+        case 'g':
+        case 'G':
+            size <<= 30;
+            break;
+    }
+    return size;
+}
+
+static B8 parse_options(ArArena *arena, I32 argc, char **argv, Options *options) {
+    options->cache_size = 256 << 20;
+
+    for (I32 i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] == '\0') {
+            ar_str_list_push(arena, &options->inputs, ar_str_cstr(arg));
+            continue;
+        }
+
+        if (arg[1] == '-') {
+            B8 error = false;
+            const char *value = NULL;
+            if ((value = long_option_arg(argc, argv, &i, "--cache-dir", &error)) != NULL) {
+                options->cache_dir = ar_str_cstr(value);
+            } else if ((value = long_option_arg(argc, argv, &i, "--cache-size", &error)) != NULL) {
+                options->cache_size = parse_size(value);
+            } else if ((value = long_option_arg(argc, argv, &i, "--server", &error)) != NULL) {
+                options->server = ar_str_cstr(value);
+            } else if ((value = long_option_arg(argc, argv, &i, "--client", &error)) != NULL) {
+                options->client = ar_str_cstr(value);
+            } else if ((value = long_option_arg(argc, argv, &i, "--spv-format", &error)) != NULL) {
+                if (strcmp(value, "string") == 0) {
+                    options->output_options.spv_format = SPV_FORMAT_STRING;
+                } else if (strcmp(value, "words") == 0) {
+                    options->output_options.spv_format = SPV_FORMAT_WORDS;
+                } else if (strcmp(value, "object") == 0) {
+                    options->output_options.spv_format = SPV_FORMAT_OBJECT;
+                } else {
+                    ar_error("%s: Unknown SPIR-V format.", value);
+                    return false;
+                }
+            } else if ((value = long_option_arg(argc, argv, &i, "--compress", &error)) != NULL) {
+                if (strcmp(value, "smolv") == 0) {
+                    options->output_options.compression = COMPRESSION_SMOLV;
+                } else if (strcmp(value, "smolv-lz") == 0) {
+                    options->output_options.compression = COMPRESSION_SMOLV_LZ;
+                } else {
+                    ar_error("%s: Unknown compression.", value);
+                    return false;
+                }
+            } else if ((value = long_option_arg(argc, argv, &i, "--pack", &error)) != NULL) {
+                options->pack = ar_str_cstr(value);
+            } else if ((value = long_option_arg(argc, argv, &i, "--bench-pack", &error)) != NULL) {
+                options->bench_pack = ar_str_cstr(value);
+            } else if (strcmp(arg, "--embed-reflection") == 0) {
+                options->output_options.embed_reflection = true;
+            } else if (strcmp(arg, "--bench-parse") == 0) {
+                options->bench_parse = true;
+            } else if (strcmp(arg, "--bench-reflect") == 0) {
+                options->bench_reflect = true;
+            } else if (strcmp(arg, "--bench-decode") == 0) {
+                options->bench_decode = true;
+            } else if (strcmp(arg, "--watch") == 0) {
+                options->watch = true;
+            } else {
+                if (!error) {
+                    ar_error("%s: Unknown option.", arg);
+                }
+                return false;
             }
-            fputc('\"', fp);
+            continue;
+        }
+
+        const char *value = NULL;
+        switch (arg[1]) {
+            case 'o':
+                if ((value = option_arg(argc, argv, &i, 2)) == NULL) {
+                    return false;
+                }
+                options->output_dir = ar_str_cstr(value);
+                break;
+            case 'I':
+                if ((value = option_arg(argc, argv, &i, 2)) == NULL) {
+                    return false;
+                }
+                ar_str_list_push(arena, &options->include_paths, ar_str_cstr(value));
+                break;
+            case 'j':
+                if ((value = option_arg(argc, argv, &i, 2)) == NULL) {
+                    return false;
+                }
+                options->jobs = strtoul(value, NULL, 10);
+                break;
+            case 'M':
+                if (strcmp(arg, "-M") == 0) {
+                    options->deps_only = true;
+                } else if (strcmp(arg, "-MD") == 0) {
+                    options->depfile = true;
+                } else if (strncmp(arg, "-MF", 3) == 0) {
+                    if ((value = option_arg(argc, argv, &i, 3)) == NULL) {
+                        return false;
+                    }
+                    options->depfile_path = ar_str_cstr(value);
+                } else {
+                    ar_error("%s: Unknown option.", arg);
+                    return false;
+                }
+                break;
+            case 'O':
+                if (strcmp(arg, "-O") == 0) {
+                    options->optimize = OPTIMIZE_PERFORMANCE;
+                } else if (strcmp(arg, "-Os") == 0) {
+                    options->optimize = OPTIMIZE_SIZE;
+                } else if (strcmp(arg, "-O0") == 0) {
+                    options->optimize = OPTIMIZE_NONE;
+                } else {
+                    ar_error("%s: Unknown option.", arg);
+                    return false;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                ar_error("%s: Unknown option.", arg);
+                return false;
         }
     }
-    fprintf(fp, "\";\n");
 
-    fprintf(fp, "\n");
-    fprintf(fp, "#endif\n");
+    if (options->output_options.compression != COMPRESSION_NONE && options->output_options.spv_format == SPV_FORMAT_OBJECT) {
+        ar_error("--compress can't be used with object output.");
+        return false;
+    }
 
-    fclose(fp);
+    return true;
+}
+
+// Includes are served from memory after the first iteration, so this mostly
+// measures the parser itself.
+static B8 run_parse_benchmark(ArArena *arena, Options options) {
+    FileCache *files = file_cache_create();
+    B8 success = true;
+    for (ArStrListNode *curr = options.inputs.first; curr != NULL; curr = curr->next) {
+        ArStr input = curr->str;
+        ArStr source = read_file(arena, input);
+        if (source.data == NULL) {
+            success = false;
+            continue;
+        }
+
+        ArStrList paths = {0};
+        ar_str_list_push(arena, &paths, dirname(input));
+        ar_str_list_push(arena, &paths, ar_str_lit("."));
+        for (ArStrListNode *path = options.include_paths.first; path != NULL; path = path->next) {
+            ar_str_list_push(arena, &paths, path->str);
+        }
+
+        F64 bytes_per_second = benchmark_parse(source, paths, files);
+        ar_info("%.*s: %llu bytes, parses at %.1f MB/s.",
+                (I32) input.len, input.data,
+                (unsigned long long) source.len,
+                bytes_per_second / 1e6);
+    }
+    file_cache_destroy(&files);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        // Kilobytes on Linux, bytes on macOS.
+#if defined(__APPLE__)
+        long peak_kib = usage.ru_maxrss / 1024;
+#else
+        long peak_kib = usage.ru_maxrss;
+#endif
+        ar_info("Peak memory: %ld KiB.", peak_kib);
+    }
+    return success;
+}
+
+// '--bench-reflect' and '--bench-decode'. Only variant 0 of each program, the
+// others behave the same way.
+static B8 run_stage_benchmark(ArArena *arena, Options options) {
+    Compression compression = options.output_options.compression != COMPRESSION_NONE
+        ? options.output_options.compression
+        : COMPRESSION_SMOLV_LZ;
+
+    FileCache *files = file_cache_create();
+    B8 success = true;
+    for (ArStrListNode *curr = options.inputs.first; curr != NULL; curr = curr->next) {
+        ArStr input = curr->str;
+        ArStr source = read_file(arena, input);
+        if (source.data == NULL) {
+            success = false;
+            continue;
+        }
+
+        ArStrList paths = {0};
+        ar_str_list_push(arena, &paths, dirname(input));
+        ar_str_list_push(arena, &paths, ar_str_lit("."));
+        for (ArStrListNode *path = options.include_paths.first; path != NULL; path = path->next) {
+            ar_str_list_push(arena, &paths, path->str);
+        }
+
+        ParsedShader parsed = parse_shader(arena, source, paths, files);
+        CompiledShader *programs;
+        if (parsed.program_count == 0 || !compile_shader(arena, parsed, (CompileOptions) {0}, &programs)) {
+            ar_error("%.*s: Failed to compile.", (I32) input.len, input.data);
+            success = false;
+            continue;
+        }
+
+        for (U32 i = 0; i < parsed.program_count; i++) {
+            CompiledShader program = programs[i];
+            CompiledStage stages[2];
+            const char *stage_names[2];
+            U32 stage_count = 0;
+            if (program.type == PROGRAM_TYPE_COMPUTE) {
+                stages[stage_count] = program.compute;
+                stage_names[stage_count++] = "CS";
+            } else {
+                stages[stage_count] = program.vertex;
+                stage_names[stage_count++] = "VS";
+                stages[stage_count] = program.fragment;
+                stage_names[stage_count++] = "FS";
+            }
+
+            for (U32 j = 0; j < stage_count && options.bench_reflect; j++) {
+                F64 reused_seconds = 0;
+                F64 fresh_seconds = 0;
+                benchmark_reflect(stages[j].spv, &reused_seconds, &fresh_seconds);
+                ar_info("%.*s %s: reflects in %.1f us, %.1f us with a new context.",
+                        (I32) program.name.len, program.name.data, stage_names[j],
+                        reused_seconds * 1e6,
+                        fresh_seconds * 1e6);
+            }
+
+            for (U32 j = 0; j < stage_count && options.bench_decode; j++) {
+                ArTemp scratch = ar_scratch_get(&arena, 1);
+                PackedSpv packed;
+                F64 bytes_per_second = 0;
+                if (!pack_spv(scratch.arena, stages[j].spv, compression, &packed) ||
+                        !benchmark_packed_spv(packed, stages[j].spv, &bytes_per_second)) {
+                    ar_error("%.*s %s: Failed to compress.", (I32) program.name.len, program.name.data, stage_names[j]);
+                    success = false;
+                } else {
+                    ar_info("%.*s %s: %llu -> %llu bytes (%.1f%%), decodes at %.0f MB/s.",
+                            (I32) program.name.len, program.name.data, stage_names[j],
+                            (unsigned long long) stages[j].spv.len,
+                            (unsigned long long) packed.data.len,
+                            100.0 * packed.data.len / stages[j].spv.len,
+                            bytes_per_second / 1e6);
+                }
+                ar_scratch_release(&scratch);
+            }
+        }
+    }
+    file_cache_destroy(&files);
+    return success;
 }
 
 I32 main(I32 argc, char **argv) {
@@ -235,27 +1482,66 @@ I32 main(I32 argc, char **argv) {
     ArArena *arena = ar_arena_create_default();
 
     test_dirname();
+    test_match_token_type();
+    test_parser();
 
-    if (argc < 2) {
+    Options options = {0};
+    if (!parse_options(arena, argc, argv, &options)) {
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return 1;
+    }
+
+    if (options.bench_pack.len != 0) {
+        B8 success = benchmark_pack(ar_str_to_cstr(arena, options.bench_pack));
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return success ? 0 : 1;
+    }
+
+    if (options.inputs.first == NULL && options.server.len == 0) {
         ar_error("No input file provided.");
+        print_usage(argv[0]);
         ar_arena_destroy(&arena);
         arkin_terminate();
         return 1;
     }
-    ArStr filepath = ar_str_cstr(argv[1]);
-    ArStr file = read_file(arena, filepath);
 
-    ArStrList path_list = {0};
-    ArStr file_dir = dirname(ar_str_cstr(argv[1]));
-    ar_str_list_push(arena, &path_list, file_dir);
-    ar_str_list_push(arena, &path_list, ar_str_lit("."));
+    if (options.bench_parse) {
+        B8 success = run_parse_benchmark(arena, options);
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return success ? 0 : 1;
+    }
 
-    ParsedShader parsed = parse_shader(arena, file, path_list);
-    CompiledShader compiled = compile_shader(arena, parsed);
+    if (options.bench_reflect || options.bench_decode) {
+        compiler_init();
+        B8 success = run_stage_benchmark(arena, options);
+        compiler_terminate();
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return success ? 0 : 1;
+    }
 
-    write_header(compiled, parsed.ctypes, "header.h");
+    // Dependency scanning only needs the parser and clients leave compiling
+    // to the server.
+    B8 compiles = !options.deps_only && options.client.len == 0;
+    if (compiles) {
+        compiler_init();
+    }
+    B8 success = false;
+    if (options.server.len != 0) {
+        success = run_server(arena, options);
+    } else if (options.watch) {
+        success = watch_batch(arena, options);
+    } else {
+        success = compile_batch(arena, options);
+    }
+    if (compiles) {
+        compiler_terminate();
+    }
 
     ar_arena_destroy(&arena);
     arkin_terminate();
-    return 0;
+    return success ? 0 : 1;
 }
@@ -0,0 +1,295 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+#include "arkin_pack.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// How long each part of the pack benchmark runs for.
+#define PACK_BENCH_NS 20e6
+
+typedef struct PackWriter PackWriter;
+struct PackWriter {
+    Buffer entries;
+    Buffer resources;
+    Buffer types;
+    Buffer dimensions;
+    Buffer strings;
+    // SPIR-V offsets in the entries are relative to the start of this until
+    // the tables in front of it are laid out.
+    Buffer spv;
+};
+
+static void pad_to(Buffer *buffer, U64 align) {
+    static const U8 zeroes[ARKIN_PACK_SPV_ALIGN] = {0};
+    U64 padding = (align - buffer->len % align) % align;
+    buffer_push(buffer, zeroes, padding);
+}
+
+static ArkinPackString push_string(Buffer *strings, ArStr str) {
+    ArkinPackString result = {
+        .offset = strings->len,
+        .len = str.len,
+    };
+    buffer_push(strings, str.data, str.len);
+    buffer_push(strings, "", 1);
+    return result;
+}
+
+static U32 type_count(const PackWriter *writer) {
+    return writer->types.len / sizeof(ArkinPackType);
+}
+
+// Fills in the record at 'index'. The members of a type are reserved back to
+// back before any of them is filled in so that they stay contiguous.
+static void fill_type(PackWriter *writer, U32 index, ReflectedType type) {
+    ArkinPackType record = {
+        .name = push_string(&writer->strings, type.name),
+        .data_type = type.data_type,
+        .vec_size = type.vec_size,
+        .cols = type.cols,
+        .first_dimension = writer->dimensions.len / sizeof(U32),
+        .dimension_count = type.array_dimensions,
+        .first_member = type_count(writer),
+        .member_count = type.member_count,
+    };
+    buffer_push(&writer->dimensions, type.array_dimension_lengths, type.array_dimensions * sizeof(U32));
+
+    ArkinPackType empty = {0};
+    for (U32 i = 0; i < type.member_count; i++) {
+        buffer_push(&writer->types, &empty, sizeof(empty));
+    }
+    memcpy(&writer->types.data[index * sizeof(ArkinPackType)], &record, sizeof(record));
+
+    for (U32 i = 0; i < type.member_count; i++) {
+        fill_type(writer, record.first_member + i, type.members[i]);
+    }
+}
+
+static void push_resource(PackWriter *writer, ArkinPackResourceKind kind, U32 location, ReflectedType type) {
+    ArkinPackResource resource = {
+        .kind = kind,
+        .location = location,
+        .type = type_count(writer),
+    };
+    ArkinPackType empty = {0};
+    buffer_push(&writer->types, &empty, sizeof(empty));
+    fill_type(writer, resource.type, type);
+    buffer_push(&writer->resources, &resource, sizeof(resource));
+}
+
+static void push_stage(PackWriter *writer, ArStr name, ArkinPackStage stage_kind, CompiledStage stage) {
+    ReflectedStage reflection = stage.reflection;
+    ArkinPackEntry entry = {
+        .name = push_string(&writer->strings, name),
+        .stage = stage_kind,
+        .spv_size = stage.spv.len,
+        .first_resource = writer->resources.len / sizeof(ArkinPackResource),
+    };
+
+    for (U64 i = 0; i < reflection.count[REFLECTION_INDEX_UNIFORM_BUFFER]; i++) {
+        push_resource(writer, ARKIN_PACK_RESOURCE_UNIFORM_BUFFER, ARKIN_PACK_NONE, reflection.types[REFLECTION_INDEX_UNIFORM_BUFFER][i]);
+    }
+    for (U64 i = 0; i < reflection.count[REFLECTION_INDEX_PUSH_CONSTANT]; i++) {
+        push_resource(writer, ARKIN_PACK_RESOURCE_PUSH_CONSTANT, ARKIN_PACK_NONE, reflection.types[REFLECTION_INDEX_PUSH_CONSTANT][i]);
+    }
+    for (U64 i = 0; i < reflection.count[REFLECTION_INDEX_STORAGE_BUFFER]; i++) {
+        push_resource(writer, ARKIN_PACK_RESOURCE_STORAGE_BUFFER, ARKIN_PACK_NONE, reflection.types[REFLECTION_INDEX_STORAGE_BUFFER][i]);
+    }
+    for (U64 i = 0; i < reflection.input_count; i++) {
+        push_resource(writer, ARKIN_PACK_RESOURCE_INPUT, reflection.inputs[i].location, reflection.inputs[i].type);
+    }
+    for (U64 i = 0; i < reflection.output_count; i++) {
+        push_resource(writer, ARKIN_PACK_RESOURCE_OUTPUT, reflection.outputs[i].location, reflection.outputs[i].type);
+    }
+    entry.resource_count = writer->resources.len / sizeof(ArkinPackResource) - entry.first_resource;
+
+    pad_to(&writer->spv, ARKIN_PACK_SPV_ALIGN);
+    entry.spv_offset = writer->spv.len;
+    buffer_push(&writer->spv, stage.spv.data, stage.spv.len);
+
+    buffer_push(&writer->entries, &entry, sizeof(entry));
+}
+
+static I32 program_cmp(const void *a, const void *b) {
+    const CompiledShader *_a = a;
+    const CompiledShader *_b = b;
+    U64 len = ar_min(_a->name.len, _b->name.len);
+    I32 cmp = memcmp(_a->name.data, _b->name.data, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (_a->name.len > _b->name.len) - (_a->name.len < _b->name.len);
+}
+
+B8 write_pack(const char *filepath, const CompiledShader *programs, U64 program_count) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    // Entries are sorted by name, then stage, for the loader's binary search.
+    CompiledShader *sorted = ar_arena_push_arr_no_zero(scratch.arena, CompiledShader, program_count);
+    memcpy(sorted, programs, program_count * sizeof(CompiledShader));
+    qsort(sorted, program_count, sizeof(CompiledShader), program_cmp);
+    for (U64 i = 1; i < program_count; i++) {
+        if (program_cmp(&sorted[i - 1], &sorted[i]) == 0) {
+            ar_error("%s: Program %.*s is defined more than once.", filepath, (I32) sorted[i].name.len, sorted[i].name.data);
+            ar_scratch_release(&scratch);
+            return false;
+        }
+    }
+
+    PackWriter writer = {
+        .entries = { .arena = scratch.arena },
+        .resources = { .arena = scratch.arena },
+        .types = { .arena = scratch.arena },
+        .dimensions = { .arena = scratch.arena },
+        .strings = { .arena = scratch.arena },
+        .spv = { .arena = scratch.arena },
+    };
+    // Entries are looked up by name and stage, so only the base variant of
+    // each program goes in.
+    for (U64 i = 0; i < program_count; i++) {
+        if (sorted[i].type == PROGRAM_TYPE_COMPUTE) {
+            push_stage(&writer, sorted[i].name, ARKIN_PACK_STAGE_COMPUTE, sorted[i].compute);
+            continue;
+        }
+        push_stage(&writer, sorted[i].name, ARKIN_PACK_STAGE_VERTEX, sorted[i].vertex);
+        push_stage(&writer, sorted[i].name, ARKIN_PACK_STAGE_FRAGMENT, sorted[i].fragment);
+    }
+
+    // Every table holds U32s, so only the SPIR-V needs padding.
+    ArkinPackHeader header = {
+        .magic = ARKIN_PACK_MAGIC,
+        .version = ARKIN_PACK_VERSION,
+        .entry_count = writer.entries.len / sizeof(ArkinPackEntry),
+        .resource_count = writer.resources.len / sizeof(ArkinPackResource),
+        .type_count = type_count(&writer),
+        .dimension_count = writer.dimensions.len / sizeof(U32),
+        .strings_size = writer.strings.len,
+    };
+    U64 offset = sizeof(header);
+    header.entries_offset = offset;
+    offset += writer.entries.len;
+    header.resources_offset = offset;
+    offset += writer.resources.len;
+    header.types_offset = offset;
+    offset += writer.types.len;
+    header.dimensions_offset = offset;
+    offset += writer.dimensions.len;
+    header.strings_offset = offset;
+    offset += writer.strings.len;
+    U64 spv_offset = (offset + ARKIN_PACK_SPV_ALIGN - 1) / ARKIN_PACK_SPV_ALIGN * ARKIN_PACK_SPV_ALIGN;
+    U64 file_size = spv_offset + writer.spv.len;
+    if (file_size > UINT32_MAX) {
+        ar_error("%s: Pack exceeds 4 GiB.", filepath);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+    header.file_size = file_size;
+
+    ArkinPackEntry *entries = (ArkinPackEntry *) writer.entries.data;
+    for (U32 i = 0; i < header.entry_count; i++) {
+        entries[i].spv_offset += spv_offset;
+    }
+
+    Buffer out = { .arena = scratch.arena };
+    buffer_reserve(&out, file_size);
+    buffer_push(&out, &header, sizeof(header));
+    buffer_push(&out, writer.entries.data, writer.entries.len);
+    buffer_push(&out, writer.resources.data, writer.resources.len);
+    buffer_push(&out, writer.types.data, writer.types.len);
+    buffer_push(&out, writer.dimensions.data, writer.dimensions.len);
+    buffer_push(&out, writer.strings.data, writer.strings.len);
+    pad_to(&out, ARKIN_PACK_SPV_ALIGN);
+    buffer_push(&out, writer.spv.data, writer.spv.len);
+
+    B8 success = write_file(filepath, buffer_str(out));
+    if (success) {
+        ar_info("Packed %llu program(s) into %s, %llu bytes.", (unsigned long long) program_count, filepath, (unsigned long long) file_size);
+    }
+
+    ar_scratch_release(&scratch);
+    return success;
+}
+
+static F64 elapsed_ns(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+}
+
+B8 benchmark_pack(const char *filepath) {
+    ArkinPack pack;
+    if (!arkin_pack_open(&pack, filepath)) {
+        ar_error("%s: Not a valid shader pack.", filepath);
+        return false;
+    }
+    U32 entry_count = pack.header->entry_count;
+    U64 spv_size = 0;
+    for (U32 i = 0; i < entry_count; i++) {
+        spv_size += pack.entries[i].spv_size;
+    }
+    arkin_pack_close(&pack);
+
+    // Mapping and validating the whole pack.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    U64 opens = 0;
+    F64 elapsed = 0;
+    do {
+        if (!arkin_pack_open(&pack, filepath)) {
+            ar_error("%s: Failed to reopen the pack.", filepath);
+            return false;
+        }
+        arkin_pack_close(&pack);
+        opens++;
+        elapsed = elapsed_ns(start);
+    } while (elapsed < PACK_BENCH_NS);
+    F64 open_ns = elapsed / opens;
+
+    // Looking up every stage by name. The SPIR-V is used in place.
+    arkin_pack_open(&pack, filepath);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    U64 lookups = 0;
+    do {
+        for (U32 i = 0; i < entry_count; i++) {
+            const ArkinPackEntry *entry = &pack.entries[i];
+            if (arkin_pack_find(&pack, arkin_pack_string(&pack, entry->name), entry->stage) != entry) {
+                ar_error("%s: Lookup of entry %u failed.", filepath, i);
+                arkin_pack_close(&pack);
+                return false;
+            }
+        }
+        lookups += entry_count;
+        elapsed = elapsed_ns(start);
+    } while (elapsed < PACK_BENCH_NS && entry_count > 0);
+    F64 lookup_ns = lookups == 0 ? 0 : elapsed / lookups;
+
+    // SPIR-V embedded as a 'const char*' has no alignment guarantee, so
+    // every stage gets copied into aligned memory before it can be used.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    U64 loads = 0;
+    // Keeps the copies from being optimized out.
+    volatile U32 sink = 0;
+    do {
+        for (U32 i = 0; i < entry_count; i++) {
+            const ArkinPackEntry *entry = &pack.entries[i];
+            U32 *words = malloc(entry->spv_size);
+            memcpy(words, arkin_pack_spv(&pack, entry), entry->spv_size);
+            sink += words[entry->spv_size / sizeof(U32) / 2];
+            free(words);
+        }
+        loads++;
+        elapsed = elapsed_ns(start);
+    } while (elapsed < PACK_BENCH_NS);
+    F64 copy_ns = elapsed / loads;
+    arkin_pack_close(&pack);
+
+    ar_info("%s: %u stages, %llu bytes of SPIR-V.", filepath, entry_count, (unsigned long long) spv_size);
+    ar_info("Pack: %.1f us to map and validate, %.0f ns per lookup, %.1f us for every stage.",
+            open_ns / 1e3, lookup_ns, (open_ns + lookup_ns * entry_count) / 1e3);
+    ar_info("Headers: %.1f us copying every stage into aligned memory.", copy_ns / 1e3);
+    return true;
+}
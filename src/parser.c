@@ -2,10 +2,23 @@
 #include "arkin_log.h"
 #include "internal.h"
 
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
 typedef struct FileParser FileParser;
 struct FileParser {
     FileParser *next;
 
+    // Only known for files included through 'Parser.include'.
+    ArStr name;
     ArStr source;
     U32 i;
     U32 token_start;
@@ -13,93 +26,351 @@ struct FileParser {
     U32 last_token_end;
 };
 
-U8 file_parser_peek(FileParser parser) {
-    return parser.source.data[parser.i];
-}
-
-U8 file_parser_peek_next(FileParser parser) {
-    return parser.source.data[parser.i + 1];
-}
-
 typedef enum {
     MODULE_NONE,
     MODULE_MODULE,
     MODULE_VERT,
     MODULE_FRAG,
+    MODULE_COMP,
 } ModuleType;
 
+// Text between directives. Slices point into the file buffers, which stay
+// alive until the parse is done, so module code is only copied once it's
+// handed out.
+typedef struct Slice Slice;
+struct Slice {
+    Slice *next;
+    ArStr str;
+};
+
+typedef struct SliceList SliceList;
+struct SliceList {
+    Slice *first;
+    Slice *last;
+    // Total length of all slices.
+    U64 len;
+};
+
+static void slice_list_push(ArArena *arena, SliceList *list, ArStr str) {
+    if (str.len == 0) {
+        return;
+    }
+    Slice *slice = ar_arena_push_arr_no_zero(arena, Slice, 1);
+    slice->next = NULL;
+    slice->str = str;
+    if (list->last == NULL) {
+        list->first = slice;
+    } else {
+        list->last->next = slice;
+    }
+    list->last = slice;
+    list->len += str.len;
+}
+
+// Appends the slices of 'other', the text itself is shared.
+static void slice_list_append(ArArena *arena, SliceList *list, SliceList other) {
+    for (Slice *curr = other.first; curr != NULL; curr = curr->next) {
+        slice_list_push(arena, list, curr->str);
+    }
+}
+
+static ArStr trim_start(ArStr str) {
+    while (str.len > 0 && ar_char_is_whitespace(str.data[0])) {
+        str.data++;
+        str.len--;
+    }
+    return str;
+}
+
+static ArStr trim_end(ArStr str) {
+    while (str.len > 0 && ar_char_is_whitespace(str.data[str.len - 1])) {
+        str.len--;
+    }
+    return str;
+}
+
+// Same as trimming the joined text.
+static SliceList slice_list_trim(SliceList list) {
+    while (list.first != NULL) {
+        ArStr trimmed = trim_start(list.first->str);
+        list.len -= list.first->str.len - trimmed.len;
+        list.first->str = trimmed;
+        if (trimmed.len != 0) {
+            break;
+        }
+        list.first = list.first->next;
+    }
+    if (list.first == NULL) {
+        return (SliceList) {0};
+    }
+
+    // Whatever follows the last slice with anything but whitespace in it
+    // gets dropped.
+    Slice *last = list.first;
+    for (Slice *curr = list.first; curr != NULL; curr = curr->next) {
+        if (trim_end(curr->str).len != 0) {
+            last = curr;
+        }
+    }
+    U64 len = 0;
+    for (Slice *curr = list.first; curr != last; curr = curr->next) {
+        len += curr->str.len;
+    }
+    last->str = trim_end(last->str);
+    last->next = NULL;
+    list.last = last;
+    list.len = len + last->str.len;
+    return list;
+}
+
+// Copies the slices into a single buffer of exactly the joined length plus a
+// null terminator, which glslang needs.
+static ArStr slice_list_join(ArArena *arena, SliceList list) {
+    U8 *data = ar_arena_push_arr_no_zero(arena, U8, list.len + 1);
+    U64 offset = 0;
+    for (Slice *curr = list.first; curr != NULL; curr = curr->next) {
+        memcpy(&data[offset], curr->str.data, curr->str.len);
+        offset += curr->str.len;
+    }
+    data[offset] = '\0';
+    return ar_str(data, list.len);
+}
+
 typedef struct Module Module;
 struct Module {
-    ArStr code;
+    SliceList code;
     ModuleType type;
 };
 
+// Returns the index of the next byte at or after 'start' the parser has to
+// look at, a '#' or a '/' that may start a comment. 'len' if there is none.
+typedef U64 ScanFunc(const U8 *data, U64 start, U64 len);
+
+// Finds the next '#' with memchr and only reports a '/' if it starts a
+// comment on the same line, since everything else is skipped anyway.
+static U64 scan_memchr(const U8 *data, U64 start, U64 len) {
+    const U8 *hash = memchr(&data[start], '#', len - start);
+    U64 end = hash != NULL ? (U64) (hash - data) : len;
+
+    U64 line_start = end;
+    while (line_start > start && data[line_start - 1] != '\n') {
+        line_start--;
+    }
+    for (U64 i = line_start; i + 1 < end; i++) {
+        if (data[i] == '/' && data[i + 1] == '/') {
+            return i;
+        }
+    }
+    return end;
+}
+
+#if defined(__SSE2__)
+static U64 scan_sse2(const U8 *data, U64 start, U64 len) {
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i slash = _mm_set1_epi8('/');
+    U64 i = start;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) &data[i]);
+        U32 mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, hash), _mm_cmpeq_epi8(chunk, slash)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len; i++) {
+        if (data[i] == '#' || data[i] == '/') {
+            return i;
+        }
+    }
+    return len;
+}
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAS_AVX2_SCAN
+__attribute__((target("avx2")))
+static U64 scan_avx2(const U8 *data, U64 start, U64 len) {
+    const __m256i hash = _mm256_set1_epi8('#');
+    const __m256i slash = _mm256_set1_epi8('/');
+    U64 i = start;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) &data[i]);
+        U32 mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, hash), _mm256_cmpeq_epi8(chunk, slash)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return scan_sse2(data, i, len);
+}
+#endif
+
+static ScanFunc *select_scan(void) {
+#if defined(HAS_AVX2_SCAN)
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    }
+#endif
+#if defined(__SSE2__)
+    return scan_sse2;
+#else
+    return scan_memchr;
+#endif
+}
+
+// Collects the steps of a file included at the top level the first time it
+// is parsed, for the file cache.
+typedef struct UnitRecorder UnitRecorder;
+struct UnitRecorder {
+    // IncludeStep.
+    Buffer steps;
+    B8 cacheable;
+};
+
+typedef struct Mapping Mapping;
+struct Mapping {
+    Mapping *next;
+    MappedFile file;
+};
+
+typedef struct ProgramDef ProgramDef;
+struct ProgramDef {
+    ArStr name;
+    ProgramType type;
+    // Only 'comp' is set for compute programs, only 'vert' and 'frag'
+    // otherwise.
+    ArStr vert_key;
+    ArStr frag_key;
+    ArStr comp_key;
+    Module vert;
+    Module frag;
+    Module comp;
+    U32 variant_count;
+};
+
+typedef struct AxisDef AxisDef;
+struct AxisDef {
+    U32 program;
+    ArStr name;
+    // Comma separated, empty for a boolean axis.
+    ArStr values;
+    U32 value_count;
+};
+
+// Every variant is compiled, so the combinations are capped.
+#define MAX_PROGRAM_VARIANTS 256
+
 typedef struct Parser Parser;
 struct Parser {
     ArArena *arena;
     FileParser *file_parser_stack;
     ModuleType current_module;
-    ArStrList module_parts;
+    SliceList module_parts;
     ArHashMap *module_map;
     ArHashMap *ctype_map;
     ArStr module_name;
-    struct {
-        ArStr name;
-        Module vert;
-        Module frag;
-    } program;
+    // Every file pulled in through '#include', in include order.
+    ArStrList dependencies;
+    // Canonical paths, or names given by 'include', of the files included at
+    // the top level. Including one of them again does nothing.
+    ArHashMap *included;
+    // Only set while the file on top of the stack is recorded.
+    UnitRecorder *recorder;
+    U32 error_count;
+    // Optional, includes are read from disk when NULL.
+    FileCache *files;
+    // Includes read from disk, unmapped once the parse is done.
+    Mapping *mappings;
+    // Optional, replaces the search paths.
+    ShaderIncludeFunc *include;
+    void *include_userdata;
+    ScanFunc *scan;
+    // ProgramDef, in definition order.
+    Buffer programs;
+    // AxisDef, in definition order.
+    Buffer axes;
 };
 
-const ArStr GLSL_KEYWORDS[] = {
-    ar_str_lit("define"),
-    ar_str_lit("undef"),
-    ar_str_lit("if"),
-    ar_str_lit("ifdef"),
-    ar_str_lit("ifndef"),
-    ar_str_lit("else"),
-    ar_str_lit("elif"),
-    ar_str_lit("endif"),
-    ar_str_lit("error"),
-    ar_str_lit("pragma"),
-    ar_str_lit("extension"),
-    ar_str_lit("version"),
-    ar_str_lit("line"),
-};
+// Counts errors so that units whose parse reported any aren't cached.
+#define parser_error(parser, ...) do { \
+        (parser)->error_count++; \
+        report_error(__VA_ARGS__); \
+    } while (0)
 
 typedef enum {
     TOKEN_END,
     TOKEN_MODULE,
     TOKEN_VERT,
     TOKEN_FRAG,
+    TOKEN_COMP,
     TOKEN_PROGRAM,
+    TOKEN_COMPUTE,
     TOKEN_INCLUDE,
     TOKEN_INCLUDE_MODULE,
     TOKEN_CTYPEDEF,
+    TOKEN_VARIANT,
 
     TOKEN_ERROR,
     TOKEN_GLSL,
 } TokenType;
 
-const ArStr KEYWORDS[] = {
-    ar_str_lit("end"),
-    ar_str_lit("module"),
-    ar_str_lit("vert"),
-    ar_str_lit("frag"),
-    ar_str_lit("program"),
-    ar_str_lit("include"),
-    ar_str_lit("include_module"),
-    ar_str_lit("ctypedef"),
-};
-
 const U32 KEYWORD_ARG_COUNT[] = {
     0,
     1,
     1,
     1,
+    1,
     3,
+    2,
     1,
     1,
     2,
+    2,
+};
+
+// Arguments that can follow the required ones.
+const U32 KEYWORD_OPTIONAL_ARG_COUNT[] = {
+    [TOKEN_VARIANT] = 1,
+};
+
+typedef struct Keyword Keyword;
+struct Keyword {
+    ArStr name;
+    TokenType type;
+};
+
+// Perfect hash over the length, first and last character of every directive.
+// The constants were searched offline. A collision shows up as an overridden
+// initializer warning when adding a keyword.
+#define KEYWORD_TABLE_SIZE 64
+#define KEYWORD_HASH(len, first, last) (((len) * 9 + (first) + (last) * 2) & (KEYWORD_TABLE_SIZE - 1))
+#define KEYWORD(name, first, last, type) [KEYWORD_HASH(sizeof(name) - 1, first, last)] = { ar_str_lit(name), type }
+
+static const Keyword KEYWORDS[KEYWORD_TABLE_SIZE] = {
+    KEYWORD("end", 'e', 'd', TOKEN_END),
+    KEYWORD("module", 'm', 'e', TOKEN_MODULE),
+    KEYWORD("vert", 'v', 't', TOKEN_VERT),
+    KEYWORD("frag", 'f', 'g', TOKEN_FRAG),
+    KEYWORD("comp", 'c', 'p', TOKEN_COMP),
+    KEYWORD("program", 'p', 'm', TOKEN_PROGRAM),
+    KEYWORD("compute", 'c', 'e', TOKEN_COMPUTE),
+    KEYWORD("include", 'i', 'e', TOKEN_INCLUDE),
+    KEYWORD("include_module", 'i', 'e', TOKEN_INCLUDE_MODULE),
+    KEYWORD("ctypedef", 'c', 'f', TOKEN_CTYPEDEF),
+    KEYWORD("variant", 'v', 't', TOKEN_VARIANT),
+
+    // Passed through to glslang.
+    KEYWORD("define", 'd', 'e', TOKEN_GLSL),
+    KEYWORD("undef", 'u', 'f', TOKEN_GLSL),
+    KEYWORD("if", 'i', 'f', TOKEN_GLSL),
+    KEYWORD("ifdef", 'i', 'f', TOKEN_GLSL),
+    KEYWORD("ifndef", 'i', 'f', TOKEN_GLSL),
+    KEYWORD("else", 'e', 'e', TOKEN_GLSL),
+    KEYWORD("elif", 'e', 'f', TOKEN_GLSL),
+    KEYWORD("endif", 'e', 'f', TOKEN_GLSL),
+    KEYWORD("error", 'e', 'r', TOKEN_GLSL),
+    KEYWORD("pragma", 'p', 'a', TOKEN_GLSL),
+    KEYWORD("extension", 'e', 'n', TOKEN_GLSL),
+    KEYWORD("version", 'v', 'n', TOKEN_GLSL),
+    KEYWORD("line", 'l', 'e', TOKEN_GLSL),
 };
 
 typedef struct Token Token;
@@ -109,57 +380,59 @@ struct Token {
     ArStr args[4];
 };
 
+// Moves past the statement, leaving 'i' on its newline or the end of the
+// source.
 ArStr extract_statement(FileParser *parser) {
     U32 start = parser->i;
-    while (file_parser_peek(*parser) != '\n') {
-        parser->i++;
-    }
-    U32 end = parser->i - 1;
-    return ar_str_sub(parser->source, start, end);
+    const U8 *newline = memchr(&parser->source.data[start], '\n', parser->source.len - start);
+    parser->i = newline != NULL ? (U32) (newline - parser->source.data) : parser->source.len;
+    return ar_str(&parser->source.data[start], parser->i - start);
 }
 
-ArStrList split_statement(ArArena *arena, ArStr statement) {
-    ArStrList list = {0};
-
+// Stores up to 'max_words' words and returns how many there are in total.
+U32 split_statement(ArStr statement, ArStr *words, U32 max_words) {
+    U32 count = 0;
     U32 i = 0;
-    while (i < statement.len) {
-        while (ar_char_is_whitespace(statement.data[i])) {
+    while (true) {
+        while (i < statement.len && ar_char_is_whitespace(statement.data[i])) {
             i++;
         }
+        if (i == statement.len) {
+            break;
+        }
 
         U32 start = i;
-        while (!ar_char_is_whitespace(statement.data[i])) {
+        while (i < statement.len && !ar_char_is_whitespace(statement.data[i])) {
             i++;
         }
-        U32 end = i - 1;
-        ArStr word = ar_str_sub(statement, start, end);
-        ar_str_list_push(arena, &list, word);
+        if (count < max_words) {
+            words[count] = ar_str(&statement.data[start], i - start);
+        }
+        count++;
     }
-
-    return list;
+    return count;
 }
 
 TokenType match_token_type(ArStr keyword) {
-    for (U32 i = 0; i < ar_arrlen(KEYWORDS); i++) {
-        if (ar_str_match(keyword, KEYWORDS[i], AR_STR_MATCH_FLAG_EXACT)) {
-            return i;
-        }
-    }
-
-    for (U32 i = 0; i < ar_arrlen(GLSL_KEYWORDS); i++) {
-        if (ar_str_match(keyword, GLSL_KEYWORDS[i], AR_STR_MATCH_FLAG_EXACT)) {
-            return TOKEN_GLSL;
-        }
+    Keyword entry = KEYWORDS[KEYWORD_HASH(keyword.len, keyword.data[0], keyword.data[keyword.len - 1])];
+    if (entry.name.len == keyword.len && memcmp(entry.name.data, keyword.data, keyword.len) == 0) {
+        return entry.type;
     }
-
     return TOKEN_ERROR;
 }
 
-Token tokenize_statement_list(ArArena *err_arena, ArStrList statement_list) {
+Token tokenize_statement(ArArena *err_arena, ArStr statement) {
     Token token = {0};
 
-    ArStrListNode *curr = statement_list.first;
-    ArStr keyword = curr->str;
+    ArStr words[1 + ar_arrlen(token.args)];
+    U32 word_count = split_statement(statement, words, ar_arrlen(words));
+    // A lone '#' is GLSL's null directive.
+    if (word_count == 0) {
+        token.type = TOKEN_GLSL;
+        return token;
+    }
+
+    ArStr keyword = words[0];
     token.type = match_token_type(keyword);
 
     if (token.type == TOKEN_GLSL) {
@@ -169,21 +442,21 @@ Token tokenize_statement_list(ArArena *err_arena, ArStrList statement_list) {
         return token;
     }
 
-    U32 arg_count = 0;
-    for (ArStrListNode *c = curr->next; c != NULL; c = c->next) {
-        arg_count++;
-    }
-
-    if (arg_count != KEYWORD_ARG_COUNT[token.type]) {
-        token.error = ar_str_pushf(err_arena, "%.*s: Expected %u argument(s), got %u.", (I32) keyword.len, keyword.data, KEYWORD_ARG_COUNT[token.type], arg_count);
+    U32 arg_count = word_count - 1;
+    U32 min_args = KEYWORD_ARG_COUNT[token.type];
+    U32 max_args = min_args + KEYWORD_OPTIONAL_ARG_COUNT[token.type];
+    if (arg_count < min_args || arg_count > max_args) {
+        if (min_args == max_args) {
+            token.error = ar_str_pushf(err_arena, "%.*s: Expected %u argument(s), got %u.", (I32) keyword.len, keyword.data, min_args, arg_count);
+        } else {
+            token.error = ar_str_pushf(err_arena, "%.*s: Expected %u to %u arguments, got %u.", (I32) keyword.len, keyword.data, min_args, max_args, arg_count);
+        }
         token.type = TOKEN_ERROR;
         return token;
     }
 
-    arg_count = 0;
-    for (curr = curr->next; curr != NULL; curr = curr->next) {
-        token.args[arg_count] = curr->str;
-        arg_count++;
+    for (U32 i = 0; i < arg_count; i++) {
+        token.args[i] = words[1 + i];
     }
 
     return token;
@@ -191,43 +464,386 @@ Token tokenize_statement_list(ArArena *err_arena, ArStrList statement_list) {
 
 void add_module_part(Parser *parser) {
     FileParser *file_parser = parser->file_parser_stack;
-    if (file_parser->token_start - file_parser->last_token_end == 2) {
+    // Nothing precedes a directive at the very start of the file.
+    if (file_parser->token_start == 0 || file_parser->token_start - file_parser->last_token_end == 2) {
         return;
     }
     ArStr module_part = ar_str_sub(file_parser->source, file_parser->last_token_end, file_parser->token_start - 1);
-    module_part = ar_str_push_copy(parser->arena, module_part);
-    ar_str_list_push(parser->arena, &parser->module_parts, module_part);
+    slice_list_push(parser->arena, &parser->module_parts, module_part);
 }
 
-void parse(Parser *parser, ArStr source, ArStrList paths);
+void parse(Parser *parser, ArStr name, ArStr source, ArStrList paths);
+
+static void add_dependency(Parser *parser, ArStr path) {
+    for (ArStrListNode *curr = parser->dependencies.first; curr != NULL; curr = curr->next) {
+        if (ar_str_match(curr->str, path, AR_STR_MATCH_FLAG_EXACT)) {
+            return;
+        }
+    }
+    ar_str_list_push(parser->arena, &parser->dependencies, ar_str_push_copy(parser->arena, path));
+}
+
+static void record_step(Parser *parser, IncludeStep step) {
+    if (parser->recorder != NULL) {
+        buffer_push(&parser->recorder->steps, &step, sizeof(step));
+    }
+}
+
+static B8 recorded_module(UnitRecorder *recorder, ArStr name) {
+    IncludeStep *steps = (IncludeStep *) recorder->steps.data;
+    U64 step_count = recorder->steps.len / sizeof(IncludeStep);
+    for (U64 i = 0; i < step_count; i++) {
+        if (steps[i].kind == INCLUDE_STEP_MODULE && ar_str_match(steps[i].name, name, AR_STR_MATCH_FLAG_EXACT)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void define_module(Parser *parser, ArStr name, Module module) {
+    B8 unique = ar_hash_map_insert(parser->module_map, name, module);
+    if (!unique) {
+        parser_error(parser, "%.*s: Module has already been defined.", (I32) name.len, name.data);
+        return;
+    }
+    if (parser->recorder != NULL) {
+        record_step(parser, (IncludeStep) {
+                .kind = INCLUDE_STEP_MODULE,
+                .name = name,
+                .value = slice_list_join(parser->arena, module.code),
+                .module_type = module.type,
+            });
+    }
+}
+
+static void define_ctype(Parser *parser, ArStr glsl_type, ArStr ctype) {
+    ArArena *hm_arena = ar_hash_map_get_arena(parser->ctype_map);
+    ArStr key = ar_str_push_copy(hm_arena, glsl_type);
+    ArStr value = ar_str_push_copy(hm_arena, ctype);
+    ar_hash_map_insert(parser->ctype_map, key, value);
+    record_step(parser, (IncludeStep) {
+            .kind = INCLUDE_STEP_CTYPEDEF,
+            .name = glsl_type,
+            .value = ctype,
+        });
+}
+
+// Returns false if 'key' has been included already.
+static B8 mark_included(Parser *parser, ArStr key) {
+    if (ar_hash_map_get(parser->included, key, B8)) {
+        return false;
+    }
+    ArStr included = ar_str_push_copy(parser->arena, key);
+    B8 value = true;
+    ar_hash_map_insert(parser->included, included, value);
+    return true;
+}
+
+// The content goes into the parser's arena since module slices point into it.
+static void include_from_callback(Parser *parser, ArStr path, B8 top_level) {
+    ArStr includer = parser->file_parser_stack->name;
+    ArStr name = {0};
+    ArStr content = {0};
+    if (!parser->include(parser->include_userdata, parser->arena, path, includer, &name, &content)) {
+        parser_error(parser, "%.*s: Couldn't find file %.*s.", (I32) includer.len, includer.data, (I32) path.len, path.data);
+        return;
+    }
+
+    add_dependency(parser, name);
+    if (top_level && !mark_included(parser, name)) {
+        return;
+    }
+    parse(parser, name, content, (ArStrList) {0});
+}
+
+static void include_file(Parser *parser, ArStr arg, ArStrList paths);
+
+static void replay_unit(Parser *parser, IncludeUnit unit, ArStrList paths) {
+    for (U64 i = 0; i < unit.step_count; i++) {
+        IncludeStep step = unit.steps[i];
+        switch (step.kind) {
+            case INCLUDE_STEP_MODULE: {
+                Module module = { .type = step.module_type };
+                slice_list_push(parser->arena, &module.code, step.value);
+                define_module(parser, step.name, module);
+            } break;
+            case INCLUDE_STEP_CTYPEDEF:
+                define_ctype(parser, step.name, step.value);
+                break;
+            case INCLUDE_STEP_INCLUDE:
+                include_file(parser, step.name, paths);
+                break;
+        }
+    }
+}
+
+// Replays the cached unit of the file if there is one, otherwise parses it
+// and caches what it defined. Files that leave anything behind for the
+// includer, a module or text that goes into the next one, aren't cached.
+static void include_unit(Parser *parser, ArStr path, ArStr canonical, ArStr content, ArStrList paths) {
+    IncludeUnit unit;
+    if (file_cache_get_unit(parser->files, canonical, content, &unit)) {
+        replay_unit(parser, unit, paths);
+        return;
+    }
+
+    UnitRecorder recorder = {
+        .steps = { .arena = parser->arena },
+        .cacheable = true,
+    };
+    U32 error_count = parser->error_count;
+    parser->recorder = &recorder;
+    parse(parser, path, content, paths);
+    parser->recorder = NULL;
+
+    if (recorder.cacheable &&
+            parser->error_count == error_count &&
+            parser->current_module == MODULE_NONE &&
+            parser->module_parts.first == NULL) {
+        file_cache_put_unit(parser->files, canonical, content, (IncludeUnit) {
+                .steps = (IncludeStep *) recorder.steps.data,
+                .step_count = recorder.steps.len / sizeof(IncludeStep),
+            });
+    }
+}
+
+static void include_from_paths(Parser *parser, ArStr arg, ArStrList paths, B8 top_level) {
+    if (paths.first == NULL) {
+        parser_error(parser, "Cannot include files without providing search paths.");
+        return;
+    }
+
+    ArTemp scratch = ar_scratch_get(&parser->arena, 1);
+    ArStr path = {0};
+    ArStr canonical = {0};
+    MappedFile file = {0};
+    B8 found = false;
+    for (ArStrListNode *curr = paths.first; curr != NULL; curr = curr->next) {
+        ArStr include_path = ar_str_pushf(scratch.arena, "%.*s/%.*s", (I32) curr->str.len, curr->str.data, (I32) arg.len, arg.data);
+        // The cache remembers misses. Without it every search path costs a
+        // failed open, but the file that's found is only opened once.
+        if (parser->files != NULL) {
+            found = file_cache_resolve(parser->files, include_path, &canonical);
+        } else {
+            found = map_file(include_path, &file);
+        }
+
+        if (found) {
+            path = include_path;
+            break;
+        }
+    }
+
+    if (!found) {
+        parser_error(parser, "Couldn't find file %.*s, in the provided paths.", (I32) arg.len, arg.data);
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    add_dependency(parser, path);
+    if (top_level) {
+        if (parser->files == NULL) {
+            canonical = canonicalize(scratch.arena, path);
+        }
+        if (!mark_included(parser, canonical)) {
+            unmap_file(&file);
+            ar_scratch_release(&scratch);
+            return;
+        }
+    }
+
+    // Every spelling of a path shares one cache entry, and one unit.
+    ArStr imported_file = {0};
+    if (parser->files != NULL) {
+        if (!file_cache_read(parser->files, canonical, &imported_file)) {
+            parser_error(parser, "Failed to read file %.*s.", (I32) path.len, path.data);
+            ar_scratch_release(&scratch);
+            return;
+        }
+    } else {
+        // Module slices point into the file.
+        Mapping *mapping = ar_arena_push_arr(parser->arena, Mapping, 1);
+        mapping->file = file;
+        ar_sll_stack_push(parser->mappings, mapping);
+        imported_file = file.content;
+    }
+
+    // The included file's directory takes the place of the includer's. The
+    // list is copied since the includer still searches its own.
+    ArStrList include_paths = {0};
+    ar_str_list_push(scratch.arena, &include_paths, dirname(path));
+    for (ArStrListNode *curr = paths.first->next; curr != NULL; curr = curr->next) {
+        ar_str_list_push(scratch.arena, &include_paths, curr->str);
+    }
+    if (top_level && parser->files != NULL && parser->module_parts.first == NULL) {
+        include_unit(parser, path, canonical, imported_file, include_paths);
+    } else {
+        parse(parser, path, imported_file, include_paths);
+    }
+
+    ar_scratch_release(&scratch);
+}
+
+// Files included at the top level are only included once, and cached as
+// units when there is a file cache. Files included inside of a module are
+// pasted into it every time.
+static void include_file(Parser *parser, ArStr arg, ArStrList paths) {
+    B8 top_level = parser->current_module == MODULE_NONE;
+    UnitRecorder *recorder = parser->recorder;
+    if (recorder != NULL) {
+        // A replay only gets the steps, not text left for the next module.
+        if (top_level && parser->module_parts.first == NULL) {
+            record_step(parser, (IncludeStep) {
+                    .kind = INCLUDE_STEP_INCLUDE,
+                    .name = arg,
+                });
+        } else {
+            recorder->cacheable = false;
+        }
+    }
+
+    // The included file is replayed through the step above, not recorded.
+    parser->recorder = NULL;
+    if (parser->include != NULL) {
+        include_from_callback(parser, arg, top_level);
+    } else {
+        include_from_paths(parser, arg, paths, top_level);
+    }
+    parser->recorder = recorder;
+
+    if (recorder != NULL && parser->module_parts.first != NULL) {
+        recorder->cacheable = false;
+    }
+}
+
+static ProgramDef *find_program(Parser *parser, ArStr name) {
+    ProgramDef *programs = (ProgramDef *) parser->programs.data;
+    for (U64 i = 0; i < parser->programs.len / sizeof(ProgramDef); i++) {
+        if (str_eq(&programs[i].name, &name, sizeof(ArStr))) {
+            return &programs[i];
+        }
+    }
+    return NULL;
+}
+
+// Adds 'program' unless 'failed' is set or the name is taken. Errors about
+// the modules are reported first.
+static void define_program(Parser *parser, B8 failed, ProgramDef program) {
+    // The program isn't part of any unit.
+    if (parser->recorder != NULL) {
+        parser->recorder->cacheable = false;
+    }
+
+    if (find_program(parser, program.name) != NULL) {
+        parser_error(parser, "%.*s: Program has already been defined.", (I32) program.name.len, program.name.data);
+        return;
+    }
+    if (failed) {
+        return;
+    }
+
+    program.variant_count = 1;
+    buffer_push(&parser->programs, &program, sizeof(program));
+}
+
+// Splits the comma separated values onto 'arena'. Returns 0 if any of them is
+// empty or repeated.
+static U32 split_variant_values(ArArena *arena, ArStr values, ArStr **out) {
+    U32 max_count = 1;
+    for (U64 i = 0; i < values.len; i++) {
+        max_count += values.data[i] == ',';
+    }
+    ArStr *split = ar_arena_push_arr_no_zero(arena, ArStr, max_count);
+
+    U32 count = 0;
+    U64 start = 0;
+    for (U64 i = 0; i <= values.len; i++) {
+        if (i != values.len && values.data[i] != ',') {
+            continue;
+        }
+        ArStr value = ar_str(&values.data[start], i - start);
+        if (value.len == 0) {
+            return 0;
+        }
+        for (U32 j = 0; j < count; j++) {
+            if (str_eq(&split[j], &value, sizeof(ArStr))) {
+                return 0;
+            }
+        }
+        split[count++] = value;
+        start = i + 1;
+    }
+
+    *out = split;
+    return count;
+}
+
+static void define_variant(Parser *parser, ArStr program_name, ArStr name, ArStr values) {
+    ProgramDef *program = find_program(parser, program_name);
+    if (program == NULL) {
+        parser_error(parser, "%.*s: Program not found.", (I32) program_name.len, program_name.data);
+        return;
+    }
+    U32 program_index = program - (ProgramDef *) parser->programs.data;
+
+    const AxisDef *axes = (const AxisDef *) parser->axes.data;
+    for (U64 i = 0; i < parser->axes.len / sizeof(AxisDef); i++) {
+        if (axes[i].program == program_index && str_eq(&axes[i].name, &name, sizeof(ArStr))) {
+            parser_error(parser, "%.*s: Variant has already been defined.", (I32) name.len, name.data);
+            return;
+        }
+    }
+
+    U32 value_count = 0;
+    if (values.len != 0) {
+        ArStr *split;
+        value_count = split_variant_values(parser->arena, values, &split);
+        if (value_count == 0) {
+            parser_error(parser, "%.*s: Variant values must be unique and not empty.", (I32) name.len, name.data);
+            return;
+        }
+    }
+
+    U32 states = value_count != 0 ? value_count : 2;
+    if ((U64) program->variant_count * states > MAX_PROGRAM_VARIANTS) {
+        parser_error(parser, "%.*s: Program has more than %u variants.", (I32) program_name.len, program_name.data, MAX_PROGRAM_VARIANTS);
+        return;
+    }
+    program->variant_count *= states;
+
+    AxisDef axis = {
+        .program = program_index,
+        .name = name,
+        .values = values,
+        .value_count = value_count,
+    };
+    buffer_push(&parser->axes, &axis, sizeof(axis));
+}
 
 void expand_token(Parser *parser, Token token, ArStrList paths) {
     switch (token.type) {
         case TOKEN_END:
             if (parser->current_module == MODULE_NONE) {
-                ar_error("Extranious end statment.");
+                parser_error(parser, "Extranious end statment.");
                 break;
             }
 
             add_module_part(parser);
 
             Module module = {
-                .code = ar_str_trim(ar_str_list_join(parser->arena, parser->module_parts)),
+                .code = slice_list_trim(parser->module_parts),
                 .type = parser->current_module,
             };
-            B8 unique = ar_hash_map_insert(parser->module_map, parser->module_name, module);
-            if (!unique) {
-                ar_error("%.*s: Module has already been defined.", (I32) parser->module_name.len, parser->module_name.data);
-            }
+            define_module(parser, parser->module_name, module);
 
             parser->current_module = MODULE_NONE;
             parser->module_name = (ArStr) {0};
-            parser->module_parts = AR_STR_LIST_INIT;
+            parser->module_parts = (SliceList) {0};
 
             break;
         case TOKEN_MODULE:
             if (parser->current_module != MODULE_NONE) {
-                ar_error("%.*s: New module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
+                parser_error(parser, "%.*s: New module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
 
@@ -236,7 +852,7 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
             break;
         case TOKEN_VERT:
             if (parser->current_module != MODULE_NONE) {
-                ar_error("%.*s: New vertex module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
+                parser_error(parser, "%.*s: New vertex module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
 
@@ -245,94 +861,92 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
             break;
         case TOKEN_FRAG:
             if (parser->current_module != MODULE_NONE) {
-                ar_error("%.*s: New fragment module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
+                parser_error(parser, "%.*s: New fragment module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
 
             parser->module_name = token.args[0];
             parser->current_module = MODULE_FRAG;
             break;
-        case TOKEN_PROGRAM: {
-            ArStr name = token.args[0];
-            ArStr vert_module_key = token.args[1];
-            ArStr frag_module_key = token.args[2];
-
-            if (parser->program.name.data != NULL) {
-                ar_error("%.*s: Program has already been defined.", (I32) name.len, name.data);
+        case TOKEN_COMP:
+            if (parser->current_module != MODULE_NONE) {
+                parser_error(parser, "%.*s: New compute module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
 
+            parser->module_name = token.args[0];
+            parser->current_module = MODULE_COMP;
+            break;
+        case TOKEN_PROGRAM: {
+            ArStr vert_module_key = token.args[1];
+            ArStr frag_module_key = token.args[2];
             Module vert_module = ar_hash_map_get(parser->module_map, vert_module_key, Module);
             Module frag_module = ar_hash_map_get(parser->module_map, frag_module_key, Module);
 
             B8 failed = false;
             if (vert_module.type != MODULE_VERT) {
-                ar_error("%.*s: Vertex module not found.", (I32) vert_module_key.len, vert_module_key.data);
+                parser_error(parser, "%.*s: Vertex module not found.", (I32) vert_module_key.len, vert_module_key.data);
                 failed = true;
             }
             if (frag_module.type != MODULE_FRAG) {
-                ar_error("%.*s: Fragment module not found.", (I32) frag_module_key.len, frag_module_key.data);
+                parser_error(parser, "%.*s: Fragment module not found.", (I32) frag_module_key.len, frag_module_key.data);
                 failed = true;
             }
-            if (failed) {
-                break;
-            }
 
-            parser->program.name = name;
-            parser->program.vert = vert_module;
-            parser->program.frag = frag_module;
+            define_program(parser, failed, (ProgramDef) {
+                    .name = token.args[0],
+                    .type = PROGRAM_TYPE_GRAPHICS,
+                    .vert_key = vert_module_key,
+                    .frag_key = frag_module_key,
+                    .vert = vert_module,
+                    .frag = frag_module,
+                });
         } break;
-        case TOKEN_INCLUDE:
-            if (paths.first == NULL) {
-                ar_error("Cannot include files without providing search paths.");
-                break;
-            }
+        case TOKEN_COMPUTE: {
+            ArStr comp_module_key = token.args[1];
+            Module comp_module = ar_hash_map_get(parser->module_map, comp_module_key, Module);
 
-            ArTemp scratch = ar_scratch_get(&parser->arena, 1);
-            FILE *fp = NULL;
-            ArStr path = {0};
-            for (ArStrListNode *curr = paths.first; curr != NULL; curr = curr->next) {
-                ArStr include_path = ar_str_pushf(scratch.arena, "%.*s/%.*s", (I32) curr->str.len, curr->str.data, (I32) token.args[0].len, token.args[0].data);
-                const char *cstr_include_path = ar_str_to_cstr(scratch.arena, include_path);
-                fp = fopen(cstr_include_path, "rb");
-                if (fp != NULL) {
-                    path = include_path;
-                    break;
-                }
+            B8 failed = false;
+            if (comp_module.type != MODULE_COMP) {
+                parser_error(parser, "%.*s: Compute module not found.", (I32) comp_module_key.len, comp_module_key.data);
+                failed = true;
             }
 
-            if (fp == NULL) {
-                ar_error("Couldn't find file %.*s, in the provided paths.", (I32) token.args[0].len, token.args[0].data);
-            } else {
-                fclose(fp);
+            define_program(parser, failed, (ProgramDef) {
+                    .name = token.args[0],
+                    .type = PROGRAM_TYPE_COMPUTE,
+                    .comp_key = comp_module_key,
+                    .comp = comp_module,
+                });
+        } break;
+        case TOKEN_VARIANT:
+            // Like the program, variants aren't part of any unit.
+            if (parser->recorder != NULL) {
+                parser->recorder->cacheable = false;
             }
-
-            ArStr imported_file = read_file(scratch.arena, path);
-            ArStr path_dir = dirname(path);
-            ar_str_list_push_front(scratch.arena, &paths, path_dir);
-            ar_str_list_pop(&paths);
-            parse(parser, imported_file, paths);
-
-            ar_scratch_release(&scratch);
-
+            define_variant(parser, token.args[0], token.args[1], token.args[2]);
+            break;
+        case TOKEN_INCLUDE:
+            include_file(parser, token.args[0], paths);
             break;
         case TOKEN_INCLUDE_MODULE: {
-            ArStr module_value = ar_hash_map_get(parser->module_map, token.args[0], ArStr);
-            if (module_value.data == NULL) {
-                ar_error("%.*s: Module couldn't be found.", (I32) token.args[0].len, token.args[0].data);
+            Module module = ar_hash_map_get(parser->module_map, token.args[0], Module);
+            if (module.type == MODULE_NONE) {
+                parser_error(parser, "%.*s: Module couldn't be found.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
-            ar_str_list_push(parser->arena, &parser->module_parts, module_value);
-        } break;
-        case TOKEN_CTYPEDEF: {
-            ArArena *hm_arena = ar_hash_map_get_arena(parser->ctype_map);
-            ArStr glsl_type = ar_str_push_copy(hm_arena, token.args[0]);
-            ArStr ctype = ar_str_push_copy(hm_arena, token.args[1]);
-            ar_hash_map_insert(parser->ctype_map, glsl_type, ctype);
+            // Code from another file would go stale in the cached unit.
+            if (parser->recorder != NULL && !recorded_module(parser->recorder, token.args[0])) {
+                parser->recorder->cacheable = false;
+            }
+            slice_list_append(parser->arena, &parser->module_parts, module.code);
         } break;
+        case TOKEN_CTYPEDEF:
+            define_ctype(parser, token.args[0], token.args[1]);
+            break;
 
         case TOKEN_ERROR:
-            ar_error("%.*s", (I32) token.error.len, token.error.data);
+            parser_error(parser, "%.*s", (I32) token.error.len, token.error.data);
             break;
         case TOKEN_GLSL:
             break;
@@ -343,62 +957,155 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
     }
 }
 
-void parse(Parser *parser, ArStr source, ArStrList paths) {
+void parse(Parser *parser, ArStr name, ArStr source, ArStrList paths) {
     FileParser file_parser = {
+        .name = name,
         .source = source,
     };
 
     ar_sll_stack_push(parser->file_parser_stack, &file_parser);
 
-    while (file_parser.i < file_parser.source.len) {
-        if (file_parser_peek(file_parser) == '/' && file_parser_peek_next(file_parser) == '/') {
-            while (file_parser_peek(file_parser) != '\n') {
-                file_parser.i++;
+    U64 i = 0;
+    while (i < source.len && (i = parser->scan(source.data, i, source.len)) < source.len) {
+        if (source.data[i] == '/') {
+            if (i + 1 < source.len && source.data[i + 1] == '/') {
+                const U8 *newline = memchr(&source.data[i], '\n', source.len - i);
+                i = newline != NULL ? (U64) (newline - source.data) : source.len;
+            } else {
+                i++;
             }
             continue;
         }
 
-        if (file_parser_peek(file_parser) == '#') {
-            file_parser.last_token_end = file_parser.token_end;
-            file_parser.token_start = file_parser.i;
-            file_parser.i++;
-            ArStr statement = extract_statement(&file_parser);
-            ArTemp scratch = ar_scratch_get(&parser->arena, 1);
-            ArStrList statement_list = split_statement(scratch.arena, statement);
-            Token token = tokenize_statement_list(scratch.arena, statement_list);
-            expand_token(parser, token, paths);
-            file_parser.token_end = file_parser.i;
-
-            if (token.type == TOKEN_GLSL) {
-                FileParser *file_parser = parser->file_parser_stack;
-                ArStr module_part = ar_str_sub(file_parser->source, file_parser->token_start, file_parser->token_end);
-                module_part = ar_str_push_copy(parser->arena, module_part);
-                ar_str_list_push(parser->arena, &parser->module_parts, module_part);
-            }
-            ar_scratch_release(&scratch);
+        file_parser.last_token_end = file_parser.token_end;
+        file_parser.token_start = i;
+        file_parser.i = i + 1;
+        ArStr statement = extract_statement(&file_parser);
+        ArTemp scratch = ar_scratch_get(&parser->arena, 1);
+        Token token = tokenize_statement(scratch.arena, statement);
+        expand_token(parser, token, paths);
+        // The newline is part of the directive, if there is one.
+        file_parser.token_end = ar_min(file_parser.i, source.len - 1);
+
+        if (token.type == TOKEN_GLSL) {
+            FileParser *file_parser = parser->file_parser_stack;
+            ArStr module_part = ar_str_sub(file_parser->source, file_parser->token_start, file_parser->token_end);
+            slice_list_push(parser->arena, &parser->module_parts, module_part);
         }
+        ar_scratch_release(&scratch);
 
-
-        file_parser.i++;
+        i = file_parser.i + 1;
     }
 
     ar_sll_stack_pop(parser->file_parser_stack);
 }
 
-static U64 hash_str(const void *key, U64 len) {
-    (void) len;
-    const ArStr *_key = key;
-    return ar_fvn1a_hash(_key->data, _key->len);
+// Index of the stage built from the module 'key', adding it the first time a
+// program uses the module.
+static U32 stage_index(ArArena *arena, ArHashMap *stage_map, Buffer *stages, ArStr key, Module module) {
+    U32 index = ar_hash_map_get(stage_map, key, U32);
+    if (index != 0) {
+        return index - 1;
+    }
+
+    ParsedStage stage = {
+        .source = slice_list_join(arena, module.code),
+    };
+    switch (module.type) {
+        case MODULE_VERT:
+            stage.type = SHADER_TYPE_VERTEX;
+            break;
+        case MODULE_FRAG:
+            stage.type = SHADER_TYPE_FRAGMENT;
+            break;
+        default:
+            stage.type = SHADER_TYPE_COMPUTE;
+            break;
+    }
+    buffer_push(stages, &stage, sizeof(stage));
+    index = stages->len / sizeof(ParsedStage);
+    ar_hash_map_insert(stage_map, key, index);
+    return index - 1;
 }
 
-static B8 str_eq(const void *a, const void *b, U64 len) {
-    (void) len;
-    const ArStr *_a = a;
-    const ArStr *_b = b;
-    return ar_str_match(*_a, *_b, AR_STR_MATCH_FLAG_EXACT);
+static void collect_axes(ArArena *arena, Parser *parser, U32 program_index, ParsedProgram *program) {
+    const AxisDef *defs = (const AxisDef *) parser->axes.data;
+    U64 def_count = parser->axes.len / sizeof(AxisDef);
+    for (U64 i = 0; i < def_count; i++) {
+        program->axis_count += defs[i].program == program_index;
+    }
+    if (program->axis_count == 0) {
+        return;
+    }
+
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    program->axes = ar_arena_push_arr(arena, VariantAxis, program->axis_count);
+    U32 axis = 0;
+    for (U64 i = 0; i < def_count; i++) {
+        if (defs[i].program != program_index) {
+            continue;
+        }
+        VariantAxis *out = &program->axes[axis++];
+        out->name = ar_str_push_copy(arena, defs[i].name);
+        if (defs[i].value_count == 0) {
+            continue;
+        }
+
+        ArStr *values;
+        out->value_count = split_variant_values(scratch.arena, defs[i].values, &values);
+        out->values = ar_arena_push_arr_no_zero(arena, ArStr, out->value_count);
+        for (U32 j = 0; j < out->value_count; j++) {
+            out->values[j] = ar_str_push_copy(arena, values[j]);
+        }
+    }
+    ar_scratch_release(&scratch);
+}
+
+static void collect_programs(ArArena *arena, Parser *parser, ParsedShader *shader) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // Module name to stage index + 1.
+    ArHashMapDesc stage_map_desc = {
+        .arena = scratch.arena,
+        .capacity = 32,
+
+        .hash_func = hash_str,
+        .eq_func = str_eq,
+
+        .key_size = sizeof(ArStr),
+        .value_size = sizeof(U32),
+        .null_value = &(U32) {0},
+    };
+    ArHashMap *stage_map = ar_hash_map_init(stage_map_desc);
+    Buffer stages = { .arena = scratch.arena };
+
+    const ProgramDef *defs = (const ProgramDef *) parser->programs.data;
+    U64 count = parser->programs.len / sizeof(ProgramDef);
+    shader->programs = ar_arena_push_arr_no_zero(arena, ParsedProgram, count);
+    shader->program_count = count;
+    for (U64 i = 0; i < count; i++) {
+        ParsedProgram *program = &shader->programs[i];
+        *program = (ParsedProgram) {
+            .name = ar_str_push_copy(arena, defs[i].name),
+            .type = defs[i].type,
+        };
+        if (defs[i].type == PROGRAM_TYPE_COMPUTE) {
+            program->compute = stage_index(arena, stage_map, &stages, defs[i].comp_key, defs[i].comp);
+        } else {
+            program->vertex = stage_index(arena, stage_map, &stages, defs[i].vert_key, defs[i].vert);
+            program->fragment = stage_index(arena, stage_map, &stages, defs[i].frag_key, defs[i].frag);
+        }
+        collect_axes(arena, parser, i, &shader->programs[i]);
+    }
+
+    shader->stage_count = stages.len / sizeof(ParsedStage);
+    shader->stages = ar_arena_push_arr_no_zero(arena, ParsedStage, shader->stage_count);
+    memcpy(shader->stages, stages.data, stages.len);
+
+    ar_scratch_release(&scratch);
 }
 
-ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths) {
+static ParsedShader parse_with(ArArena *arena, ArStr name, ArStr source, ArStrList paths, Parser parser) {
     ArTemp scratch = ar_scratch_get(&arena, 1);
 
     ArHashMapDesc module_map_desc = {
@@ -425,24 +1132,197 @@ ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths) {
         .null_value = &(ArStr) {0},
     };
 
-    Parser parser = {
+    ArHashMapDesc included_desc = {
         .arena = scratch.arena,
-        .module_map = ar_hash_map_init(module_map_desc),
-        .ctype_map = ar_hash_map_init(ctype_map_desc),
+        .capacity = 32,
+
+        .hash_func = hash_str,
+        .eq_func = str_eq,
+
+        .key_size = sizeof(ArStr),
+        .value_size = sizeof(B8),
+        .null_value = &(B8) {false},
     };
 
-    parse(&parser, source, paths);
+    parser.arena = scratch.arena;
+    parser.scan = select_scan();
+    parser.module_map = ar_hash_map_init(module_map_desc);
+    parser.ctype_map = ar_hash_map_init(ctype_map_desc);
+    parser.included = ar_hash_map_init(included_desc);
+    parser.programs = (Buffer) { .arena = scratch.arena };
+    parser.axes = (Buffer) { .arena = scratch.arena };
+
+    // Cached contents and units are only referenced until the result has
+    // been copied out.
+    FileCacheReader reader;
+    if (parser.files != NULL) {
+        file_cache_begin_read(parser.files, &reader);
+    }
+
+    parse(&parser, name, source, paths);
 
     ParsedShader shader = {
-        .program = {
-            .name = ar_str_push_copy(arena, parser.program.name),
-            .vertex_source = ar_str_push_copy(arena, parser.program.vert.code),
-            .fragment_source = ar_str_push_copy(arena, parser.program.frag.code),
-        },
         .ctypes = parser.ctype_map,
     };
+    collect_programs(arena, &parser, &shader);
+
+    for (ArStrListNode *curr = parser.dependencies.first; curr != NULL; curr = curr->next) {
+        ar_str_list_push(arena, &shader.dependencies, ar_str_push_copy(arena, curr->str));
+    }
+
+    for (Mapping *curr = parser.mappings; curr != NULL; curr = curr->next) {
+        unmap_file(&curr->file);
+    }
+    if (parser.files != NULL) {
+        file_cache_end_read(parser.files, &reader);
+    }
 
     ar_scratch_release(&scratch);
 
     return shader;
 }
+
+ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths, FileCache *files) {
+    return parse_with(arena, (ArStr) {0}, source, paths, (Parser) { .files = files });
+}
+
+ParsedShader parse_shader_source(ArArena *arena, ShaderSource source) {
+    return parse_with(arena, source.name, source.code, (ArStrList) {0}, (Parser) {
+            .include = source.include,
+            .include_userdata = source.include_userdata,
+        });
+}
+
+// How long benchmark_parse runs for.
+#define PARSE_BENCH_NS 200e6
+
+F64 benchmark_parse(ArStr source, ArStrList paths, FileCache *files) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    U64 iterations = 0;
+    F64 elapsed = 0;
+    do {
+        ArTemp temp = ar_temp_begin(scratch.arena);
+        parse_shader(temp.arena, source, paths, files);
+        ar_temp_end(&temp);
+        iterations++;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+    } while (elapsed < PARSE_BENCH_NS);
+
+    ar_scratch_release(&scratch);
+    return source.len * iterations / (elapsed / 1e9);
+}
+
+void test_match_token_type(void) {
+    // Listed apart from KEYWORDS, so that a keyword lost to a hash collision
+    // still fails here.
+    static const Keyword keywords[] = {
+        { ar_str_lit("end"), TOKEN_END },
+        { ar_str_lit("module"), TOKEN_MODULE },
+        { ar_str_lit("vert"), TOKEN_VERT },
+        { ar_str_lit("frag"), TOKEN_FRAG },
+        { ar_str_lit("comp"), TOKEN_COMP },
+        { ar_str_lit("program"), TOKEN_PROGRAM },
+        { ar_str_lit("compute"), TOKEN_COMPUTE },
+        { ar_str_lit("include"), TOKEN_INCLUDE },
+        { ar_str_lit("include_module"), TOKEN_INCLUDE_MODULE },
+        { ar_str_lit("ctypedef"), TOKEN_CTYPEDEF },
+        { ar_str_lit("variant"), TOKEN_VARIANT },
+        { ar_str_lit("define"), TOKEN_GLSL },
+        { ar_str_lit("undef"), TOKEN_GLSL },
+        { ar_str_lit("if"), TOKEN_GLSL },
+        { ar_str_lit("ifdef"), TOKEN_GLSL },
+        { ar_str_lit("ifndef"), TOKEN_GLSL },
+        { ar_str_lit("else"), TOKEN_GLSL },
+        { ar_str_lit("elif"), TOKEN_GLSL },
+        { ar_str_lit("endif"), TOKEN_GLSL },
+        { ar_str_lit("error"), TOKEN_GLSL },
+        { ar_str_lit("pragma"), TOKEN_GLSL },
+        { ar_str_lit("extension"), TOKEN_GLSL },
+        { ar_str_lit("version"), TOKEN_GLSL },
+        { ar_str_lit("line"), TOKEN_GLSL },
+    };
+    for (U32 i = 0; i < ar_arrlen(keywords); i++) {
+        assert(match_token_type(keywords[i].name) == keywords[i].type);
+    }
+
+    // Same length, first and last character as a keyword, prefixes, suffixes
+    // and case.
+    static const ArStr near_misses[] = {
+        ar_str_lit("vest"),
+        ar_str_lit("frog"),
+        ar_str_lit("cusp"),
+        ar_str_lit("eld"),
+        ar_str_lit("endef"),
+        ar_str_lit("en"),
+        ar_str_lit("ends"),
+        ar_str_lit("modul"),
+        ar_str_lit("modules"),
+        ar_str_lit("Module"),
+        ar_str_lit("vertex"),
+        ar_str_lit("fragment"),
+        ar_str_lit("computer"),
+        ar_str_lit("include_"),
+        ar_str_lit("include_modules"),
+        ar_str_lit("ctypedefs"),
+        ar_str_lit("variants"),
+        ar_str_lit("i"),
+        ar_str_lit("x"),
+    };
+    for (U32 i = 0; i < ar_arrlen(near_misses); i++) {
+        assert(match_token_type(near_misses[i]) == TOKEN_ERROR);
+    }
+}
+
+// Regressions found by fuzzing the parser against its previous version.
+void test_parser(void) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    Diagnostics diagnostics = { .arena = scratch.arena };
+    Diagnostics *previous = diagnostics_swap(&diagnostics);
+
+    // Trailing whitespace isn't an extra argument.
+    {
+        ArStr words[4];
+        assert(split_statement(ar_str_lit("program P vs fs \t "), words, ar_arrlen(words)) == 4);
+        Token token = tokenize_statement(scratch.arena, ar_str_lit("program P vs fs \t "));
+        assert(token.type == TOKEN_PROGRAM);
+    }
+
+    // A lone '#' is GLSL's null directive.
+    {
+        Token token = tokenize_statement(scratch.arena, ar_str_lit(""));
+        assert(token.type == TOKEN_GLSL);
+        token = tokenize_statement(scratch.arena, ar_str_lit(" \t"));
+        assert(token.type == TOKEN_GLSL);
+    }
+
+    // A directive at the very start of the file, a lone '#' inside a module
+    // and trailing whitespace after a directive, parsed end to end.
+    {
+        ArStr source = ar_str_lit(
+                "#vert vs\n"
+                "#\n"
+                "void main() {}\n"
+                "#end\n"
+                "#frag fs \n"
+                "void main() {}\n"
+                "#end\n"
+                "#program P vs fs \t\n");
+        ParsedShader parsed = parse_shader(scratch.arena, source, (ArStrList) {0}, NULL);
+        assert(diagnostics.errors.first == NULL);
+        assert(parsed.program_count == 1);
+        assert(parsed.stage_count == 2);
+        ParsedStage vertex = parsed.stages[parsed.programs[0].vertex];
+        assert(vertex.type == SHADER_TYPE_VERTEX);
+        assert(strstr((const char *) vertex.source.data, "#\n") != NULL);
+        assert(strstr((const char *) vertex.source.data, "void main() {}") != NULL);
+    }
+
+    diagnostics_swap(previous);
+    ar_scratch_release(&scratch);
+}
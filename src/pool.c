@@ -0,0 +1,169 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct ThreadPoolTask ThreadPoolTask;
+struct ThreadPoolTask {
+    ThreadPoolTask *next;
+    ThreadPoolFunc *func;
+    void *userdata;
+};
+
+typedef struct ThreadPoolWorker ThreadPoolWorker;
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    pthread_t thread;
+    ArArena *arena;
+};
+
+struct ThreadPool {
+    ArArena *arena;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    ThreadPoolTask *first;
+    ThreadPoolTask *last;
+    ThreadPoolTask *free_list;
+
+    // Queued and running tasks.
+    U32 pending;
+    B8 quit;
+
+    U32 worker_count;
+    ThreadPoolWorker *workers;
+};
+
+static void *worker_main(void *userdata) {
+    ThreadPoolWorker *worker = userdata;
+    ThreadPool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (pool->first == NULL && !pool->quit) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->first == NULL && pool->quit) {
+            break;
+        }
+
+        ThreadPoolTask *task = pool->first;
+        pool->first = task->next;
+        if (pool->first == NULL) {
+            pool->last = NULL;
+        }
+        ThreadPoolFunc *func = task->func;
+        void *task_userdata = task->userdata;
+        ar_sll_stack_push(pool->free_list, task);
+        pthread_mutex_unlock(&pool->mutex);
+
+        func(worker->arena, task_userdata);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->pending--;
+        if (pool->pending == 0) {
+            pthread_cond_broadcast(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+U32 cpu_count(void) {
+    I64 count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+        return 1;
+    }
+    return count;
+}
+
+ThreadPool *thread_pool_create(U32 worker_count) {
+    if (worker_count == 0) {
+        worker_count = cpu_count();
+    }
+
+    ArArena *arena = ar_arena_create_default();
+    ThreadPool *pool = ar_arena_push_arr(arena, ThreadPool, 1);
+    pool->arena = arena;
+    pool->worker_count = worker_count;
+    pool->workers = ar_arena_push_arr(arena, ThreadPoolWorker, worker_count);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (U32 i = 0; i < worker_count; i++) {
+        ThreadPoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->arena = ar_arena_create_default();
+        pthread_create(&worker->thread, NULL, worker_main, worker);
+    }
+
+    return pool;
+}
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *userdata) {
+    pthread_mutex_lock(&pool->mutex);
+
+    ThreadPoolTask *task = pool->free_list;
+    if (task != NULL) {
+        ar_sll_stack_pop(pool->free_list);
+    } else {
+        task = ar_arena_push_arr(pool->arena, ThreadPoolTask, 1);
+    }
+    *task = (ThreadPoolTask) {
+        .func = func,
+        .userdata = userdata,
+    };
+
+    if (pool->last == NULL) {
+        pool->first = task;
+    } else {
+        pool->last->next = task;
+    }
+    pool->last = task;
+    pool->pending++;
+
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+U32 thread_pool_worker_count(const ThreadPool *pool) {
+    return pool->worker_count;
+}
+
+void thread_pool_destroy(ThreadPool **pool) {
+    ThreadPool *p = *pool;
+
+    pthread_mutex_lock(&p->mutex);
+    p->quit = true;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (U32 i = 0; i < p->worker_count; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+        ar_arena_destroy(&p->workers[i].arena);
+    }
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->done_cond);
+
+    ArArena *arena = p->arena;
+    ar_arena_destroy(&arena);
+    *pool = NULL;
+}
@@ -2,11 +2,13 @@
 
 #include "arkin_log.h"
 
+#include <pthread.h>
 #include <spirv_cross_c.h>
+#include <time.h>
 
 static void error_cb(void *userdata, const char *error) {
     (void) userdata;
-    ar_error("%s", error);
+    report_error("%s", error);
 }
 
 static ReflectedDataType translate_type(spvc_basetype type, U32 vec_size, U32 cols) {
@@ -113,21 +115,99 @@ static ReflectedDataType translate_type(spvc_basetype type, U32 vec_size, U32 co
             break;
     }
 
-    ar_error("Unkown: %d", type);
+    report_error("Unkown: %d", type);
     return REFLECTED_DATA_TYPE_UNKNOWN;
 }
 
-static ReflectedType reflect(ArArena *arena, spvc_compiler compiler, spvc_type type, ArStr name) {
-    spvc_basetype basetype = spvc_type_get_basetype(type);
+static void reflect_member_layout(spvc_compiler compiler, spvc_type struct_type, U32 index, ReflectedType *member) {
+    size_t size = 0;
+    spvc_compiler_type_struct_member_offset(compiler, struct_type, index, &member->offset);
+    spvc_compiler_get_declared_struct_member_size(compiler, struct_type, index, &size);
+    member->size = size;
+    if (member->array_dimensions > 0) {
+        spvc_compiler_type_struct_member_array_stride(compiler, struct_type, index, &member->array_stride);
+    }
+    if (member->cols > 1) {
+        spvc_compiler_type_struct_member_matrix_stride(compiler, struct_type, index, &member->matrix_stride);
+    }
+}
 
-    U32 arr_dims = spvc_type_get_num_array_dimensions(type);
-    U32 *arr_dim_lens = NULL;
-    if (arr_dims > 0) {
-        arr_dim_lens = ar_arena_push_arr_no_zero(arena, U32, arr_dims);
-        for (U32 i = 0; i < arr_dims; i++) {
-            arr_dim_lens[i] = spvc_type_get_array_dimension(type, i);
+// Non-literal lengths are the ID of a specialization constant, which is
+// replaced with its default.
+static U32 array_dimension_length(spvc_compiler compiler, spvc_type type, U32 index, U32 *spec_id) {
+    U32 length = spvc_type_get_array_dimension(type, index);
+    *spec_id = REFLECTED_NO_SPEC_ID;
+    if (!spvc_type_array_dimension_is_literal(type, index)) {
+        if (spvc_compiler_has_decoration(compiler, length, SpvDecorationSpecId)) {
+            *spec_id = spvc_compiler_get_decoration(compiler, length, SpvDecorationSpecId);
         }
+        length = spvc_constant_get_scalar_u32(spvc_compiler_get_constant_handle(compiler, length), 0, 0);
     }
+    return length;
+}
+
+// Types are reflected into flat pools first, linked by index. The members of
+// a struct take consecutive nodes, array lengths consecutive entries and names
+// go into one string table. finish_types then turns them into ReflectedType
+// trees with a single allocation per pool. The pools belong to the Reflector
+// and keep their capacity from one stage to the next.
+typedef struct TypeNode TypeNode;
+struct TypeNode {
+    // Without its pointers, finish_types sets those.
+    ReflectedType type;
+    U32 name_offset;
+    U32 first_member;
+    U32 first_dimension;
+};
+
+// A stage input or output whose type isn't finished yet.
+typedef struct PendingVariable PendingVariable;
+struct PendingVariable {
+    U32 location;
+    U32 node;
+};
+
+struct Reflector {
+    spvc_context context;
+    // Of the stage being reflected.
+    spvc_compiler compiler;
+
+    ArArena *arena;
+    Buffer nodes;
+    // Array lengths and their specialization constant IDs.
+    Buffer lengths;
+    Buffer spec_ids;
+    Buffer names;
+};
+
+static TypeNode *pool_node(Reflector *reflector, U32 index) {
+    return &((TypeNode *) reflector->nodes.data)[index];
+}
+
+// 'count' zeroed nodes, returns the index of the first one.
+static U32 pool_reserve(Reflector *reflector, U32 count) {
+    U32 first = reflector->nodes.len / sizeof(TypeNode);
+    if (count > 0) {
+        buffer_reserve(&reflector->nodes, count*sizeof(TypeNode));
+        memset(&reflector->nodes.data[reflector->nodes.len], 0, count*sizeof(TypeNode));
+        reflector->nodes.len += count*sizeof(TypeNode);
+    }
+    return first;
+}
+
+// Appends 'name' to the string table, returns its offset.
+static U32 pool_name(Reflector *reflector, const char *name, U32 *len) {
+    U32 offset = reflector->names.len;
+    *len = strlen(name);
+    buffer_push(&reflector->names, name, *len);
+    return offset;
+}
+
+// Fills node 'index'. 'layout' is set for buffer blocks, whose members carry
+// explicit offsets.
+static void reflect_node(Reflector *reflector, spvc_type type, const char *name, B8 layout, U32 index) {
+    spvc_compiler compiler = reflector->compiler;
+    spvc_basetype basetype = spvc_type_get_basetype(type);
 
     // if vec_size == 1:
     //     type = scaler
@@ -140,90 +220,395 @@ static ReflectedType reflect(ArArena *arena, spvc_compiler compiler, spvc_type t
     U32 vec_size = spvc_type_get_vector_size(type);
     U32 cols = spvc_type_get_columns(type);
 
-    ReflectedType reflected = {
-        .data_type = (ReflectedDataType) translate_type(basetype, vec_size, cols),
-        .name = ar_str_push_copy(arena, name),
-        .array_dimensions = arr_dims,
-        .array_dimension_lengths = arr_dim_lens,
-
-        .vec_size = vec_size,
-        .cols = cols,
+    TypeNode node = {
+        .type = {
+            .data_type = (ReflectedDataType) translate_type(basetype, vec_size, cols),
+            .array_dimensions = spvc_type_get_num_array_dimensions(type),
+            .vec_size = vec_size,
+            .cols = cols,
+        },
+        .first_dimension = reflector->lengths.len / sizeof(U32),
     };
+    U32 name_len;
+    node.name_offset = pool_name(reflector, name, &name_len);
+    node.type.name.len = name_len;
+
+    for (U32 i = 0; i < node.type.array_dimensions; i++) {
+        U32 spec_id;
+        U32 length = array_dimension_length(compiler, type, i, &spec_id);
+        buffer_push(&reflector->lengths, &length, sizeof(length));
+        buffer_push(&reflector->spec_ids, &spec_id, sizeof(spec_id));
+    }
 
-    switch (basetype) {
-        case SPVC_BASETYPE_VOID:
-            break;
-        case SPVC_BASETYPE_BOOLEAN:
-            break;
-        case SPVC_BASETYPE_INT8:
-            break;
-        case SPVC_BASETYPE_UINT8:
-            break;
-        case SPVC_BASETYPE_INT16:
-            break;
-        case SPVC_BASETYPE_UINT16:
-            break;
-        case SPVC_BASETYPE_INT32:
-            break;
-        case SPVC_BASETYPE_UINT32:
-            break;
-        case SPVC_BASETYPE_INT64:
-            break;
-        case SPVC_BASETYPE_UINT64:
-            break;
-        case SPVC_BASETYPE_ATOMIC_COUNTER:
-            break;
-        case SPVC_BASETYPE_FP16:
-            break;
-        case SPVC_BASETYPE_FP32:
-            break;
-        case SPVC_BASETYPE_FP64:
-            break;
+    if (basetype == SPVC_BASETYPE_STRUCT) {
+        U32 id = spvc_type_get_base_type_id(type);
+        node.type.member_count = spvc_type_get_num_member_types(type);
+        node.first_member = pool_reserve(reflector, node.type.member_count);
+        for (U32 i = 0; i < node.type.member_count; i++) {
+            spvc_type member_type = spvc_compiler_get_type_handle(compiler, spvc_type_get_member_type(type, i));
+            reflect_node(reflector, member_type, spvc_compiler_get_member_name(compiler, id, i), layout, node.first_member + i);
+            if (layout) {
+                reflect_member_layout(compiler, type, i, &pool_node(reflector, node.first_member + i)->type);
+            }
+        }
+
+        // Members overwrite this with their declared member size.
+        if (layout) {
+            size_t size = 0;
+            spvc_compiler_get_declared_struct_size(compiler, type, &size);
+            node.type.size = size;
+        }
+    }
+
+    // Written last, reserving the members may have moved the pool.
+    *pool_node(reflector, index) = node;
+}
+
+// Copies the pools into 'arena' and links the nodes up. The types are
+// indexed like the nodes. 'names' is the string table already copied.
+static ReflectedType *finish_types(Reflector *reflector, ArArena *arena, const U8 *names) {
+    U32 node_count = reflector->nodes.len / sizeof(TypeNode);
+    U32 dimension_count = reflector->lengths.len / sizeof(U32);
+    ReflectedType *types = ar_arena_push_arr_no_zero(arena, ReflectedType, node_count);
+    U32 *lengths = ar_arena_push_arr_no_zero(arena, U32, dimension_count);
+    U32 *spec_ids = ar_arena_push_arr_no_zero(arena, U32, dimension_count);
+    memcpy(lengths, reflector->lengths.data, reflector->lengths.len);
+    memcpy(spec_ids, reflector->spec_ids.data, reflector->spec_ids.len);
+
+    for (U32 i = 0; i < node_count; i++) {
+        TypeNode node = *pool_node(reflector, i);
+        types[i] = node.type;
+        types[i].name = ar_str((U8 *) &names[node.name_offset], node.type.name.len);
+        if (node.type.array_dimensions > 0) {
+            types[i].array_dimension_lengths = &lengths[node.first_dimension];
+            types[i].array_dimension_spec_ids = &spec_ids[node.first_dimension];
+        }
+        if (node.type.member_count > 0) {
+            types[i].members = &types[node.first_member];
+        }
+    }
+
+    return types;
+}
+
+static PendingVariable *reflect_interface(Reflector *reflector, ArArena *arena, spvc_resources resources, spvc_resource_type resource_type, Usize *count) {
+    const spvc_reflected_resource *list = NULL;
+    spvc_resources_get_resource_list_for_type(resources, resource_type, &list, count);
+
+    PendingVariable *variables = ar_arena_push_arr(arena, PendingVariable, *count);
+    U32 first = pool_reserve(reflector, *count);
+    for (U32 i = 0; i < *count; i++) {
+        spvc_reflected_resource resource = list[i];
+        spvc_type type = spvc_compiler_get_type_handle(reflector->compiler, resource.type_id);
+        reflect_node(reflector, type, resource.name, false, first + i);
+
+        PendingVariable variable = {
+            .location = spvc_compiler_get_decoration(reflector->compiler, resource.id, SpvDecorationLocation),
+            .node = first + i,
+        };
+
+        // Insertion sort by location, interfaces are small.
+        U32 j = i;
+        while (j > 0 && variables[j - 1].location > variable.location) {
+            variables[j] = variables[j - 1];
+            j--;
+        }
+        variables[j] = variable;
+    }
+
+    return variables;
+}
 
-        case SPVC_BASETYPE_STRUCT: {
-            U32 member_count = spvc_type_get_num_member_types(type);
-            reflected.member_count = member_count;
-            reflected.members = ar_arena_push_arr(arena, ReflectedType, member_count);
-            U32 id = spvc_type_get_base_type_id(type);
-            for (U32 i = 0; i < member_count; i++) {
-                const char *member_name = spvc_compiler_get_member_name(compiler, id, i);
-                spvc_type_id member_type_id = spvc_type_get_member_type(type, i);
-                spvc_type member_type = spvc_compiler_get_type_handle(compiler, member_type_id);
-                reflected.members[i] = reflect(arena, compiler, member_type, ar_str_cstr(member_name));
+static ReflectedVariable *finish_variables(ArArena *arena, const ReflectedType *types, const PendingVariable *pending, Usize count) {
+    ReflectedVariable *variables = ar_arena_push_arr_no_zero(arena, ReflectedVariable, count);
+    for (U32 i = 0; i < count; i++) {
+        variables[i].location = pending[i].location;
+        variables[i].type = types[pending[i].node];
+    }
+    return variables;
+}
+
+// Resource types that take a descriptor.
+static const spvc_resource_type DESCRIPTOR_RESOURCE_TYPES[] = {
+    SPVC_RESOURCE_TYPE_UNIFORM_BUFFER,
+    SPVC_RESOURCE_TYPE_STORAGE_BUFFER,
+    SPVC_RESOURCE_TYPE_SAMPLED_IMAGE,
+    SPVC_RESOURCE_TYPE_SEPARATE_IMAGE,
+    SPVC_RESOURCE_TYPE_SEPARATE_SAMPLERS,
+    SPVC_RESOURCE_TYPE_STORAGE_IMAGE,
+    SPVC_RESOURCE_TYPE_SUBPASS_INPUT,
+};
+
+// Images with a 'Buffer' dimension are texel buffers.
+static ReflectedDescriptorType descriptor_type(spvc_resource_type resource_type, spvc_type type) {
+    switch (resource_type) {
+        case SPVC_RESOURCE_TYPE_UNIFORM_BUFFER:
+            return REFLECTED_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        case SPVC_RESOURCE_TYPE_STORAGE_BUFFER:
+            return REFLECTED_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        case SPVC_RESOURCE_TYPE_SAMPLED_IMAGE:
+            if (spvc_type_get_image_dimension(type) == SpvDimBuffer) {
+                return REFLECTED_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            }
+            return REFLECTED_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        case SPVC_RESOURCE_TYPE_SEPARATE_IMAGE:
+            if (spvc_type_get_image_dimension(type) == SpvDimBuffer) {
+                return REFLECTED_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
             }
-        } break;
+            return REFLECTED_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+        case SPVC_RESOURCE_TYPE_SEPARATE_SAMPLERS:
+            return REFLECTED_DESCRIPTOR_TYPE_SAMPLER;
+        case SPVC_RESOURCE_TYPE_STORAGE_IMAGE:
+            if (spvc_type_get_image_dimension(type) == SpvDimBuffer) {
+                return REFLECTED_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER;
+            }
+            return REFLECTED_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        default:
+            return REFLECTED_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    }
+}
 
-        case SPVC_BASETYPE_IMAGE:
-            break;
-        case SPVC_BASETYPE_SAMPLED_IMAGE:
-            break;
-        case SPVC_BASETYPE_SAMPLER:
-            break;
-        case SPVC_BASETYPE_ACCELERATION_STRUCTURE:
-            break;
-        case SPVC_BASETYPE_UNKNOWN:
-            break;
-        case SPVC_BASETYPE_INT_MAX:
-            break;
+// Arrays sized by a specialization constant count with its default.
+static U32 descriptor_count(spvc_compiler compiler, spvc_type type) {
+    U32 count = 1;
+    U32 dimensions = spvc_type_get_num_array_dimensions(type);
+    for (U32 i = 0; i < dimensions; i++) {
+        U32 spec_id;
+        count *= array_dimension_length(compiler, type, i, &spec_id);
     }
+    return count;
+}
 
-    return reflected;
+// Bindings and specialization constants are sorted before their names are
+// copied out with the rest of the string table.
+typedef struct PendingBinding PendingBinding;
+struct PendingBinding {
+    // Without its name data.
+    ReflectedBinding binding;
+    U32 name_offset;
+};
+
+typedef struct PendingSpecConstant PendingSpecConstant;
+struct PendingSpecConstant {
+    // Without its name data.
+    ReflectedSpecConstant constant;
+    U32 name_offset;
+};
+
+static PendingBinding *reflect_bindings(Reflector *reflector, ArArena *arena, spvc_resources resources, Usize *count) {
+    spvc_compiler compiler = reflector->compiler;
+    *count = 0;
+    for (U32 i = 0; i < ar_arrlen(DESCRIPTOR_RESOURCE_TYPES); i++) {
+        const spvc_reflected_resource *list = NULL;
+        Usize list_count = 0;
+        spvc_resources_get_resource_list_for_type(resources, DESCRIPTOR_RESOURCE_TYPES[i], &list, &list_count);
+        *count += list_count;
+    }
+
+    PendingBinding *bindings = ar_arena_push_arr(arena, PendingBinding, *count);
+    U32 binding_count = 0;
+    for (U32 i = 0; i < ar_arrlen(DESCRIPTOR_RESOURCE_TYPES); i++) {
+        const spvc_reflected_resource *list = NULL;
+        Usize list_count = 0;
+        spvc_resources_get_resource_list_for_type(resources, DESCRIPTOR_RESOURCE_TYPES[i], &list, &list_count);
+        for (U32 j = 0; j < list_count; j++) {
+            spvc_reflected_resource resource = list[j];
+            spvc_type type = spvc_compiler_get_type_handle(compiler, resource.type_id);
+
+            PendingBinding pending = {
+                .binding = {
+                    .set = spvc_compiler_get_decoration(compiler, resource.id, SpvDecorationDescriptorSet),
+                    .binding = spvc_compiler_get_decoration(compiler, resource.id, SpvDecorationBinding),
+                    .descriptor_type = descriptor_type(DESCRIPTOR_RESOURCE_TYPES[i], type),
+                    .count = descriptor_count(compiler, type),
+                },
+            };
+            U32 name_len;
+            pending.name_offset = pool_name(reflector, resource.name, &name_len);
+            pending.binding.name.len = name_len;
+
+            // Insertion sort by set and binding.
+            ReflectedBinding binding = pending.binding;
+            U32 k = binding_count++;
+            while (k > 0 && (bindings[k - 1].binding.set > binding.set ||
+                        (bindings[k - 1].binding.set == binding.set && bindings[k - 1].binding.binding > binding.binding))) {
+                bindings[k] = bindings[k - 1];
+                k--;
+            }
+            bindings[k] = pending;
+        }
+    }
+
+    return bindings;
 }
 
+static PendingSpecConstant *reflect_spec_constants(Reflector *reflector, ArArena *arena, Usize *count) {
+    spvc_compiler compiler = reflector->compiler;
+    const spvc_specialization_constant *list = NULL;
+    Usize list_count = 0;
+    spvc_compiler_get_specialization_constants(compiler, &list, &list_count);
+
+    PendingSpecConstant *constants = ar_arena_push_arr(arena, PendingSpecConstant, list_count);
+    *count = 0;
+    for (U32 i = 0; i < list_count; i++) {
+        spvc_constant constant = spvc_compiler_get_constant_handle(compiler, list[i].id);
+        spvc_type type = spvc_compiler_get_type_handle(compiler, spvc_constant_get_type(constant));
+
+        ReflectedSpecConstant reflected = {
+            .id = list[i].constant_id,
+        };
+        switch (spvc_type_get_basetype(type)) {
+            case SPVC_BASETYPE_BOOLEAN:
+                reflected.boolean = true;
+                reflected.data_type = REFLECTED_DATA_TYPE_U32;
+                reflected.default_value = spvc_constant_get_scalar_u32(constant, 0, 0) != 0;
+                break;
+            case SPVC_BASETYPE_INT32:
+                reflected.data_type = REFLECTED_DATA_TYPE_I32;
+                reflected.default_value = spvc_constant_get_scalar_u32(constant, 0, 0);
+                break;
+            case SPVC_BASETYPE_UINT32:
+                reflected.data_type = REFLECTED_DATA_TYPE_U32;
+                reflected.default_value = spvc_constant_get_scalar_u32(constant, 0, 0);
+                break;
+            case SPVC_BASETYPE_FP32: {
+                F32 value = spvc_constant_get_scalar_fp32(constant, 0, 0);
+                U32 bits;
+                memcpy(&bits, &value, sizeof(bits));
+                reflected.data_type = REFLECTED_DATA_TYPE_F32;
+                reflected.default_value = bits;
+            } break;
+            case SPVC_BASETYPE_FP64: {
+                F64 value = spvc_constant_get_scalar_fp64(constant, 0, 0);
+                reflected.data_type = REFLECTED_DATA_TYPE_F64;
+                memcpy(&reflected.default_value, &value, sizeof(value));
+            } break;
+            default:
+                // 8, 16 and 64 bit integers and halfs need extra features to
+                // specialize, so they aren't worth the generated code yet.
+                continue;
+        }
 
-ReflectedStage reflect_spv(ArArena *arena, ArStr spv) {
-    ReflectedStage shader = {0}; 
+        // Only named once it's known to be kept.
+        U32 name_len;
+        U32 name_offset = pool_name(reflector, spvc_compiler_get_name(compiler, list[i].id), &name_len);
+        reflected.name.len = name_len;
+
+        // Insertion sort by ID.
+        U32 j = (*count)++;
+        while (j > 0 && constants[j - 1].constant.id > reflected.id) {
+            constants[j] = constants[j - 1];
+            j--;
+        }
+        constants[j] = (PendingSpecConstant) {
+            .constant = reflected,
+            .name_offset = name_offset,
+        };
+    }
+
+    return constants;
+}
+
+static ReflectedBinding *finish_bindings(ArArena *arena, const U8 *names, const PendingBinding *pending, Usize count) {
+    ReflectedBinding *bindings = ar_arena_push_arr_no_zero(arena, ReflectedBinding, count);
+    for (U32 i = 0; i < count; i++) {
+        bindings[i] = pending[i].binding;
+        bindings[i].name.data = (U8 *) &names[pending[i].name_offset];
+    }
+    return bindings;
+}
+
+static ReflectedSpecConstant *finish_spec_constants(ArArena *arena, const U8 *names, const PendingSpecConstant *pending, Usize count) {
+    ReflectedSpecConstant *constants = ar_arena_push_arr_no_zero(arena, ReflectedSpecConstant, count);
+    for (U32 i = 0; i < count; i++) {
+        constants[i] = pending[i].constant;
+        constants[i].name.data = (U8 *) &names[pending[i].name_offset];
+    }
+    return constants;
+}
+
+// Stays 0 for stages without a 'LocalSize' execution mode.
+static void reflect_workgroup_size(spvc_compiler compiler, ReflectedStage *stage) {
+    spvc_specialization_constant spec_constants[3];
+    spvc_compiler_get_work_group_size_specialization_constants(compiler, &spec_constants[0], &spec_constants[1], &spec_constants[2]);
+
+    for (U32 i = 0; i < 3; i++) {
+        stage->workgroup_size[i] = spvc_compiler_get_execution_mode_argument_by_index(compiler, SpvExecutionModeLocalSize, i);
+        stage->workgroup_size_spec_ids[i] = REFLECTED_NO_SPEC_ID;
+        // The ID is 0 for dimensions that aren't specialization constants.
+        if (spec_constants[i].id != 0) {
+            spvc_constant constant = spvc_compiler_get_constant_handle(compiler, spec_constants[i].id);
+            stage->workgroup_size[i] = spvc_constant_get_scalar_u32(constant, 0, 0);
+            stage->workgroup_size_spec_ids[i] = spec_constants[i].constant_id;
+        }
+    }
+}
+
+Reflector *reflector_create(void) {
+    ArArena *arena = ar_arena_create_default();
+    Reflector *reflector = ar_arena_push_arr(arena, Reflector, 1);
+    reflector->arena = arena;
+    reflector->nodes = (Buffer) { .arena = arena };
+    reflector->lengths = (Buffer) { .arena = arena };
+    reflector->spec_ids = (Buffer) { .arena = arena };
+    reflector->names = (Buffer) { .arena = arena };
+    // Up front, so finish_types never copies from NULL and most stages never
+    // grow them.
+    buffer_reserve(&reflector->nodes, 64*sizeof(TypeNode));
+    buffer_reserve(&reflector->lengths, 64*sizeof(U32));
+    buffer_reserve(&reflector->spec_ids, 64*sizeof(U32));
+    buffer_reserve(&reflector->names, 1024);
+
+    spvc_context_create(&reflector->context);
+    spvc_context_set_error_callback(reflector->context, error_cb, NULL);
+    return reflector;
+}
+
+void reflector_destroy(Reflector **reflector) {
+    spvc_context_destroy((*reflector)->context);
+    // The Reflector itself lives in the arena.
+    ArArena *arena = (*reflector)->arena;
+    ar_arena_destroy(&arena);
+    *reflector = NULL;
+}
+
+static pthread_once_t thread_reflector_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_reflector_key;
 
-    spvc_context ctx;
-    spvc_context_create(&ctx);
+static void destroy_thread_reflector(void *reflector) {
+    Reflector *r = reflector;
+    reflector_destroy(&r);
+}
 
-    spvc_context_set_error_callback(ctx, error_cb, NULL);
+static void create_thread_reflector_key(void) {
+    pthread_key_create(&thread_reflector_key, destroy_thread_reflector);
+}
+
+Reflector *reflector_thread(void) {
+    pthread_once(&thread_reflector_once, create_thread_reflector_key);
+    Reflector *reflector = pthread_getspecific(thread_reflector_key);
+    if (reflector == NULL) {
+        reflector = reflector_create();
+        pthread_setspecific(thread_reflector_key, reflector);
+    }
+    return reflector;
+}
+
+ReflectedStage reflector_reflect(Reflector *reflector, ArArena *arena, ArStr spv) {
+    ReflectedStage shader = {0};
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    reflector->nodes.len = 0;
+    reflector->lengths.len = 0;
+    reflector->spec_ids.len = 0;
+    reflector->names.len = 0;
 
     spvc_parsed_ir ir;
-    spvc_context_parse_spirv(ctx, (const SpvId *) spv.data, spv.len / sizeof(SpvId), &ir);
+    spvc_context_parse_spirv(reflector->context, (const SpvId *) spv.data, spv.len / sizeof(SpvId), &ir);
 
     spvc_compiler compiler;
-    spvc_context_create_compiler(ctx, SPVC_BACKEND_NONE, ir, SPVC_CAPTURE_MODE_TAKE_OWNERSHIP, &compiler);
+    spvc_context_create_compiler(reflector->context, SPVC_BACKEND_NONE, ir, SPVC_CAPTURE_MODE_TAKE_OWNERSHIP, &compiler);
+    reflector->compiler = compiler;
 
     // Reflection
     spvc_resources resources;
@@ -232,22 +617,367 @@ ReflectedStage reflect_spv(ArArena *arena, ArStr spv) {
     spvc_resource_type reflection_types[] = {
         SPVC_RESOURCE_TYPE_UNIFORM_BUFFER,
         SPVC_RESOURCE_TYPE_PUSH_CONSTANT,
-        // SPVC_RESOURCE_TYPE_STAGE_INPUT,
+        SPVC_RESOURCE_TYPE_STORAGE_BUFFER,
     };
 
+    U32 first_types[REFLECTION_INDEX_COUNT];
     for (U32 i = 0; i < ar_arrlen(reflection_types); i++) {
         const spvc_reflected_resource *list = NULL;
         spvc_resources_get_resource_list_for_type(resources, reflection_types[i], &list, &shader.count[i]);
-        shader.types[i] = ar_arena_push_arr(arena, ReflectedType, shader.count[i]);
+        first_types[i] = pool_reserve(reflector, shader.count[i]);
         for (U32 j = 0; j < shader.count[i]; j++) {
             spvc_reflected_resource resource = list[j];
             spvc_type type = spvc_compiler_get_type_handle(compiler, resource.type_id);
 
-            shader.types[i][j] = reflect(arena, compiler, type, ar_str_cstr(resource.name));
+            reflect_node(reflector, type, resource.name, true, first_types[i] + j);
         }
     }
 
-    spvc_context_destroy(ctx);
+    PendingVariable *inputs = reflect_interface(reflector, scratch.arena, resources, SPVC_RESOURCE_TYPE_STAGE_INPUT, &shader.input_count);
+    PendingVariable *outputs = reflect_interface(reflector, scratch.arena, resources, SPVC_RESOURCE_TYPE_STAGE_OUTPUT, &shader.output_count);
+
+    PendingBinding *bindings = reflect_bindings(reflector, scratch.arena, resources, &shader.binding_count);
+    reflect_workgroup_size(compiler, &shader);
+    PendingSpecConstant *spec_constants = reflect_spec_constants(reflector, scratch.arena, &shader.spec_constant_count);
+
+    // Every name is in the table now, so it's copied in one go.
+    U8 *names = ar_arena_push_no_zero(arena, reflector->names.len);
+    memcpy(names, reflector->names.data, reflector->names.len);
+
+    ReflectedType *types = finish_types(reflector, arena, names);
+    for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
+        shader.types[i] = &types[first_types[i]];
+    }
+    shader.inputs = finish_variables(arena, types, inputs, shader.input_count);
+    shader.outputs = finish_variables(arena, types, outputs, shader.output_count);
+    shader.bindings = finish_bindings(arena, names, bindings, shader.binding_count);
+    shader.spec_constants = finish_spec_constants(arena, names, spec_constants, shader.spec_constant_count);
 
+    // Frees the IR and compiler but keeps the context.
+    spvc_context_release_allocations(reflector->context);
+    reflector->compiler = NULL;
+
+    ar_scratch_release(&scratch);
     return shader;
 }
+
+ReflectedStage reflect_spv(ArArena *arena, ArStr spv) {
+    Reflector *reflector = reflector_create();
+    ReflectedStage shader = reflector_reflect(reflector, arena, spv);
+    reflector_destroy(&reflector);
+    return shader;
+}
+
+// How long each half of benchmark_reflect runs for.
+#define REFLECT_BENCH_NS 100e6
+
+static F64 time_reflect(ArStr spv, B8 reuse) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    Reflector *reflector = reflector_create();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    U64 iterations = 0;
+    F64 elapsed = 0;
+    do {
+        ArTemp temp = ar_temp_begin(scratch.arena);
+        if (reuse) {
+            reflector_reflect(reflector, temp.arena, spv);
+        } else {
+            reflect_spv(temp.arena, spv);
+        }
+        ar_temp_end(&temp);
+        iterations++;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+    } while (elapsed < REFLECT_BENCH_NS);
+
+    reflector_destroy(&reflector);
+    ar_scratch_release(&scratch);
+    return elapsed / 1e9 / iterations;
+}
+
+void benchmark_reflect(ArStr spv, F64 *reused_seconds, F64 *fresh_seconds) {
+    *reused_seconds = time_reflect(spv, true);
+    *fresh_seconds = time_reflect(spv, false);
+}
+
+static ReflectedType reflected_type_copy(ArArena *arena, ReflectedType type) {
+    ReflectedType copy = type;
+    copy.name = ar_str_push_copy(arena, type.name);
+
+    if (type.array_dimensions > 0) {
+        copy.array_dimension_lengths = ar_arena_push_arr_no_zero(arena, U32, type.array_dimensions);
+        memcpy(copy.array_dimension_lengths, type.array_dimension_lengths, type.array_dimensions * sizeof(U32));
+        copy.array_dimension_spec_ids = ar_arena_push_arr_no_zero(arena, U32, type.array_dimensions);
+        memcpy(copy.array_dimension_spec_ids, type.array_dimension_spec_ids, type.array_dimensions * sizeof(U32));
+    }
+
+    if (type.member_count > 0) {
+        copy.members = ar_arena_push_arr_no_zero(arena, ReflectedType, type.member_count);
+        for (U32 i = 0; i < type.member_count; i++) {
+            copy.members[i] = reflected_type_copy(arena, type.members[i]);
+        }
+    }
+
+    return copy;
+}
+
+static ReflectedVariable *reflected_variables_copy(ArArena *arena, const ReflectedVariable *variables, Usize count) {
+    ReflectedVariable *copy = ar_arena_push_arr_no_zero(arena, ReflectedVariable, count);
+    for (U32 i = 0; i < count; i++) {
+        copy[i].location = variables[i].location;
+        copy[i].type = reflected_type_copy(arena, variables[i].type);
+    }
+    return copy;
+}
+
+ReflectedStage reflected_stage_copy(ArArena *arena, ReflectedStage stage) {
+    ReflectedStage copy = stage;
+
+    for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
+        copy.types[i] = ar_arena_push_arr_no_zero(arena, ReflectedType, stage.count[i]);
+        for (U32 j = 0; j < stage.count[i]; j++) {
+            copy.types[i][j] = reflected_type_copy(arena, stage.types[i][j]);
+        }
+    }
+
+    copy.inputs = reflected_variables_copy(arena, stage.inputs, stage.input_count);
+    copy.outputs = reflected_variables_copy(arena, stage.outputs, stage.output_count);
+
+    copy.bindings = ar_arena_push_arr_no_zero(arena, ReflectedBinding, stage.binding_count);
+    for (U32 i = 0; i < stage.binding_count; i++) {
+        copy.bindings[i] = stage.bindings[i];
+        copy.bindings[i].name = ar_str_push_copy(arena, stage.bindings[i].name);
+    }
+
+    copy.spec_constants = ar_arena_push_arr_no_zero(arena, ReflectedSpecConstant, stage.spec_constant_count);
+    for (U32 i = 0; i < stage.spec_constant_count; i++) {
+        copy.spec_constants[i] = stage.spec_constants[i];
+        copy.spec_constants[i].name = ar_str_push_copy(arena, stage.spec_constants[i].name);
+    }
+
+    return copy;
+}
+
+B8 reflected_type_eq(ReflectedType a, ReflectedType b) {
+    if (a.data_type != b.data_type ||
+            a.array_dimensions != b.array_dimensions ||
+            a.member_count != b.member_count) {
+        return false;
+    }
+
+    for (U32 i = 0; i < a.array_dimensions; i++) {
+        if (a.array_dimension_lengths[i] != b.array_dimension_lengths[i]) {
+            return false;
+        }
+    }
+
+    for (U32 i = 0; i < a.member_count; i++) {
+        if (!reflected_type_eq(a.members[i], b.members[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void serialize_reflected_type(Buffer *buffer, ReflectedType type) {
+    buffer_push_u32(buffer, type.data_type);
+    buffer_push_str(buffer, type.name);
+    buffer_push_u32(buffer, type.array_dimensions);
+    for (U32 i = 0; i < type.array_dimensions; i++) {
+        buffer_push_u32(buffer, type.array_dimension_lengths[i]);
+        buffer_push_u32(buffer, type.array_dimension_spec_ids[i]);
+    }
+    buffer_push_u32(buffer, type.vec_size);
+    buffer_push_u32(buffer, type.cols);
+    buffer_push_u32(buffer, type.offset);
+    buffer_push_u32(buffer, type.size);
+    buffer_push_u32(buffer, type.array_stride);
+    buffer_push_u32(buffer, type.matrix_stride);
+    buffer_push_u32(buffer, type.member_count);
+    for (U32 i = 0; i < type.member_count; i++) {
+        serialize_reflected_type(buffer, type.members[i]);
+    }
+}
+
+static B8 deserialize_reflected_type(ArArena *arena, BufferReader *reader, ReflectedType *type) {
+    *type = (ReflectedType) {0};
+
+    type->data_type = buffer_read_u32(reader);
+    if (type->data_type >= REFLECTED_DATA_TYPE_COUNT) {
+        reader->error = true;
+        return false;
+    }
+    type->name = ar_str_push_copy(arena, buffer_read_str(reader));
+
+    type->array_dimensions = buffer_read_u32(reader);
+    if (reader->error || type->array_dimensions > reader->data.len) {
+        reader->error = true;
+        return false;
+    }
+    type->array_dimension_lengths = ar_arena_push_arr_no_zero(arena, U32, type->array_dimensions);
+    type->array_dimension_spec_ids = ar_arena_push_arr_no_zero(arena, U32, type->array_dimensions);
+    for (U32 i = 0; i < type->array_dimensions; i++) {
+        type->array_dimension_lengths[i] = buffer_read_u32(reader);
+        type->array_dimension_spec_ids[i] = buffer_read_u32(reader);
+    }
+
+    type->vec_size = buffer_read_u32(reader);
+    type->cols = buffer_read_u32(reader);
+    type->offset = buffer_read_u32(reader);
+    type->size = buffer_read_u32(reader);
+    type->array_stride = buffer_read_u32(reader);
+    type->matrix_stride = buffer_read_u32(reader);
+
+    type->member_count = buffer_read_u32(reader);
+    if (reader->error || type->member_count > reader->data.len) {
+        reader->error = true;
+        return false;
+    }
+    type->members = ar_arena_push_arr(arena, ReflectedType, type->member_count);
+    for (U32 i = 0; i < type->member_count; i++) {
+        if (!deserialize_reflected_type(arena, reader, &type->members[i])) {
+            return false;
+        }
+    }
+
+    return !reader->error;
+}
+
+static void serialize_reflected_variables(Buffer *buffer, const ReflectedVariable *variables, Usize count) {
+    buffer_push_u32(buffer, count);
+    for (U32 i = 0; i < count; i++) {
+        buffer_push_u32(buffer, variables[i].location);
+        serialize_reflected_type(buffer, variables[i].type);
+    }
+}
+
+static B8 deserialize_reflected_variables(ArArena *arena, BufferReader *reader, ReflectedVariable **variables, Usize *count) {
+    *count = buffer_read_u32(reader);
+    if (reader->error || *count > reader->data.len) {
+        reader->error = true;
+        return false;
+    }
+    *variables = ar_arena_push_arr(arena, ReflectedVariable, *count);
+    for (U32 i = 0; i < *count; i++) {
+        (*variables)[i].location = buffer_read_u32(reader);
+        if (!deserialize_reflected_type(arena, reader, &(*variables)[i].type)) {
+            return false;
+        }
+    }
+    return !reader->error;
+}
+
+void serialize_reflected_stage(Buffer *buffer, ReflectedStage stage) {
+    buffer_push_u32(buffer, REFLECTION_INDEX_COUNT);
+    for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
+        buffer_push_u32(buffer, stage.count[i]);
+        for (U32 j = 0; j < stage.count[i]; j++) {
+            serialize_reflected_type(buffer, stage.types[i][j]);
+        }
+    }
+
+    serialize_reflected_variables(buffer, stage.inputs, stage.input_count);
+    serialize_reflected_variables(buffer, stage.outputs, stage.output_count);
+
+    buffer_push_u32(buffer, stage.binding_count);
+    for (U32 i = 0; i < stage.binding_count; i++) {
+        ReflectedBinding binding = stage.bindings[i];
+        buffer_push_str(buffer, binding.name);
+        buffer_push_u32(buffer, binding.set);
+        buffer_push_u32(buffer, binding.binding);
+        buffer_push_u32(buffer, binding.descriptor_type);
+        buffer_push_u32(buffer, binding.count);
+    }
+
+    for (U32 i = 0; i < 3; i++) {
+        buffer_push_u32(buffer, stage.workgroup_size[i]);
+        buffer_push_u32(buffer, stage.workgroup_size_spec_ids[i]);
+    }
+
+    buffer_push_u32(buffer, stage.spec_constant_count);
+    for (U32 i = 0; i < stage.spec_constant_count; i++) {
+        ReflectedSpecConstant constant = stage.spec_constants[i];
+        buffer_push_str(buffer, constant.name);
+        buffer_push_u32(buffer, constant.id);
+        buffer_push_u32(buffer, constant.data_type);
+        buffer_push_u32(buffer, constant.boolean);
+        buffer_push_u64(buffer, constant.default_value);
+    }
+}
+
+B8 deserialize_reflected_stage(ArArena *arena, BufferReader *reader, ReflectedStage *stage) {
+    *stage = (ReflectedStage) {0};
+
+    if (buffer_read_u32(reader) != REFLECTION_INDEX_COUNT) {
+        reader->error = true;
+        return false;
+    }
+
+    for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
+        stage->count[i] = buffer_read_u32(reader);
+        if (reader->error || stage->count[i] > reader->data.len) {
+            reader->error = true;
+            return false;
+        }
+        stage->types[i] = ar_arena_push_arr(arena, ReflectedType, stage->count[i]);
+        for (U32 j = 0; j < stage->count[i]; j++) {
+            if (!deserialize_reflected_type(arena, reader, &stage->types[i][j])) {
+                return false;
+            }
+        }
+    }
+
+    if (!deserialize_reflected_variables(arena, reader, &stage->inputs, &stage->input_count) ||
+            !deserialize_reflected_variables(arena, reader, &stage->outputs, &stage->output_count)) {
+        return false;
+    }
+
+    stage->binding_count = buffer_read_u32(reader);
+    if (reader->error || stage->binding_count > reader->data.len) {
+        reader->error = true;
+        return false;
+    }
+    stage->bindings = ar_arena_push_arr(arena, ReflectedBinding, stage->binding_count);
+    for (U32 i = 0; i < stage->binding_count; i++) {
+        ReflectedBinding *binding = &stage->bindings[i];
+        binding->name = ar_str_push_copy(arena, buffer_read_str(reader));
+        binding->set = buffer_read_u32(reader);
+        binding->binding = buffer_read_u32(reader);
+        binding->descriptor_type = buffer_read_u32(reader);
+        binding->count = buffer_read_u32(reader);
+        if (binding->descriptor_type >= REFLECTED_DESCRIPTOR_TYPE_COUNT) {
+            reader->error = true;
+            return false;
+        }
+    }
+
+    for (U32 i = 0; i < 3; i++) {
+        stage->workgroup_size[i] = buffer_read_u32(reader);
+        stage->workgroup_size_spec_ids[i] = buffer_read_u32(reader);
+    }
+
+    stage->spec_constant_count = buffer_read_u32(reader);
+    if (reader->error || stage->spec_constant_count > reader->data.len) {
+        reader->error = true;
+        return false;
+    }
+    stage->spec_constants = ar_arena_push_arr(arena, ReflectedSpecConstant, stage->spec_constant_count);
+    for (U32 i = 0; i < stage->spec_constant_count; i++) {
+        ReflectedSpecConstant *constant = &stage->spec_constants[i];
+        constant->name = ar_str_push_copy(arena, buffer_read_str(reader));
+        constant->id = buffer_read_u32(reader);
+        constant->data_type = buffer_read_u32(reader);
+        constant->boolean = buffer_read_u32(reader) != 0;
+        constant->default_value = buffer_read_u64(reader);
+        if (constant->data_type >= REFLECTED_DATA_TYPE_COUNT) {
+            reader->error = true;
+            return false;
+        }
+    }
+    return !reader->error;
+}
@@ -0,0 +1,416 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Every message is a U64 length followed by the payload, integers little
+// endian, strings as written by buffer_push_str.
+//
+// Request:
+// U32 magic
+// U32 version
+// U32 OptimizeLevel
+// U32 SpvFormat
+// U32 Compression
+// U32 embed reflection
+// Str input
+// U32 path count
+// Str paths...
+//
+// Response:
+// U32 magic
+// U32 version
+// U32 RemoteStatus
+// Str header
+// Str object
+// U32 dependency count
+// Str dependencies...
+// U32 error count
+// Str errors...
+#define SERVER_MAGIC 0x56525341 // 'ASRV'
+#define SERVER_VERSION 6
+// Refuse anything larger instead of trusting the peer with the allocation.
+#define SERVER_MAX_MESSAGE_SIZE (256 << 20)
+// A client that stalls for longer is dropped instead of holding a worker.
+#define SERVER_IO_TIMEOUT_SECONDS 30
+
+typedef struct Server Server;
+struct Server {
+    I32 fd;
+    ShaderCache *cache;
+    FileCache *files;
+    ThreadPool *pool;
+};
+
+typedef struct Connection Connection;
+struct Connection {
+    Server *server;
+    I32 fd;
+};
+
+static B8 send_all(I32 fd, const void *data, U64 len) {
+    const U8 *bytes = data;
+    while (len > 0) {
+        // Don't get killed by SIGPIPE when the peer goes away.
+        I64 sent = send(fd, bytes, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static B8 recv_all(I32 fd, void *data, U64 len) {
+    U8 *bytes = data;
+    while (len > 0) {
+        I64 received = recv(fd, bytes, len, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        len -= received;
+    }
+    return true;
+}
+
+static B8 send_message(I32 fd, Buffer message) {
+    ArTemp scratch = ar_scratch_get(&message.arena, 1);
+    Buffer len = { .arena = scratch.arena };
+    buffer_push_u64(&len, message.len);
+    B8 success = send_all(fd, len.data, len.len) && send_all(fd, message.data, message.len);
+    ar_scratch_release(&scratch);
+    return success;
+}
+
+static B8 recv_message(ArArena *arena, I32 fd, BufferReader *reader) {
+    U8 len_bytes[sizeof(U64)];
+    if (!recv_all(fd, len_bytes, sizeof(len_bytes))) {
+        return false;
+    }
+    BufferReader len_reader = { .data = ar_str(len_bytes, sizeof(len_bytes)) };
+    U64 len = buffer_read_u64(&len_reader);
+    if (len > SERVER_MAX_MESSAGE_SIZE) {
+        return false;
+    }
+
+    U8 *data = ar_arena_push_arr_no_zero(arena, U8, len);
+    if (!recv_all(fd, data, len)) {
+        return false;
+    }
+    *reader = (BufferReader) { .data = ar_str(data, len) };
+    return true;
+}
+
+static B8 socket_address(ArStr path, struct sockaddr_un *addr) {
+    *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+    if (path.len >= sizeof(addr->sun_path)) {
+        ar_error("%.*s: Socket path too long.", (I32) path.len, path.data);
+        return false;
+    }
+    memcpy(addr->sun_path, path.data, path.len);
+    return true;
+}
+
+//
+// Server
+//
+
+// Errors go to the calling thread's Diagnostics, which serve_connection sends
+// to the client.
+static RemoteStatus serve_compile(Server *server, ArArena *arena, ArStr input, ArStrList paths, OptimizeLevel optimize, OutputOptions options, Buffer *header, Buffer *object, ArStrList *dependencies) {
+    // Every request gets a fresh view of which include paths have a file.
+    file_cache_refresh(server->files);
+
+    // The input content is only needed until it has been parsed.
+    FileCacheReader reader;
+    file_cache_begin_read(server->files, &reader);
+    ArStr file;
+    if (!file_cache_read(server->files, input, &file)) {
+        file_cache_end_read(server->files, &reader);
+        report_error("Failed to open file %.*s.", (I32) input.len, input.data);
+        return REMOTE_STATUS_FAILED;
+    }
+
+    ParsedShader parsed = parse_shader(arena, file, paths, server->files);
+    file_cache_end_read(server->files, &reader);
+    *dependencies = parsed.dependencies;
+    if (parsed.program_count == 0) {
+        return REMOTE_STATUS_NO_PROGRAM;
+    }
+
+    CompiledShader *programs;
+    CompileOptions compile_options = {
+        .cache = server->cache,
+        .optimize = optimize,
+        // Requests already run one per pool worker.
+        .threads = 1,
+    };
+    if (!compile_shader(arena, parsed, compile_options, &programs)) {
+        return REMOTE_STATUS_FAILED;
+    }
+
+    if (!render_header(header, programs, parsed.program_count, parsed.ctypes, options)) {
+        return REMOTE_STATUS_FAILED;
+    }
+    if (options.spv_format == SPV_FORMAT_OBJECT) {
+        render_object(object, programs, parsed.program_count, options);
+    }
+    return REMOTE_STATUS_DONE;
+}
+
+// ThreadPoolFunc handling a single request.
+static void serve_connection(ArArena *arena, void *userdata) {
+    Connection *connection = userdata;
+    ArTemp temp = ar_temp_begin(arena);
+
+    BufferReader reader;
+    if (!recv_message(temp.arena, connection->fd, &reader)) {
+        ar_error("Failed to receive request.");
+        goto done;
+    }
+
+    U32 magic = buffer_read_u32(&reader);
+    U32 version = buffer_read_u32(&reader);
+    if (magic != SERVER_MAGIC || version != SERVER_VERSION) {
+        ar_error("Ignoring request with unknown version.");
+        goto done;
+    }
+    OptimizeLevel optimize = buffer_read_u32(&reader);
+    OutputOptions options = {
+        .spv_format = buffer_read_u32(&reader),
+        .compression = buffer_read_u32(&reader),
+        .embed_reflection = buffer_read_u32(&reader) != 0,
+    };
+    ArStr input = buffer_read_str(&reader);
+    ArStrList paths = {0};
+    U32 path_count = buffer_read_u32(&reader);
+    for (U32 i = 0; i < path_count && !reader.error; i++) {
+        ar_str_list_push(temp.arena, &paths, buffer_read_str(&reader));
+    }
+    if (reader.error || optimize > OPTIMIZE_SIZE || options.spv_format > SPV_FORMAT_OBJECT || options.compression > COMPRESSION_SMOLV_LZ) {
+        ar_error("Ignoring malformed request.");
+        goto done;
+    }
+
+    Buffer header = { .arena = temp.arena };
+    Buffer object = { .arena = temp.arena };
+    ArStrList dependencies = {0};
+    Diagnostics diagnostics = { .arena = temp.arena };
+    Diagnostics *previous = diagnostics_swap(&diagnostics);
+    RemoteStatus status = serve_compile(connection->server, temp.arena, input, paths, optimize, options, &header, &object, &dependencies);
+    diagnostics_swap(previous);
+
+    Buffer response = { .arena = temp.arena };
+    buffer_push_u32(&response, SERVER_MAGIC);
+    buffer_push_u32(&response, SERVER_VERSION);
+    buffer_push_u32(&response, status);
+    buffer_push_str(&response, buffer_str(header));
+    buffer_push_str(&response, buffer_str(object));
+    U32 dependency_count = 0;
+    for (ArStrListNode *curr = dependencies.first; curr != NULL; curr = curr->next) {
+        dependency_count++;
+    }
+    buffer_push_u32(&response, dependency_count);
+    for (ArStrListNode *curr = dependencies.first; curr != NULL; curr = curr->next) {
+        buffer_push_str(&response, curr->str);
+    }
+    U32 error_count = 0;
+    for (ArStrListNode *curr = diagnostics.errors.first; curr != NULL; curr = curr->next) {
+        error_count++;
+    }
+    buffer_push_u32(&response, error_count);
+    for (ArStrListNode *curr = diagnostics.errors.first; curr != NULL; curr = curr->next) {
+        buffer_push_str(&response, curr->str);
+    }
+
+    if (!send_message(connection->fd, response)) {
+        ar_error("%.*s: Failed to send response.", (I32) input.len, input.data);
+    }
+
+done:
+    close(connection->fd);
+    free(connection);
+    ar_temp_end(&temp);
+}
+
+static I32 listen_on(ArStr path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        return -1;
+    }
+
+    // Remove a socket left behind by a previous server, but nothing else.
+    struct stat st;
+    if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(addr.sun_path);
+    }
+
+    I32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        ar_error("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Only the owner may connect, the server reads any file it can on behalf
+    // of its clients.
+    mode_t previous_umask = umask(0177);
+    B8 bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(previous_umask);
+    if (!bound || listen(fd, 64) == -1) {
+        ar_error("%s: Failed to listen: %s", addr.sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+B8 run_server(ArArena *arena, Options options) {
+    (void) arena;
+
+    I32 fd = listen_on(options.server);
+    if (fd == -1) {
+        return false;
+    }
+
+    Server server = {
+        .fd = fd,
+        .files = file_cache_create(),
+        .pool = thread_pool_create(options.jobs),
+    };
+    if (options.cache_dir.len != 0) {
+        server.cache = shader_cache_create(options.cache_dir, options.cache_size);
+    }
+
+    ar_info("Listening on %.*s with %u workers.",
+            (I32) options.server.len, options.server.data,
+            thread_pool_worker_count(server.pool));
+
+    while (true) {
+        I32 client = accept(fd, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            ar_error("Failed to accept connection: %s", strerror(errno));
+            break;
+        }
+
+        struct timeval timeout = { .tv_sec = SERVER_IO_TIMEOUT_SECONDS };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Connection *connection = malloc(sizeof(Connection));
+        if (connection == NULL) {
+            ar_error("Out of memory, dropping connection.");
+            close(client);
+            continue;
+        }
+        *connection = (Connection) {
+            .server = &server,
+            .fd = client,
+        };
+        thread_pool_submit(server.pool, serve_connection, connection);
+    }
+
+    thread_pool_wait(server.pool);
+    thread_pool_destroy(&server.pool);
+    if (server.cache != NULL) {
+        shader_cache_destroy(&server.cache);
+    }
+    file_cache_destroy(&server.files);
+    close(fd);
+    return false;
+}
+
+//
+// Client
+//
+
+B8 compile_remote(ArArena *arena, ArStr socket_path, ArStr input, ArStrList paths, OptimizeLevel optimize, OutputOptions options, RemoteResult *result) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path, &addr)) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    I32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        ar_error("%s: Failed to connect to server: %s", addr.sun_path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    U32 path_count = 0;
+    for (ArStrListNode *curr = paths.first; curr != NULL; curr = curr->next) {
+        path_count++;
+    }
+
+    Buffer request = { .arena = scratch.arena };
+    buffer_push_u32(&request, SERVER_MAGIC);
+    buffer_push_u32(&request, SERVER_VERSION);
+    buffer_push_u32(&request, optimize);
+    buffer_push_u32(&request, options.spv_format);
+    buffer_push_u32(&request, options.compression);
+    buffer_push_u32(&request, options.embed_reflection);
+    buffer_push_str(&request, canonicalize(scratch.arena, input));
+    buffer_push_u32(&request, path_count);
+    for (ArStrListNode *curr = paths.first; curr != NULL; curr = curr->next) {
+        buffer_push_str(&request, canonicalize(scratch.arena, curr->str));
+    }
+
+    BufferReader reader;
+    if (!send_message(fd, request) || !recv_message(scratch.arena, fd, &reader)) {
+        ar_error("%.*s: Lost connection to server.", (I32) input.len, input.data);
+        close(fd);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+    close(fd);
+
+    U32 magic = buffer_read_u32(&reader);
+    U32 version = buffer_read_u32(&reader);
+    *result = (RemoteResult) {
+        .status = buffer_read_u32(&reader),
+        .header = ar_str_push_copy(arena, buffer_read_str(&reader)),
+        .object = ar_str_push_copy(arena, buffer_read_str(&reader)),
+    };
+    U32 dependency_count = buffer_read_u32(&reader);
+    for (U32 i = 0; i < dependency_count && !reader.error; i++) {
+        ar_str_list_push(arena, &result->dependencies, ar_str_push_copy(arena, buffer_read_str(&reader)));
+    }
+    U32 error_count = buffer_read_u32(&reader);
+    for (U32 i = 0; i < error_count && !reader.error; i++) {
+        ar_str_list_push(arena, &result->errors, ar_str_push_copy(arena, buffer_read_str(&reader)));
+    }
+
+    if (reader.error || magic != SERVER_MAGIC || version != SERVER_VERSION || result->status >= REMOTE_STATUS_COUNT) {
+        ar_error("%.*s: Malformed response from server.", (I32) input.len, input.data);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    ar_scratch_release(&scratch);
+    return true;
+}
@@ -4,6 +4,14 @@
 #include "arkin_log.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char *ar_str_to_cstr(ArArena *arena, ArStr str) {
     char *cstr = ar_arena_push_no_zero(arena, str.len + 1);
@@ -12,26 +20,257 @@ char *ar_str_to_cstr(ArArena *arena, ArStr str) {
     return cstr;
 }
 
+void buffer_reserve(Buffer *buffer, U64 len) {
+    if (buffer->len + len <= buffer->cap) {
+        return;
+    }
+
+    U64 cap = buffer->cap == 0 ? 4096 : buffer->cap;
+    while (cap < buffer->len + len) {
+        cap *= 2;
+    }
+
+    U8 *data = ar_arena_push_no_zero(buffer->arena, cap);
+    if (buffer->len > 0) {
+        memcpy(data, buffer->data, buffer->len);
+    }
+    buffer->data = data;
+    buffer->cap = cap;
+}
+
+void buffer_push(Buffer *buffer, const void *data, U64 len) {
+    // 'data' may be NULL for empty pushes, which memcpy doesn't allow.
+    if (len == 0) {
+        return;
+    }
+    buffer_reserve(buffer, len);
+    memcpy(&buffer->data[buffer->len], data, len);
+    buffer->len += len;
+}
+
+void buffer_push_u32(Buffer *buffer, U32 value) {
+    U8 bytes[4];
+    for (U32 i = 0; i < 4; i++) {
+        bytes[i] = value >> (i*8);
+    }
+    buffer_push(buffer, bytes, sizeof(bytes));
+}
+
+void buffer_push_u64(Buffer *buffer, U64 value) {
+    buffer_push_u32(buffer, value);
+    buffer_push_u32(buffer, value >> 32);
+}
+
+void buffer_push_str(Buffer *buffer, ArStr str) {
+    buffer_push_u32(buffer, str.len);
+    buffer_push(buffer, str.data, str.len);
+}
+
+void buffer_pushf(Buffer *buffer, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    I32 len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    // vsnprintf always writes a terminator, reserve room for it and drop it.
+    buffer_reserve(buffer, len + 1);
+    va_start(args, fmt);
+    vsnprintf((char *) &buffer->data[buffer->len], len + 1, fmt, args);
+    va_end(args);
+    buffer->len += len;
+}
+
+static __thread Diagnostics *thread_diagnostics;
+
+Diagnostics *diagnostics_swap(Diagnostics *diagnostics) {
+    Diagnostics *previous = thread_diagnostics;
+    thread_diagnostics = diagnostics;
+    return previous;
+}
+
+Diagnostics *diagnostics_current(void) {
+    return thread_diagnostics;
+}
+
+B8 diagnostics_report(const char *fmt, ...) {
+    Diagnostics *diagnostics = thread_diagnostics;
+    if (diagnostics == NULL) {
+        return false;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    I32 len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    char *message = ar_arena_push_no_zero(diagnostics->arena, len + 1);
+    va_start(args, fmt);
+    vsnprintf(message, len + 1, fmt, args);
+    va_end(args);
+    ar_str_list_push(diagnostics->arena, &diagnostics->errors, ar_str((U8 *) message, len));
+    return true;
+}
+
+ArStr buffer_str(Buffer buffer) {
+    return ar_str(buffer.data, buffer.len);
+}
+
+const U8 *buffer_read(BufferReader *reader, U64 len) {
+    if (reader->error || reader->data.len - reader->offset < len) {
+        reader->error = true;
+        return NULL;
+    }
+    const U8 *data = &reader->data.data[reader->offset];
+    reader->offset += len;
+    return data;
+}
+
+U32 buffer_read_u32(BufferReader *reader) {
+    const U8 *bytes = buffer_read(reader, 4);
+    if (bytes == NULL) {
+        return 0;
+    }
+    return (U32) bytes[0] | (U32) bytes[1] << 8 | (U32) bytes[2] << 16 | (U32) bytes[3] << 24;
+}
+
+U64 buffer_read_u64(BufferReader *reader) {
+    U64 low = buffer_read_u32(reader);
+    U64 high = buffer_read_u32(reader);
+    return low | high << 32;
+}
+
+ArStr buffer_read_str(BufferReader *reader) {
+    U32 len = buffer_read_u32(reader);
+    const U8 *data = buffer_read(reader, len);
+    if (data == NULL) {
+        return (ArStr) {0};
+    }
+    return ar_str(data, len);
+}
+
+U64 hash_str(const void *key, U64 len) {
+    (void) len;
+    const ArStr *_key = key;
+    return ar_fvn1a_hash(_key->data, _key->len);
+}
+
+B8 str_eq(const void *a, const void *b, U64 len) {
+    (void) len;
+    const ArStr *_a = a;
+    const ArStr *_b = b;
+    return ar_str_match(*_a, *_b, AR_STR_MATCH_FLAG_EXACT);
+}
+
 ArStr read_file(ArArena *arena, ArStr path) {
-    ArTemp temp = ar_temp_begin(arena);
-    const char *cstr_path = ar_str_to_cstr(temp.arena, path);
-    FILE *fp = fopen(cstr_path, "rb");
-    ar_temp_end(&temp);
-    if (fp == NULL) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    const char *cstr_path = ar_str_to_cstr(scratch.arena, path);
+    I32 fd = open(cstr_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
         ar_error("Failed to open file %s.", cstr_path);
+        if (fd != -1) {
+            close(fd);
+        }
+        ar_scratch_release(&scratch);
         return (ArStr) {0};
     }
 
-    fseek(fp, 0, SEEK_END);
-    U64 len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    U8 *buffer = ar_arena_push_no_zero(arena, st.st_size);
+    U64 len = 0;
+    while (len < (U64) st.st_size) {
+        I64 bytes_read = read(fd, &buffer[len], st.st_size - len);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        len += bytes_read;
+    }
+    close(fd);
 
-    U8 *buffer = ar_arena_push_no_zero(arena, len);
-    fread(buffer, 1, len, fp);
+    ar_scratch_release(&scratch);
+    return ar_str(buffer, len);
+}
 
-    fclose(fp);
+B8 map_file(ArStr path, MappedFile *file) {
+    *file = (MappedFile) {0};
 
-    return ar_str(buffer, len);
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    I32 fd = open(ar_str_to_cstr(scratch.arena, path), O_RDONLY | O_CLOEXEC);
+    ar_scratch_release(&scratch);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    // Zero length mappings aren't allowed.
+    if (st.st_size == 0) {
+        close(fd);
+        file->content = ar_str_lit("");
+        return true;
+    }
+
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    file->content = ar_str(mapping, st.st_size);
+    file->mapping = mapping;
+    return true;
+}
+
+void unmap_file(MappedFile *file) {
+    if (file->mapping != NULL) {
+        munmap(file->mapping, file->content.len);
+    }
+    *file = (MappedFile) {0};
+}
+
+B8 write_file(const char *filepath, ArStr content) {
+    I32 fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        ar_error("Failed to open file %s.", filepath);
+        return false;
+    }
+
+    // A single write unless interrupted or the file system splits it.
+    B8 success = true;
+    U64 offset = 0;
+    while (offset < content.len) {
+        I64 written = write(fd, &content.data[offset], content.len - offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            success = false;
+            break;
+        }
+        offset += written;
+    }
+    success &= close(fd) == 0;
+    if (!success) {
+        ar_error("Failed to write file %s.", filepath);
+    }
+    return success;
+}
+
+ArStr canonicalize(ArArena *arena, ArStr path) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    char *resolved = realpath(ar_str_to_cstr(scratch.arena, path), NULL);
+    ar_scratch_release(&scratch);
+
+    if (resolved == NULL) {
+        return ar_str_push_copy(arena, path);
+    }
+    ArStr result = ar_str_push_copy(arena, ar_str_cstr(resolved));
+    free(resolved);
+    return result;
 }
 
 ArStr dirname(ArStr filepath) {
@@ -62,6 +301,80 @@ ArStr dirname(ArStr filepath) {
     return new_path;
 }
 
+ArStr stem(ArStr filepath) {
+    while (filepath.len > 1 && filepath.data[filepath.len - 1] == '/') {
+        filepath.len--;
+    }
+
+    U64 last_slash = ar_str_find_char(filepath, '/', AR_STR_MATCH_FLAG_LAST);
+    if (last_slash != filepath.len) {
+        filepath = ar_str_chop_start(filepath, last_slash + 1);
+    }
+
+    U64 last_dot = ar_str_find_char(filepath, '.', AR_STR_MATCH_FLAG_LAST);
+    if (last_dot != filepath.len && last_dot != 0) {
+        filepath = ar_str_chop_end(filepath, filepath.len - last_dot);
+    }
+
+    return filepath;
+}
+
+B8 is_directory(ArStr path) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    struct stat st;
+    B8 result = stat(ar_str_to_cstr(scratch.arena, path), &st) == 0 && S_ISDIR(st.st_mode);
+    ar_scratch_release(&scratch);
+    return result;
+}
+
+B8 make_directory(ArStr path) {
+    if (path.len == 0 || is_directory(path)) {
+        return true;
+    }
+
+    ArStr parent = dirname(path);
+    if (!ar_str_match(parent, path, AR_STR_MATCH_FLAG_EXACT) && !make_directory(parent)) {
+        return false;
+    }
+
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    const char *cstr_path = ar_str_to_cstr(scratch.arena, path);
+    B8 result = mkdir(cstr_path, 0755) == 0 || errno == EEXIST;
+    if (!result) {
+        ar_error("Failed to create directory %s.", cstr_path);
+    }
+    ar_scratch_release(&scratch);
+
+    return result;
+}
+
+void collect_files(ArArena *arena, ArStrList *list, ArStr dir, ArStr extension) {
+    const char *cstr_dir = ar_str_to_cstr(arena, dir);
+    DIR *d = opendir(cstr_dir);
+    if (d == NULL) {
+        ar_error("Failed to open directory %s.", cstr_dir);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        ArStr name = ar_str_cstr(entry->d_name);
+        if (name.data[0] == '.') {
+            continue;
+        }
+
+        ArStr path = ar_str_pushf(arena, "%.*s/%.*s", (I32) dir.len, dir.data, (I32) name.len, name.data);
+        if (is_directory(path)) {
+            collect_files(arena, list, path, extension);
+        } else if (name.len > extension.len &&
+                ar_str_match(ar_str_chop_start(name, name.len - extension.len), extension, AR_STR_MATCH_FLAG_EXACT)) {
+            ar_str_list_push(arena, list, path);
+        }
+    }
+
+    closedir(d);
+}
+
 void test_dirname(void) {
     ArTemp scratch = ar_scratch_get(NULL, 0);
 
@@ -0,0 +1,258 @@
+#include "arkin_core.h"
+#include "internal.h"
+
+#include "arkin_log.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+// Events arriving this close together are handled as one change. Editors
+// often write a file in several steps.
+#define DEBOUNCE_MS 10
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE)
+
+typedef struct JobRef JobRef;
+struct JobRef {
+    JobRef *next;
+    U64 index;
+};
+
+typedef struct JobRefList JobRefList;
+struct JobRefList {
+    JobRef *first;
+};
+
+typedef struct Watch Watch;
+struct Watch {
+    // Lives for the whole session.
+    ArArena *arena;
+    I32 fd;
+    // Canonical directory -> watch descriptor.
+    ArHashMap *dirs;
+    // Watch descriptor -> canonical directory.
+    ArHashMap *wds;
+
+    // Rebuilt after every compile.
+    ArArena *graph_arena;
+    // Canonical file path -> JobRefList of every job depending on it.
+    ArHashMap *graph;
+
+    Batch *batch;
+};
+
+static U64 hash_i32(const void *key, U64 len) {
+    (void) len;
+    return ar_fvn1a_hash(key, sizeof(I32));
+}
+
+static B8 i32_eq(const void *a, const void *b, U64 len) {
+    (void) len;
+    return *(const I32 *) a == *(const I32 *) b;
+}
+
+static void watch_dir(Watch *watch, ArStr dir) {
+    I32 existing = ar_hash_map_get(watch->dirs, dir, I32);
+    if (existing != -1) {
+        return;
+    }
+
+    ArTemp scratch = ar_scratch_get(&watch->arena, 1);
+    I32 wd = inotify_add_watch(watch->fd, ar_str_to_cstr(scratch.arena, dir), WATCH_MASK);
+    ar_scratch_release(&scratch);
+    if (wd == -1) {
+        ar_error("Failed to watch %.*s: %s", (I32) dir.len, dir.data, strerror(errno));
+        return;
+    }
+
+    dir = ar_str_push_copy(watch->arena, dir);
+    ar_hash_map_insert(watch->dirs, dir, wd);
+    ar_hash_map_insert(watch->wds, wd, dir);
+}
+
+static void add_dependency(Watch *watch, ArStr path, U64 job) {
+    ArStr canonical = canonicalize(watch->graph_arena, path);
+
+    JobRefList *list = ar_hash_map_get(watch->graph, canonical, JobRefList *);
+    if (list == NULL) {
+        list = ar_arena_push_arr(watch->graph_arena, JobRefList, 1);
+        ar_hash_map_insert(watch->graph, canonical, list);
+    }
+
+    // Jobs are added in order so a repeated dependency is always at the front.
+    if (list->first != NULL && list->first->index == job) {
+        return;
+    }
+    JobRef *ref = ar_arena_push_arr(watch->graph_arena, JobRef, 1);
+    ref->index = job;
+    ar_sll_stack_push(list->first, ref);
+
+    watch_dir(watch, dirname(canonical));
+}
+
+// The graph outlives build_graph so its null value can't be a compound literal.
+static JobRefList *const NULL_JOB_REF_LIST = NULL;
+
+static void build_graph(Watch *watch) {
+    if (watch->graph_arena != NULL) {
+        ar_arena_destroy(&watch->graph_arena);
+    }
+    watch->graph_arena = ar_arena_create_default();
+    watch->graph = ar_hash_map_init((ArHashMapDesc) {
+            .arena = watch->graph_arena,
+            .capacity = watch->batch->job_count * 8,
+
+            .hash_func = hash_str,
+            .eq_func = str_eq,
+
+            .key_size = sizeof(ArStr),
+            .value_size = sizeof(JobRefList *),
+            .null_value = &NULL_JOB_REF_LIST,
+        });
+
+    for (U64 i = 0; i < watch->batch->job_count; i++) {
+        BatchJob *job = &watch->batch->jobs[i];
+        add_dependency(watch, job->input, i);
+        for (ArStrListNode *curr = job->dependencies.first; curr != NULL; curr = curr->next) {
+            add_dependency(watch, curr->str, i);
+        }
+    }
+}
+
+// Marks every job depending on the changed files as pending. Returns the
+// number of newly marked jobs.
+static U64 handle_events(Watch *watch, const U8 *buffer, U64 len) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+
+    U64 marked = 0;
+    U64 offset = 0;
+    while (offset < len) {
+        const struct inotify_event *event = (const struct inotify_event *) &buffer[offset];
+        offset += sizeof(struct inotify_event) + event->len;
+
+        if (event->len == 0) {
+            continue;
+        }
+
+        ArStr dir = ar_hash_map_get(watch->wds, event->wd, ArStr);
+        ArStr path = ar_str_pushf(scratch.arena, "%.*s/%s", (I32) dir.len, dir.data, event->name);
+        JobRefList *list = ar_hash_map_get(watch->graph, path, JobRefList *);
+        if (list == NULL) {
+            continue;
+        }
+
+        for (JobRef *ref = list->first; ref != NULL; ref = ref->next) {
+            BatchJob *job = &watch->batch->jobs[ref->index];
+            if (job->status != BATCH_STATUS_PENDING) {
+                job->status = BATCH_STATUS_PENDING;
+                marked++;
+            }
+        }
+    }
+
+    ar_scratch_release(&scratch);
+    return marked;
+}
+
+static F64 elapsed_ms(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+B8 watch_batch(ArArena *arena, Options options) {
+    Batch batch;
+    if (!batch_create(arena, options, &batch)) {
+        return false;
+    }
+
+    for (U64 i = 0; i < batch.job_count; i++) {
+        batch.jobs[i].dependency_arena = ar_arena_create_default();
+    }
+
+    Watch watch = {
+        .arena = ar_arena_create_default(),
+        .fd = inotify_init1(IN_CLOEXEC),
+        .batch = &batch,
+    };
+    if (watch.fd == -1) {
+        ar_error("Failed to initialize inotify: %s", strerror(errno));
+        ar_arena_destroy(&watch.arena);
+        batch_destroy(&batch);
+        return false;
+    }
+
+    watch.dirs = ar_hash_map_init((ArHashMapDesc) {
+            .arena = watch.arena,
+            .capacity = 256,
+
+            .hash_func = hash_str,
+            .eq_func = str_eq,
+
+            .key_size = sizeof(ArStr),
+            .value_size = sizeof(I32),
+            .null_value = &(I32) {-1},
+        });
+    watch.wds = ar_hash_map_init((ArHashMapDesc) {
+            .arena = watch.arena,
+            .capacity = 256,
+
+            .hash_func = hash_i32,
+            .eq_func = i32_eq,
+
+            .key_size = sizeof(I32),
+            .value_size = sizeof(ArStr),
+            .null_value = &(ArStr) {0},
+        });
+
+    batch_run(&batch);
+    build_graph(&watch);
+    ar_info("Watching %llu input(s) for changes.", (unsigned long long) batch.job_count);
+
+    // Large enough for several events with maximum length names. U32 keeps
+    // the events aligned.
+    U32 buffer[16 * 1024];
+
+    while (true) {
+        struct pollfd pfd = { .fd = watch.fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ar_error("Failed to poll inotify: %s", strerror(errno));
+            break;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        U64 marked = 0;
+        while (poll(&pfd, 1, DEBOUNCE_MS) > 0) {
+            I64 len = read(watch.fd, buffer, sizeof(buffer));
+            if (len <= 0) {
+                break;
+            }
+            marked += handle_events(&watch, (const U8 *) buffer, len);
+        }
+
+        if (marked == 0) {
+            continue;
+        }
+
+        batch_run(&batch);
+        build_graph(&watch);
+
+        ar_info("Rebuilt %llu program(s) in %.1f ms.", (unsigned long long) marked, elapsed_ms(start));
+    }
+
+    close(watch.fd);
+    ar_arena_destroy(&watch.graph_arena);
+    ar_arena_destroy(&watch.arena);
+    batch_destroy(&batch);
+    return false;
+}